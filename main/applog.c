@@ -0,0 +1,230 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include <stdatomic.h>
+#include <string.h>
+#include <strings.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "global.h"
+
+#include "applog.h"
+#include "tasks.h"
+
+#define APPLOG_RING_MASK (APPLOG_RING_SIZE - 1)
+#define APPLOG_MAX_TAG_LEN 24
+
+_Static_assert((APPLOG_RING_SIZE & APPLOG_RING_MASK) == 0, "APPLOG_RING_SIZE must be a power of two");
+
+// Bounded MPMC queue (Vyukov). A slot is free for the producer at position pos when its
+// sequence equals pos and holds a record for the consumer when it equals pos + 1.
+// Producers claim a position with a CAS and never wait on each other.
+typedef struct applog_slot_t {
+    atomic_uint sequence;
+    uint32_t timestamp_ms;
+    esp_log_level_t level;
+    const char* tag;
+    const char* format;
+    uint32_t args[APPLOG_MAX_ARGS];
+} applog_slot;
+
+typedef struct applog_tag_level_t {
+    char tag[APPLOG_MAX_TAG_LEN];
+    esp_log_level_t level;
+} applog_tag_level;
+
+typedef struct applog_config_t {
+    applog_slot ring[APPLOG_RING_SIZE];
+    atomic_uint enqueue_pos;
+    unsigned int dequeue_pos; // single consumer, the applog task
+    atomic_uint dropped;
+    uint32_t dropped_reported;
+
+    applog_tag_level tag_levels[APPLOG_MAX_TAG_LEVELS];
+    volatile size_t tag_level_count;
+    volatile esp_log_level_t default_level;
+} applog_config;
+
+static applog_config _config;
+
+static const char* const _level_names[] = {
+    [ESP_LOG_NONE] = "none",
+    [ESP_LOG_ERROR] = "error",
+    [ESP_LOG_WARN] = "warn",
+    [ESP_LOG_INFO] = "info",
+    [ESP_LOG_DEBUG] = "debug",
+    [ESP_LOG_VERBOSE] = "verbose",
+};
+
+void init_applog(void)
+{
+    for (unsigned int i = 0; i < APPLOG_RING_SIZE; i++) {
+        atomic_init(&_config.ring[i].sequence, i);
+    }
+    atomic_init(&_config.enqueue_pos, 0);
+    atomic_init(&_config.dropped, 0);
+    _config.dequeue_pos = 0;
+    _config.dropped_reported = 0;
+    _config.tag_level_count = 0;
+    _config.default_level = ESP_LOG_INFO;
+}
+
+bool applog_is_enabled(const char* tag, esp_log_level_t level)
+{
+    size_t count = _config.tag_level_count;
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(_config.tag_levels[i].tag, tag) == 0) {
+            return level <= _config.tag_levels[i].level;
+        }
+    }
+    return level <= _config.default_level;
+}
+
+void applog_record(esp_log_level_t level, const char* tag, const char* format, const uint32_t* args)
+{
+    if (!applog_is_enabled(tag, level)) {
+        return;
+    }
+
+    applog_slot* slot;
+    unsigned int pos = atomic_load_explicit(&_config.enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        slot = &_config.ring[pos & APPLOG_RING_MASK];
+        unsigned int sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int diff = (int)(sequence - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&_config.enqueue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&_config.dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&_config.enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    // esp_log_timestamp() is not safe from an ISR, esp_timer is
+    slot->timestamp_ms = (uint32_t)(esp_timer_get_time() / 1000);
+    slot->level = level;
+    slot->tag = tag;
+    slot->format = format;
+    memcpy(slot->args, args, sizeof slot->args);
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+}
+
+static bool applog_drain_one(void)
+{
+    unsigned int pos = _config.dequeue_pos;
+    applog_slot* slot = &_config.ring[pos & APPLOG_RING_MASK];
+    unsigned int sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if (sequence != pos + 1) {
+        return false;
+    }
+
+    // Formats were built with LOG_FORMAT, same layout as ESP_LOGx output
+    esp_log_write(slot->level, slot->tag, slot->format, slot->timestamp_ms, slot->tag,
+        slot->args[0], slot->args[1], slot->args[2], slot->args[3]);
+
+    atomic_store_explicit(&slot->sequence, pos + APPLOG_RING_SIZE, memory_order_release);
+    _config.dequeue_pos = pos + 1;
+    return true;
+}
+
+static void applog_task(void* arg)
+{
+    UNUSED(arg);
+    for (;;) {
+        while (applog_drain_one()) {
+        }
+
+        uint32_t dropped = atomic_load_explicit(&_config.dropped, memory_order_relaxed);
+        if (dropped != _config.dropped_reported) {
+            ESP_LOGW(LOG_TAG_APPLOG, "%u log records dropped, ring full", dropped - _config.dropped_reported);
+            _config.dropped_reported = dropped;
+        }
+
+        // Polling keeps the producer side free of any notify/wake cost
+        vTaskDelay(APPLOG_DRAIN_INTERVAL_MS / portTICK_PERIOD_MS);
+    }
+}
+
+void start_applog(void)
+{
+    app_task_start(APP_TASK_APPLOG, applog_task, NULL);
+}
+
+void applog_set_level(const char* tag, esp_log_level_t level)
+{
+    esp_log_level_set(tag, level);
+
+    if (strcmp(tag, "*") == 0) {
+        _config.tag_level_count = 0;
+        _config.default_level = level;
+        ESP_LOGI(LOG_TAG_APPLOG, "default log level set to %s", _level_names[level]);
+        return;
+    }
+
+    size_t count = _config.tag_level_count;
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(_config.tag_levels[i].tag, tag) == 0) {
+            _config.tag_levels[i].level = level;
+            ESP_LOGI(LOG_TAG_APPLOG, "log level of %s set to %s", tag, _level_names[level]);
+            return;
+        }
+    }
+
+    if (count == APPLOG_MAX_TAG_LEVELS || strlen(tag) >= APPLOG_MAX_TAG_LEN) {
+        ESP_LOGE(LOG_TAG_APPLOG, "cannot track log level of %s, deferred records use the default", tag);
+        return;
+    }
+
+    // Fill the entry before publishing it, applog_is_enabled reads without a lock
+    strcpy(_config.tag_levels[count].tag, tag);
+    _config.tag_levels[count].level = level;
+    _config.tag_level_count = count + 1;
+    ESP_LOGI(LOG_TAG_APPLOG, "log level of %s set to %s", tag, _level_names[level]);
+}
+
+bool applog_parse_level(const char* str, int len, esp_log_level_t* level)
+{
+    for (size_t i = 0; i < sizeof _level_names / sizeof _level_names[0]; i++) {
+        if ((int)strlen(_level_names[i]) == len && strncasecmp(str, _level_names[i], len) == 0) {
+            *level = (esp_log_level_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t applog_get_dropped(void)
+{
+    return atomic_load_explicit(&_config.dropped, memory_order_relaxed);
+}
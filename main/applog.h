@@ -0,0 +1,66 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#ifndef APPLOG_H
+#define APPLOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_log.h"
+
+#define APPLOG_MAX_ARGS 4
+
+// Deferred logging for hot paths, including ISRs. The call site only copies the format
+// string pointer and up to APPLOG_MAX_ARGS 32-bit arguments into a lock-free ring, the
+// applog task formats them later onto UART. So arguments have to fit in 32 bits (no %llu,
+// no floats) and %s arguments must point to strings that outlive the call, i.e. literals.
+// When the ring is full records are dropped and counted, the caller never waits.
+#define APPLOG(level, letter, tag, format, ...) do {                        \
+        if (LOG_LOCAL_LEVEL >= (level)) {                                   \
+            const uint32_t _applog_args[APPLOG_MAX_ARGS] = { __VA_ARGS__ }; \
+            applog_record((level), (tag), LOG_FORMAT(letter, format), _applog_args); \
+        }                                                                   \
+    } while (0)
+
+#define APPLOG_E(tag, format, ...) APPLOG(ESP_LOG_ERROR, E, tag, format, ##__VA_ARGS__)
+#define APPLOG_W(tag, format, ...) APPLOG(ESP_LOG_WARN, W, tag, format, ##__VA_ARGS__)
+#define APPLOG_I(tag, format, ...) APPLOG(ESP_LOG_INFO, I, tag, format, ##__VA_ARGS__)
+#define APPLOG_D(tag, format, ...) APPLOG(ESP_LOG_DEBUG, D, tag, format, ##__VA_ARGS__)
+#define APPLOG_V(tag, format, ...) APPLOG(ESP_LOG_VERBOSE, V, tag, format, ##__VA_ARGS__)
+
+void init_applog(void);
+void start_applog(void);
+
+void applog_record(esp_log_level_t level, const char* tag, const char* format, const uint32_t* args);
+
+// Applies to both deferred and regular ESP_LOGx logging. Tag "*" sets the default level
+// and clears all per-tag levels
+void applog_set_level(const char* tag, esp_log_level_t level);
+bool applog_is_enabled(const char* tag, esp_log_level_t level);
+bool applog_parse_level(const char* str, int len, esp_log_level_t* level);
+
+uint32_t applog_get_dropped(void);
+
+#endif
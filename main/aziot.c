@@ -25,14 +25,17 @@
  **************************************************************************/
 // <END LICENSE>
 
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 
 #include "azure_c_shared_utility/crt_abstractions.h"
 #include "azure_c_shared_utility/platform.h"
@@ -44,7 +47,16 @@
 #include "iothub_message.h"
 #include "iothubtransportmqtt.h"
 
+#include "cJSON.h"
+#include "esp_ota_ops.h"
+
 #include "global.h"
+#include "applog.h"
+#include "aziot.h"
+#include "datalink.h"
+#include "devicecontrollogic.h"
+#include "tasks.h"
+#include "transport.h"
 #include "creddef.h"
 
 #ifdef MBED_BUILD_TIMESTAMP
@@ -56,11 +68,42 @@
 #endif // SET_TRUSTED_CERT_IN_SAMPLES
 
 
+typedef enum aziot_reported_type_t {
+    AZIOT_REPORTED_BOOL,
+    AZIOT_REPORTED_INT,
+    AZIOT_REPORTED_STRING,
+} aziot_reported_type;
+
+typedef struct aziot_reported_property_t {
+    char path[AZIOT_TWIN_PATH_MAX_LEN];
+    aziot_reported_type type;
+    union {
+        bool value_bool;
+        int value_int;
+        char value_str[AZIOT_REPORTED_STRING_MAX_LEN];
+    };
+    bool dirty;
+} aziot_reported_property;
+
 typedef struct aziot_config_t {
     IOTHUB_CLIENT_LL_HANDLE iothub_client_handle;
+    atomic_int pending_count; // sent but not confirmed yet
+    volatile int64_t connected_since_us; // 0 while not authenticated
+    int64_t disconnected_since_us;
+
+    // last known value of every reported property, set from any task, sent by the aziot task
+    portMUX_TYPE reported_lock;
+    aziot_reported_property reported[AZIOT_REPORTED_MAX_PROPERTIES];
+    size_t reported_count;
+    int64_t reported_dirty_since_us; // 0 if nothing to send
+
+    int desired_version; // last desired $version applied
 } aziot_config;
 
-static aziot_config _config;
+static aziot_config _config = {
+    .reported_lock = portMUX_INITIALIZER_UNLOCKED,
+    .desired_version = -1,
+};
 static const char* aziothub_connection_string = AZIOTHUB_CONNSTR;
 
 
@@ -87,51 +130,355 @@ static IOTHUBMESSAGE_DISPOSITION_RESULT aziot_receive_message_callback(IOTHUB_ME
         ESP_LOGE(LOG_TAG_AZIOT, "unable to retrieve downlink message");
     } else {
         ESP_LOGI(LOG_TAG_AZIOT, "received downlink message, msg id: %s, correlation id: %s, size %d", message_id, correlation_id, size);
-        ESP_LOGE(LOG_TAG_AZIOT, "downlink message processing not implemented");
-    }
 
-    MAP_HANDLE map_properties = IoTHubMessage_Properties(message);
-    if (map_properties != NULL) {
-        const char* const* keys;
-        const char* const* values;
-        size_t property_count = 0;
-        if (Map_GetInternals(map_properties, &keys, &values, &property_count) != MAP_OK) {
+        // same config topics and handlers as MQTT downlinks
+        const char* topic = IoTHubMessage_GetProperty(message, AZIOT_C2D_TOPIC_PROPERTY);
+        if (topic == NULL) {
+            ESP_LOGE(LOG_TAG_AZIOT, "downlink message without %s property rejected", AZIOT_C2D_TOPIC_PROPERTY);
+            return IOTHUBMESSAGE_REJECTED;
+        }
+        if (!datalink_process_config(topic, strlen(topic), buffer, size)) {
+            return IOTHUBMESSAGE_REJECTED;
         }
     }
 
     return IOTHUBMESSAGE_ACCEPTED;
 }
 
+typedef struct aziot_sent_context_t {
+    IOTHUB_MESSAGE_HANDLE handle;
+    void (*on_settled)(bool delivered, void* context);
+    void* context;
+} aziot_sent_context;
+
 static void aziot_message_sent_confirmation(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void* user_context_callback)
 {
-    IOTHUB_MESSAGE_HANDLE handle = (IOTHUB_MESSAGE_HANDLE)user_context_callback;
+    aziot_sent_context* sent = (aziot_sent_context*)user_context_callback;
 
+    atomic_fetch_sub(&_config.pending_count, 1);
     if (result == IOTHUB_CLIENT_CONFIRMATION_OK) {
-        ESP_LOGI(LOG_TAG_AZIOT, "confirmation received for a msg, result = %s\r\n", MU_ENUM_TO_STRING(IOTHUB_CLIENT_CONFIRMATION_RESULT, result));
+        APPLOG_I(LOG_TAG_AZIOT, "confirmation received for a msg, result = %s",
+            (uint32_t)(uintptr_t)MU_ENUM_TO_STRING(IOTHUB_CLIENT_CONFIRMATION_RESULT, result));
+    } else {
+        APPLOG_W(LOG_TAG_AZIOT, "msg not confirmed, result = %s",
+            (uint32_t)(uintptr_t)MU_ENUM_TO_STRING(IOTHUB_CLIENT_CONFIRMATION_RESULT, result));
+        transport_note_failed(TRANSPORT_AZIOT);
+    }
+    if (sent->on_settled != NULL) {
+        sent->on_settled(result == IOTHUB_CLIENT_CONFIRMATION_OK, sent->context);
+    }
+    IoTHubMessage_Destroy(sent->handle);
+    free(sent);
+}
+
+// Applies every leaf under object as the config topic of its path
+static void aziot_apply_desired(const cJSON* object, char* path, size_t path_len, int depth)
+{
+    const cJSON* item;
+    cJSON_ArrayForEach(item, object) {
+        // $version and $metadata
+        if (item->string == NULL || item->string[0] == '$') {
+            continue;
+        }
+
+        size_t name_len = strlen(item->string);
+        size_t len = path_len + (path_len ? 1 : 0) + name_len;
+        if (len >= AZIOT_TWIN_PATH_MAX_LEN) {
+            ESP_LOGE(LOG_TAG_AZIOT, "desired property path too long: %.*s/%s", path_len, path, item->string);
+            continue;
+        }
+        char* name = path + path_len;
+        if (path_len) {
+            *name++ = '/';
+        }
+        for (size_t i = 0; i <= name_len; ++i) {
+            name[i] = item->string[i] == '_' ? '.' : item->string[i];
+        }
+
+        char number[16];
+        const char* value = NULL;
+        if (cJSON_IsObject(item)) {
+            if (depth + 1 < AZIOT_TWIN_MAX_DEPTH) {
+                aziot_apply_desired(item, path, len, depth + 1);
+            } else {
+                ESP_LOGE(LOG_TAG_AZIOT, "desired property nested too deep: %s", path);
+            }
+        } else if (cJSON_IsBool(item)) {
+            value = cJSON_IsTrue(item) ? "true" : "false";
+        } else if (cJSON_IsNumber(item)) {
+            snprintf(number, sizeof number, "%d", item->valueint);
+            value = number;
+        } else if (cJSON_IsString(item)) {
+            value = item->valuestring;
+        }
+        // null means the property was removed, the device keeps its current value
+
+        if (value != NULL) {
+            datalink_process_config(path, len, value, strlen(value));
+        }
+        path[path_len] = 0;
+    }
+}
+
+// A full twin document arrives on (re)connect, a patch of desired properties on every change
+static void aziot_device_twin_callback(DEVICE_TWIN_UPDATE_STATE update_state, const unsigned char* payload, size_t size, void* user_context_callback)
+{
+    UNUSED(user_context_callback);
+
+    char* json_str = malloc(size + 1);
+    if (json_str == NULL) {
+        ESP_LOGE(LOG_TAG_AZIOT, "no memory for twin update of %d bytes", size);
+        return;
+    }
+    memcpy(json_str, payload, size);
+    json_str[size] = 0;
+    cJSON* root = cJSON_Parse(json_str);
+    free(json_str);
+    if (root == NULL) {
+        ESP_LOGE(LOG_TAG_AZIOT, "invalid twin update");
+        return;
+    }
+
+    const cJSON* desired = update_state == DEVICE_TWIN_UPDATE_COMPLETE ? cJSON_GetObjectItemCaseSensitive(root, "desired") : root;
+    const cJSON* version = cJSON_GetObjectItemCaseSensitive(desired, "$version");
+    int desired_version = cJSON_IsNumber(version) ? version->valueint : -1;
+
+    if (update_state == DEVICE_TWIN_UPDATE_COMPLETE && desired_version >= 0 && desired_version == _config.desired_version) {
+        // reconnected, nothing changed meanwhile
+        ESP_LOGI(LOG_TAG_AZIOT, "desired properties version %d already applied", desired_version);
+    } else if (cJSON_IsObject(desired)) {
+        ESP_LOGI(LOG_TAG_AZIOT, "applying %s desired properties, version %d",
+            update_state == DEVICE_TWIN_UPDATE_COMPLETE ? "all" : "changed", desired_version);
+        char path[AZIOT_TWIN_PATH_MAX_LEN] = "";
+        aziot_apply_desired(desired, path, 0, 0);
+        _config.desired_version = desired_version;
+        aziot_report_int(AZIOT_REPORTED_DESIRED_VERSION, desired_version);
+    }
+
+    cJSON_Delete(root);
+}
+
+_Static_assert(AZIOT_REPORTED_MAX_PROPERTIES <= 32, "reported batches are passed around as a 32 bit mask");
+
+// Sent again with the next flush, at their latest value
+static void aziot_mark_reported_dirty(uint32_t batch)
+{
+    portENTER_CRITICAL(&_config.reported_lock);
+    for (size_t i = 0; i < _config.reported_count; ++i) {
+        if (batch & (1u << i)) {
+            _config.reported[i].dirty = true;
+        }
+    }
+    if (_config.reported_dirty_since_us == 0) {
+        _config.reported_dirty_since_us = esp_timer_get_time();
+    }
+    portEXIT_CRITICAL(&_config.reported_lock);
+}
+
+// The context is the mask of the slots in the patch
+static void aziot_reported_state_callback(int status_code, void* user_context_callback)
+{
+    if (status_code < 200 || status_code >= 300) {
+        ESP_LOGE(LOG_TAG_AZIOT, "reported properties rejected, status %d", status_code);
+        aziot_mark_reported_dirty((uint32_t)(uintptr_t)user_context_callback);
+    }
+}
+
+static void aziot_report(const aziot_reported_property* property)
+{
+    portENTER_CRITICAL(&_config.reported_lock);
+    aziot_reported_property* slot = NULL;
+    for (size_t i = 0; i < _config.reported_count; ++i) {
+        if (strcmp(_config.reported[i].path, property->path) == 0) {
+            slot = &_config.reported[i];
+            break;
+        }
+    }
+
+    bool changed = true;
+    if (slot == NULL && _config.reported_count < AZIOT_REPORTED_MAX_PROPERTIES) {
+        slot = &_config.reported[_config.reported_count++];
+    } else if (slot != NULL && slot->type == property->type) {
+        switch (property->type) {
+        case AZIOT_REPORTED_BOOL:
+            changed = slot->value_bool != property->value_bool;
+            break;
+        case AZIOT_REPORTED_INT:
+            changed = slot->value_int != property->value_int;
+            break;
+        case AZIOT_REPORTED_STRING:
+            changed = strcmp(slot->value_str, property->value_str) != 0;
+            break;
+        }
+    }
+
+    if (slot != NULL && changed) {
+        *slot = *property;
+        slot->dirty = true;
+        if (_config.reported_dirty_since_us == 0) {
+            _config.reported_dirty_since_us = esp_timer_get_time();
+        }
+    }
+    portEXIT_CRITICAL(&_config.reported_lock);
+
+    if (slot == NULL) {
+        ESP_LOGE(LOG_TAG_AZIOT, "more than %d reported properties, %s dropped", AZIOT_REPORTED_MAX_PROPERTIES, property->path);
     }
-    IoTHubMessage_Destroy(handle);
+}
+
+void aziot_report_bool(const char* path, bool value)
+{
+    aziot_reported_property property = { .type = AZIOT_REPORTED_BOOL, .value_bool = value };
+    strncpy(property.path, path, sizeof property.path - 1);
+    aziot_report(&property);
+}
+
+void aziot_report_int(const char* path, int value)
+{
+    aziot_reported_property property = { .type = AZIOT_REPORTED_INT, .value_int = value };
+    strncpy(property.path, path, sizeof property.path - 1);
+    aziot_report(&property);
+}
+
+void aziot_report_str(const char* path, const char* value)
+{
+    aziot_reported_property property = { .type = AZIOT_REPORTED_STRING };
+    strncpy(property.path, path, sizeof property.path - 1);
+    strncpy(property.value_str, value, sizeof property.value_str - 1);
+    aziot_report(&property);
+}
+
+// Adds the property to the patch, creating the objects along its path
+static void aziot_add_reported(cJSON* root, const aziot_reported_property* property)
+{
+    char path[AZIOT_TWIN_PATH_MAX_LEN];
+    strcpy(path, property->path);
+
+    cJSON* object = root;
+    char* name = path;
+    char* slash;
+    while ((slash = strchr(name, '/')) != NULL) {
+        *slash = 0;
+        cJSON* child = cJSON_GetObjectItemCaseSensitive(object, name);
+        object = child != NULL ? child : cJSON_AddObjectToObject(object, name);
+        name = slash + 1;
+    }
+
+    switch (property->type) {
+    case AZIOT_REPORTED_BOOL:
+        cJSON_AddBoolToObject(object, name, property->value_bool);
+        break;
+    case AZIOT_REPORTED_INT:
+        cJSON_AddNumberToObject(object, name, property->value_int);
+        break;
+    case AZIOT_REPORTED_STRING:
+        cJSON_AddStringToObject(object, name, property->value_str);
+        break;
+    }
+}
+
+static void aziot_flush_reported(void)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t dirty_since = _config.reported_dirty_since_us;
+    if (_config.connected_since_us == 0 || dirty_since == 0 || now - dirty_since < AZIOT_REPORTED_BATCH_MS * 1000LL) {
+        return;
+    }
+
+    aziot_reported_property batch[AZIOT_REPORTED_MAX_PROPERTIES];
+    uint32_t batch_mask = 0;
+    size_t count = 0;
+    portENTER_CRITICAL(&_config.reported_lock);
+    for (size_t i = 0; i < _config.reported_count; ++i) {
+        if (_config.reported[i].dirty) {
+            batch[count++] = _config.reported[i];
+            batch_mask |= 1u << i;
+            _config.reported[i].dirty = false;
+        }
+    }
+    _config.reported_dirty_since_us = 0;
+    portEXIT_CRITICAL(&_config.reported_lock);
+
+    cJSON* root = cJSON_CreateObject();
+    for (size_t i = 0; i < count; ++i) {
+        aziot_add_reported(root, &batch[i]);
+    }
+    char* json = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    if (json == NULL) {
+        ESP_LOGE(LOG_TAG_AZIOT, "no memory for reported properties");
+        aziot_mark_reported_dirty(batch_mask);
+        return;
+    }
+
+    if (IoTHubClient_LL_SendReportedState(_config.iothub_client_handle, (const unsigned char*)json, strlen(json),
+            aziot_reported_state_callback, (void*)(uintptr_t)batch_mask) != IOTHUB_CLIENT_OK) {
+        ESP_LOGE(LOG_TAG_AZIOT, "failed to send reported properties");
+        aziot_mark_reported_dirty(batch_mask);
+    } else {
+        APPLOG_I(LOG_TAG_AZIOT, "reported %u changed properties", count);
+    }
+    cJSON_free(json);
 }
 
 void aziot_connection_status_callback(IOTHUB_CLIENT_CONNECTION_STATUS result, IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason, void* user_context_callback)
 {
+    bool was_connected = _config.connected_since_us != 0;
+    bool connected = result == IOTHUB_CLIENT_CONNECTION_AUTHENTICATED;
+    int64_t now = esp_timer_get_time();
+    _config.connected_since_us = connected ? now : 0;
+
+    // the SDK reports every retry, device control only hears about transitions
+    if (connected != was_connected) {
+        if (connected) {
+            // the LL client has no hook before it connects, this includes the backoff
+            transport_note_connected(TRANSPORT_AZIOT, now - _config.disconnected_since_us);
+        } else {
+            _config.disconnected_since_us = now;
+        }
+        device_control_event e;
+        e.event_type = connected ? DEVICE_CONTROL_EVENT_AZIOT_CONNECTED : DEVICE_CONTROL_EVENT_AZIOT_DISCONNECTED;
+        device_control_send_event(&e);
+    }
     ESP_LOGI(LOG_TAG_AZIOT, "status changed to: %s, reason: %s",
         MU_ENUM_TO_STRING(IOTHUB_CLIENT_CONNECTION_STATUS, result),
         MU_ENUM_TO_STRING(IOTHUB_CLIENT_CONNECTION_STATUS_REASON, reason));
 }
 
-static bool aziot_send_core(IOTHUB_MESSAGE_HANDLE message_handle)
+static bool aziot_send_core(IOTHUB_MESSAGE_HANDLE message_handle, void (*on_settled)(bool delivered, void* context), void* context)
 {
-    if (IoTHubClient_LL_SendEventAsync(_config.iothub_client_handle, message_handle, aziot_message_sent_confirmation, message_handle) != IOTHUB_CLIENT_OK) {
+    // the SDK would hold it until authenticated, the transport queue holds it instead
+    if (_config.connected_since_us == 0) {
+        ESP_LOGW(LOG_TAG_AZIOT, "not connected, message not sent");
+        IoTHubMessage_Destroy(message_handle);
+        return false;
+    }
+
+    aziot_sent_context* sent = malloc(sizeof(aziot_sent_context));
+    if (sent == NULL) {
+        ESP_LOGE(LOG_TAG_AZIOT, "no memory to send message");
+        IoTHubMessage_Destroy(message_handle);
+        return false;
+    }
+    sent->handle = message_handle;
+    sent->on_settled = on_settled;
+    sent->context = context;
+
+    atomic_fetch_add(&_config.pending_count, 1);
+    if (IoTHubClient_LL_SendEventAsync(_config.iothub_client_handle, message_handle, aziot_message_sent_confirmation, sent) != IOTHUB_CLIENT_OK) {
+        atomic_fetch_sub(&_config.pending_count, 1);
         ESP_LOGE(LOG_TAG_AZIOT, "failed to send message");
+        IoTHubMessage_Destroy(message_handle);
+        free(sent);
         return false;
     } else {
-        ESP_LOGI(LOG_TAG_AZIOT, "message scheduled for transmission");
+        APPLOG_I(LOG_TAG_AZIOT, "message scheduled for transmission");
     }
     IoTHubClient_LL_DoWork(_config.iothub_client_handle);
     return true;
 }
 
-bool aziot_send_str(const char* data)
+bool aziot_send_str_settled(const char* data, void (*on_settled)(bool delivered, void* context), void* context)
 {
     IOTHUB_MESSAGE_HANDLE message_handle = IoTHubMessage_CreateFromString(data);
     if (message_handle == NULL) {
@@ -139,7 +486,12 @@ bool aziot_send_str(const char* data)
         return false;
     }
 
-    return aziot_send_core(message_handle);
+    return aziot_send_core(message_handle, on_settled, context);
+}
+
+bool aziot_send_str(const char* data)
+{
+    return aziot_send_str_settled(data, NULL, NULL);
 }
 
 bool aziot_send_bin(const uint8_t* data, size_t len)
@@ -150,7 +502,7 @@ bool aziot_send_bin(const uint8_t* data, size_t len)
         return false;
     }
 
-    return aziot_send_core(message_handle);
+    return aziot_send_core(message_handle, NULL, NULL);
 }
 
 bool aziot_init(void)
@@ -168,7 +520,10 @@ bool aziot_init(void)
     bool traceOn = true;
     IoTHubClient_LL_SetOption(client, OPTION_LOG_TRACE, &traceOn);
 
-    IoTHubDeviceClient_LL_SetRetryPolicy(client, IOTHUB_CLIENT_RETRY_INTERVAL, 0);
+    int keepalive = AZIOT_KEEPALIVE_SECONDS;
+    IoTHubClient_LL_SetOption(client, OPTION_KEEP_ALIVE, &keepalive);
+
+    IoTHubDeviceClient_LL_SetRetryPolicy(client, IOTHUB_CLIENT_RETRY_EXPONENTIAL_BACKOFF_WITH_JITTER, AZIOT_RETRY_TIMEOUT_SECONDS);
 
     IoTHubClient_LL_SetConnectionStatusCallback(client, aziot_connection_status_callback, NULL);
 
@@ -178,6 +533,12 @@ bool aziot_init(void)
     IoTHubDeviceClient_LL_SetOption(client, OPTION_TRUSTED_CERT, certificates);
 #endif // SET_TRUSTED_CERT_IN_SAMPLES
 
+    if (IoTHubClient_LL_SetDeviceTwinCallback(client, aziot_device_twin_callback, NULL) != IOTHUB_CLIENT_OK) {
+        ESP_LOGE(LOG_TAG_AZIOT, "failed to set device twin callback");
+        goto aziot_init_failed;
+    }
+    aziot_report_str(AZIOT_REPORTED_FIRMWARE_VERSION, esp_ota_get_app_description()->version);
+
     /* Setting Message call back, so we can receive Commands. */
     int receiveContext = 0;
     if (IoTHubClient_LL_SetMessageCallback(client, aziot_receive_message_callback, &receiveContext) != IOTHUB_CLIENT_OK) {
@@ -194,15 +555,36 @@ aziot_init_failed:
 
 static void aziot_loop_task(void* unused)
 {
-    const TickType_t xDelay = 100 / portTICK_PERIOD_MS;
-
     while (true) {
+        // the LL client isn't thread safe, every send happens here
+        transport_pump(TRANSPORT_AZIOT);
         IoTHubClient_LL_DoWork(_config.iothub_client_handle);
-        vTaskDelay(xDelay);
+        aziot_flush_reported();
+
+        // drain what queued up while disconnected, the window still bounds what's in flight
+        bool burst = aziot_is_connected() && !transport_is_idle(TRANSPORT_AZIOT);
+        vTaskDelay((burst ? AZIOT_BURST_INTERVAL_MS : AZIOT_DO_WORK_INTERVAL_MS) / portTICK_PERIOD_MS);
     }
 }
 
 void aziot_start(void)
 {
-    xTaskCreate(aziot_loop_task, "aziot_loop_task", 8192, NULL, 0, NULL);
-}
\ No newline at end of file
+    _config.disconnected_since_us = esp_timer_get_time();
+    app_task_start(APP_TASK_AZIOT, aziot_loop_task, NULL);
+}
+
+int aziot_get_pending_count(void)
+{
+    return atomic_load(&_config.pending_count);
+}
+
+bool aziot_is_connected(void)
+{
+    return _config.connected_since_us != 0;
+}
+
+uint32_t aziot_get_connected_seconds(void)
+{
+    int64_t since = _config.connected_since_us;
+    return since ? (uint32_t)((esp_timer_get_time() - since) / 1000000) : 0;
+}
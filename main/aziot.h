@@ -25,12 +25,27 @@
 #ifndef AZIOT_H
 #define AZIOT_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 bool aziot_send_str(const char *data);
+// on_settled is called from the aziot task once the hub answered, delivered only if it confirmed.
+// Never called when this returns false, may be NULL
+bool aziot_send_str_settled(const char *data, void (*on_settled)(bool delivered, void *context), void *context);
 bool aziot_send_bin(const uint8_t *data, size_t len);
 bool aziot_init(void);
 void aziot_start(void);
+int aziot_get_pending_count(void);
+bool aziot_is_connected(void);
+// 0 while not authenticated with the hub
+uint32_t aziot_get_connected_seconds(void);
+
+// Device twin reported properties, path as in the config topics. Only changed values are
+// sent, batched, once authenticated
+void aziot_report_bool(const char *path, bool value);
+void aziot_report_int(const char *path, int value);
+void aziot_report_str(const char *path, const char *value);
 
 
 #endif
\ No newline at end of file
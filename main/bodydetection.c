@@ -23,8 +23,6 @@
 // <END LICENSE>
 
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
-#include "freertos/task.h"
 
 #include "driver/gpio.h"
 #include "esp_log.h"
@@ -33,36 +31,32 @@
 
 #include "bodydetection.h"
 #include "devicecontrollogic.h"
+#include "eventbus.h"
 
-static xQueueHandle body_detection_gpio_queue = NULL;
-static bool body_detected;
+static volatile bool body_detected;
 
 static void IRAM_ATTR body_detection_isr_handler(void* arg)
 {
     UNUSED(arg);
     int level = gpio_get_level(BODY_DETECTION_PIN);
-    xQueueSendFromISR(body_detection_gpio_queue, &level, NULL);
-}
+    if (BODY_DETECTION_LOW_ACTIVE) { // Inverted
+        body_detected = !level;
+    } else {
+        body_detected = level;
+    }
 
-static void body_detection_task(void* arg)
-{
-    UNUSED(arg);
-    int level;
-    for (;;) {
-        if (xQueueReceive(body_detection_gpio_queue, &level, portMAX_DELAY)) {
-            if (BODY_DETECTION_LOW_ACTIVE) { // Inverted
-                body_detected = !level;
-            } else {
-                body_detected = level;
-            }
+    // straight onto the bus, no intermediate queue and task hop
+    eventbus_event* event = eventbus_alloc_from_isr(EVENTBUS_TOPIC_DEVICE_CONTROL);
+    if (event == NULL) {
+        return;
+    }
+    event->device_control.event_type = DEVICE_CONTROL_EVENT_BODY_DETECTION_TRIGGERED;
+    event->device_control.body_detected = body_detected;
 
-            device_control_event event = {
-                .event_type = DEVICE_CONTROL_EVENT_BODY_DETECTION_TRIGGERED,
-                .body_detected = level
-            };
-            device_control_send_event(&event);
-            ESP_LOGI(LOG_TAG_BODY_DETECTION, "body detection pin level %s", level ? "hi" : "lo");
-        }
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    eventbus_publish_from_isr(event, &higher_priority_task_woken);
+    if (higher_priority_task_woken) {
+        portYIELD_FROM_ISR();
     }
 }
 
@@ -72,15 +66,28 @@ void init_body_detection()
     gpio_set_direction(BODY_DETECTION_PIN, GPIO_MODE_INPUT);
     gpio_set_pull_mode(BODY_DETECTION_PIN, GPIO_FLOATING);
     gpio_set_intr_type(BODY_DETECTION_PIN, GPIO_INTR_ANYEDGE);
-
-    body_detection_gpio_queue = xQueueCreate(10, sizeof(int));
 }
 
 void start_body_detection()
 {
+    if (TRACE_REPLAY_ENABLED) {
+        ESP_LOGW(LOG_TAG_BODY_DETECTION, "trace replay, PIR edges ignored");
+        return;
+    }
     gpio_isr_handler_add(BODY_DETECTION_PIN, body_detection_isr_handler, NULL);
+}
 
-    xTaskCreate(body_detection_task, "body_detection_task", 2048, NULL, 10, NULL);
+void body_detection_inject(int level)
+{
+    body_detected = level;
+
+    eventbus_event* event = eventbus_alloc(EVENTBUS_TOPIC_DEVICE_CONTROL);
+    if (event == NULL) {
+        return;
+    }
+    event->device_control.event_type = DEVICE_CONTROL_EVENT_BODY_DETECTION_TRIGGERED;
+    event->device_control.body_detected = level;
+    eventbus_publish(event);
 }
 
 int get_body_detected()
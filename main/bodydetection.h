@@ -28,5 +28,7 @@
 void init_body_detection();
 int get_body_detected();
 void start_body_detection();
+// Feeds an edge as if the ISR had read it, from task context
+void body_detection_inject(int level);
 
 #endif // BODYDETECTION_H
@@ -0,0 +1,174 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "global.h"
+
+#include "boot.h"
+#include "tasks.h"
+
+_Static_assert(BOOT_MAX_PHASES <= 24, "event group has 24 usable bits");
+
+typedef struct boot_phase_timing_t {
+    int64_t start_us;
+    int64_t end_us;
+    int core;
+} boot_phase_timing;
+
+typedef struct boot_config_t {
+    const boot_phase* phases;
+    size_t count;
+    uint32_t started;
+    uint32_t done;
+    boot_phase_timing timing[BOOT_MAX_PHASES];
+    int64_t ready_us;
+    EventGroupHandle_t done_event_group;
+} boot_config;
+
+static boot_config _config;
+static portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Returns the index of a phase that's ready to run and marks it started, -1 if none
+static int boot_take_phase(void)
+{
+    int taken = -1;
+
+    portENTER_CRITICAL(&_lock);
+    for (size_t i = 0; i < _config.count; ++i) {
+        uint32_t bit = BOOT_PHASE_BIT(i);
+        if ((_config.started & bit) == 0 && (_config.phases[i].depends_on & ~_config.done) == 0) {
+            _config.started |= bit;
+            taken = i;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&_lock);
+
+    return taken;
+}
+
+static void boot_work(void)
+{
+    const uint32_t all = BOOT_PHASE_BIT(_config.count) - 1;
+
+    for (;;) {
+        int phase = boot_take_phase();
+        if (phase >= 0) {
+            boot_phase_timing* timing = &_config.timing[phase];
+            timing->core = xPortGetCoreID();
+            timing->start_us = esp_timer_get_time();
+            _config.phases[phase].run();
+            timing->end_us = esp_timer_get_time();
+
+            portENTER_CRITICAL(&_lock);
+            _config.done |= BOOT_PHASE_BIT(phase);
+            portEXIT_CRITICAL(&_lock);
+            xEventGroupSetBits(_config.done_event_group, BOOT_PHASE_BIT(phase));
+            continue;
+        }
+
+        portENTER_CRITICAL(&_lock);
+        uint32_t started = _config.started;
+        uint32_t done = _config.done;
+        portEXIT_CRITICAL(&_lock);
+
+        if (started == all) {
+            return;
+        }
+
+        // bits are never cleared, so a phase finishing right before this still wakes us up
+        xEventGroupWaitBits(_config.done_event_group, all & ~done, pdFALSE, pdFALSE, portMAX_DELAY);
+    }
+}
+
+static void boot_worker_task(void* arg)
+{
+    UNUSED(arg);
+    boot_work();
+    app_task_exit(APP_TASK_BOOT_WORKER);
+}
+
+void boot_run(const boot_phase* phases, size_t count)
+{
+    if (count > BOOT_MAX_PHASES) {
+        ESP_LOGE(LOG_TAG_APP, "too many boot phases: %u", count);
+        abort();
+    }
+
+    _config.phases = phases;
+    _config.count = count;
+    _config.done_event_group = app_event_group_create(APP_EVENT_GROUP_BOOT);
+
+    app_task_start(APP_TASK_BOOT_WORKER, boot_worker_task, NULL);
+    boot_work();
+
+    const uint32_t all = BOOT_PHASE_BIT(count) - 1;
+    xEventGroupWaitBits(_config.done_event_group, all, pdFALSE, pdTRUE, portMAX_DELAY);
+    boot_log_timeline();
+}
+
+void boot_mark_ready(void)
+{
+    if (_config.ready_us == 0) {
+        _config.ready_us = esp_timer_get_time();
+        ESP_LOGI(LOG_TAG_APP, "ready to report %lldms after power on", _config.ready_us / 1000);
+    }
+}
+
+bool boot_is_ready(void)
+{
+    return _config.ready_us != 0;
+}
+
+// {"boot":{"nvs":[start,end],...},"ready":ms}, milliseconds since power on
+int boot_format_timeline(char* buffer, size_t len)
+{
+    int pos = snprintf(buffer, len, "{\"boot\":{");
+    for (size_t i = 0; i < _config.count && pos < (int)len; ++i) {
+        pos += snprintf(buffer + pos, len - pos, "%s\"%s\":[%lld,%lld]", i ? "," : "",
+            _config.phases[i].name, _config.timing[i].start_us / 1000, _config.timing[i].end_us / 1000);
+    }
+    if (pos < (int)len) {
+        pos += snprintf(buffer + pos, len - pos, "},\"ready\":%lld}", _config.ready_us / 1000);
+    }
+    return pos;
+}
+
+void boot_log_timeline(void)
+{
+    for (size_t i = 0; i < _config.count; ++i) {
+        const boot_phase_timing* timing = &_config.timing[i];
+        ESP_LOGI(LOG_TAG_APP, "boot phase %-16s core %d, %6lldms - %6lldms (%lldms)", _config.phases[i].name,
+            timing->core, timing->start_us / 1000, timing->end_us / 1000, (timing->end_us - timing->start_us) / 1000);
+    }
+}
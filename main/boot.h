@@ -0,0 +1,50 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BOOT_PHASE_BIT(phase) (1u << (phase))
+
+typedef struct boot_phase_t {
+    const char* name;
+    void (*run)(void);
+    uint32_t depends_on; // mask of BOOT_PHASE_BIT
+} boot_phase;
+
+// Runs the phases on the calling task and a boot worker on the other core. A phase starts
+// as soon as everything it depends on is done. Returns when all phases are done
+void boot_run(const boot_phase* phases, size_t count);
+
+// First time the device is able to report, ends the boot timeline
+void boot_mark_ready(void);
+bool boot_is_ready(void);
+int boot_format_timeline(char* buffer, size_t len);
+void boot_log_timeline(void);
+
+#endif // BOOT_H
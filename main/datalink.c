@@ -22,43 +22,172 @@
  **************************************************************************/
 // <END LICENSE>
 
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "global.h"
 
+#include "applog.h"
 #include "datalink.h"
 #include "devicecontrollogic.h"
+#include "eventbus.h"
+#include "fleetsim.h"
+#include "metrics.h"
+#include "overstay.h"
+#include "router.h"
+#include "sessionlog.h"
+#include "sessionstats.h"
 #include "status.h"
+#include "tasks.h"
+#include "timeman.h"
+#include "topics.h"
+#include "tracereplay.h"
+#include "transport.h"
+#include "uplinkseq.h"
 #include "aziot.h"
+#include "boot.h"
+
+typedef struct mqtt_delivery_t {
+    int msg_id;
+    transport_message* message; // retained, NULL if the slot is free
+} mqtt_delivery;
 
 typedef struct datalink_config_t {
  bool enable_mqtt;
  bool enable_azure_iot;
  esp_mqtt_client_handle_t mqtt_client;
- xQueueHandle datalink_event_queue;
+ eventbus_subscriber* datalink_subscriber;
+ volatile int64_t mqtt_connected_since_us; // 0 while disconnected
+ router* downlink_router;
+ volatile uint32_t metrics_interval_ms;
+ int64_t mqtt_connect_started_us;
+ atomic_int mqtt_in_flight; // QoS 1 publishes not acknowledged yet
+ SemaphoreHandle_t mqtt_uplink_ready;
+ portMUX_TYPE mqtt_delivery_lock;
+ mqtt_delivery mqtt_deliveries[TRANSPORT_MQTT_WINDOW]; // publishes a sender waits on
+ size_t mqtt_delivery_next; // slot taken next, the oldest one
+ int mqtt_published_msg_id; // last acknowledged, it may beat the bookkeeping of its publish
 } datalink_config;
 
-static datalink_config _config;
-
-static const char datalink_msg_body_detection[] = "{\"start\": %" PRIu64 ",\"elapsed\": %" PRIu64 "}";
+static datalink_config _config = {
+    .mqtt_delivery_lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+typedef enum datalink_class_t {
+    DATALINK_CLASS_SESSION,
+    DATALINK_CLASS_TELEMETRY,
+    DATALINK_CLASS_STATUS,
+    DATALINK_CLASS_LOAD_TEST,
+    DATALINK_CLASS_SESSION_SUMMARY,
+    DATALINK_CLASS_HISTORY,
+    DATALINK_CLASS_ALERT,
+    DATALINK_CLASS_COUNT
+} datalink_class;
+
+typedef enum datalink_route_mode_t {
+    DATALINK_ROUTE_PRIMARY, // primary only, queued while it's down
+    DATALINK_ROUTE_FALLBACK, // secondary while the primary isn't up and the secondary is healthier
+    DATALINK_ROUTE_MIRROR, // both
+} datalink_route_mode;
+
+typedef struct datalink_class_route_t {
+    datalink_route_mode mode;
+    transport_id primary;
+    transport_id secondary;
+    topics_uplink uplink;
+    transport_lane lane;
+    bool sequenced; // JSON objects stamped with boot and seq
+} datalink_class_route;
+
+static const datalink_class_route _class_routes[DATALINK_CLASS_COUNT] = {
+    // sessions are the product, the cloud record and the on-prem dashboards both need them
+    [DATALINK_CLASS_SESSION] = { DATALINK_ROUTE_MIRROR, TRANSPORT_AZIOT, TRANSPORT_MQTT, TOPICS_UPLINK_SESSION, TRANSPORT_LANE_SESSION, true },
+    [DATALINK_CLASS_TELEMETRY] = { DATALINK_ROUTE_FALLBACK, TRANSPORT_AZIOT, TRANSPORT_MQTT, TOPICS_UPLINK_TELEMETRY, TRANSPORT_LANE_BULK },
+    [DATALINK_CLASS_STATUS] = { DATALINK_ROUTE_PRIMARY, TRANSPORT_MQTT, TRANSPORT_MQTT, TOPICS_UPLINK_BODY_DETECTION, TRANSPORT_LANE_STATUS },
+    [DATALINK_CLASS_LOAD_TEST] = { DATALINK_ROUTE_PRIMARY, TRANSPORT_AZIOT, TRANSPORT_AZIOT, TOPICS_UPLINK_LOAD_TEST, TRANSPORT_LANE_BULK },
+    [DATALINK_CLASS_SESSION_SUMMARY] = { DATALINK_ROUTE_MIRROR, TRANSPORT_AZIOT, TRANSPORT_MQTT, TOPICS_UPLINK_SESSION_SUMMARY, TRANSPORT_LANE_SESSION, true },
+    // queries arrive on either transport, replies take whichever is up
+    [DATALINK_CLASS_HISTORY] = { DATALINK_ROUTE_FALLBACK, TRANSPORT_AZIOT, TRANSPORT_MQTT, TOPICS_UPLINK_HISTORY_REPLY, TRANSPORT_LANE_BULK },
+    [DATALINK_CLASS_ALERT] = { DATALINK_ROUTE_MIRROR, TRANSPORT_AZIOT, TRANSPORT_MQTT, TOPICS_UPLINK_ALERT, TRANSPORT_LANE_URGENT, true },
+};
+
+static const char datalink_msg_body_detection[] = "{\"start\": %" PRIu64 ",\"elapsed\": %" PRIu64 ",\"elapsed_ms\": %" PRIu64 "}";
 
 static void init_mqtt(void);
 static void start_mqtt(void);
 static void subscribe_mqtt_topics(esp_mqtt_client_handle_t client);
 static void process_downlink_data(const char* topic, int topic_len, const char* data, int data_len);
 
+// Keeps message until msg_id is acknowledged. With every slot taken the oldest is dropped, its
+// senders never hear back and have to resend
+static void mqtt_delivery_track(int msg_id, transport_message* message)
+{
+    transport_message* dropped = NULL;
+    portENTER_CRITICAL(&_config.mqtt_delivery_lock);
+    bool published = _config.mqtt_published_msg_id == msg_id;
+    if (!published) {
+        mqtt_delivery* d = &_config.mqtt_deliveries[_config.mqtt_delivery_next];
+        _config.mqtt_delivery_next = (_config.mqtt_delivery_next + 1) % TRANSPORT_MQTT_WINDOW;
+        dropped = d->message;
+        d->msg_id = msg_id;
+        d->message = message;
+        transport_message_retain(message);
+    }
+    portEXIT_CRITICAL(&_config.mqtt_delivery_lock);
+    if (published) {
+        transport_message_delivered(message);
+    }
+    if (dropped != NULL) {
+        transport_message_release(dropped);
+    }
+}
+
+static void mqtt_delivery_confirm(int msg_id)
+{
+    transport_message* message = NULL;
+    portENTER_CRITICAL(&_config.mqtt_delivery_lock);
+    _config.mqtt_published_msg_id = msg_id;
+    for (size_t i = 0; i < TRANSPORT_MQTT_WINDOW; ++i) {
+        mqtt_delivery* d = &_config.mqtt_deliveries[i];
+        if (d->message != NULL && d->msg_id == msg_id) {
+            message = d->message;
+            d->message = NULL;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&_config.mqtt_delivery_lock);
+    if (message != NULL) {
+        transport_message_delivered(message);
+        transport_message_release(message);
+    }
+}
+
 static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
 {
     esp_mqtt_client_handle_t client = event->client;
     switch (event->event_id) {
+    case MQTT_EVENT_BEFORE_CONNECT:
+        _config.mqtt_connect_started_us = esp_timer_get_time();
+        break;
     case MQTT_EVENT_CONNECTED:
-        subscribe_mqtt_topics(client);
+        // DNS, TCP, TLS and CONNACK
+        transport_note_connected(TRANSPORT_MQTT, esp_timer_get_time() - _config.mqtt_connect_started_us);
+        // a resumed session still has its subscriptions
+        if (!event->session_present) {
+            subscribe_mqtt_topics(client);
+        }
         __device_status.datalink_status = DATALINK_STATUS_CONNECTED;
+        _config.mqtt_connected_since_us = esp_timer_get_time();
+        xSemaphoreGive(_config.mqtt_uplink_ready);
         {
             device_control_event e;
             e.event_type = DEVICE_CONTROL_EVENT_MQTT_CONNECTED;
@@ -67,6 +196,9 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
         break;
     case MQTT_EVENT_DISCONNECTED:
         __device_status.datalink_status = DATALINK_STATUS_DISCONNECTED;
+        _config.mqtt_connected_since_us = 0;
+        // in flight stays as is, the client's outbox resends those on reconnect and they're
+        // acknowledged then
         {
             device_control_event e;
             e.event_type = DEVICE_CONTROL_EVENT_MQTT_DISCONNECTED;
@@ -81,8 +213,16 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
         ESP_LOGI(LOG_TAG_MQTT, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
         break;
     case MQTT_EVENT_PUBLISHED:
+        if (atomic_fetch_sub(&_config.mqtt_in_flight, 1) <= 0) {
+            atomic_store(&_config.mqtt_in_flight, 0);
+        }
+        mqtt_delivery_confirm(event->msg_id);
+        xSemaphoreGive(_config.mqtt_uplink_ready);
         break;
     case MQTT_EVENT_DATA:
+        if (FLEET_SIM_ENABLED && fleet_sim_process_message(event->topic, event->topic_len, event->data, event->data_len)) {
+            break;
+        }
         process_downlink_data(event->topic, event->topic_len, event->data, event->data_len);
         break;
     case MQTT_EVENT_ERROR:
@@ -100,6 +240,14 @@ void init_mqtt(void)
     esp_mqtt_client_config_t mqtt_cfg = {
         .uri = MQTT_BROKER_URL,
         .event_handle = mqtt_event_handler,
+        // a persistent session needs a stable client id
+        .client_id = topics_get_device_id(),
+        .disable_clean_session = true,
+        .keepalive = MQTT_KEEPALIVE_SECONDS,
+        .reconnect_timeout_ms = MQTT_RECONNECT_TIMEOUT_MS,
+#ifdef MQTT_BROKER_CA_PEM
+        .cert_pem = MQTT_BROKER_CA_PEM,
+#endif
         // .user_context = (void *)your_context
     };
 
@@ -112,41 +260,180 @@ void start_mqtt(void)
     esp_mqtt_client_start(_config.mqtt_client);
 }
 
+static bool mqtt_transport_is_connected(void)
+{
+    return _config.mqtt_connected_since_us != 0;
+}
+
+static size_t mqtt_transport_get_in_flight(void)
+{
+    // publishes the outbox expired are never acknowledged, they'd hold the window for good
+    if (atomic_load(&_config.mqtt_in_flight) > 0 && esp_mqtt_client_get_outbox_size(_config.mqtt_client) == 0) {
+        atomic_store(&_config.mqtt_in_flight, 0);
+    }
+    return atomic_load(&_config.mqtt_in_flight);
+}
+
+static bool mqtt_transport_send(transport_message* message)
+{
+    atomic_fetch_add(&_config.mqtt_in_flight, 1);
+    int msg_id = esp_mqtt_client_publish(_config.mqtt_client, topics_get_uplink(message->uplink), message->data, message->len, 1, 0);
+    if (msg_id < 0) {
+        atomic_fetch_sub(&_config.mqtt_in_flight, 1);
+        return false;
+    }
+    if (transport_message_is_awaited(message)) {
+        mqtt_delivery_track(msg_id, message);
+    }
+    return true;
+}
+
+static void mqtt_transport_notify(void)
+{
+    xSemaphoreGive(_config.mqtt_uplink_ready);
+}
+
+static const transport_ops _mqtt_transport_ops = {
+    .name = "mqtt",
+    .window = TRANSPORT_MQTT_WINDOW,
+    .is_connected = mqtt_transport_is_connected,
+    .get_in_flight = mqtt_transport_get_in_flight,
+    .send = mqtt_transport_send,
+};
+
+static size_t aziot_transport_get_in_flight(void)
+{
+    return aziot_get_pending_count();
+}
+
+static void aziot_transport_settled(bool delivered, void* context)
+{
+    transport_message* message = (transport_message*)context;
+    if (delivered) {
+        transport_message_delivered(message);
+    }
+    transport_message_release(message);
+}
+
+static bool aziot_transport_send(transport_message* message)
+{
+    if (!transport_message_is_awaited(message)) {
+        return aziot_send_str(message->data);
+    }
+    // kept until the hub answers
+    transport_message_retain(message);
+    if (!aziot_send_str_settled(message->data, aziot_transport_settled, message)) {
+        transport_message_release(message);
+        return false;
+    }
+    return true;
+}
+
+// pumped by the aziot task, which polls
+static const transport_ops _aziot_transport_ops = {
+    .name = "aziot",
+    .window = TRANSPORT_AZIOT_WINDOW,
+    .is_connected = aziot_is_connected,
+    .get_in_flight = aziot_transport_get_in_flight,
+    .send = aziot_transport_send,
+};
+
+static void mqtt_uplink_task(void* arg)
+{
+    UNUSED(arg);
+    for (;;) {
+        // woken on enqueue, connect and acknowledge, the timeout only refreshes the window state
+        xSemaphoreTake(_config.mqtt_uplink_ready, TRANSPORT_MQTT_PUMP_INTERVAL_MS / portTICK_PERIOD_MS);
+        transport_pump(TRANSPORT_MQTT);
+    }
+}
+
+// Where the next message of a primary or fallback route goes
+static transport_id datalink_route_target(const datalink_class_route* route)
+{
+    if (route->mode != DATALINK_ROUTE_FALLBACK) {
+        return route->primary;
+    }
+    transport_health primary = transport_get_health(route->primary);
+    transport_health secondary = transport_get_health(route->secondary);
+    bool use_secondary = !transport_is_enabled(route->primary)
+        || (primary != TRANSPORT_HEALTH_UP && secondary > primary);
+    return use_secondary ? route->secondary : route->primary;
+}
+
+// Returns the sequence number stamped into the message, 0 if none. seq is used if the class is
+// sequenced, 0 takes the next one. on_delivered, if set, is called by each transport that got
+// it acknowledged
+static uint32_t datalink_uplink_confirmed(datalink_class class, const char* data, int len, uint32_t seq,
+    transport_delivered_fn on_delivered, void* context)
+{
+    const datalink_class_route* route = &_class_routes[class];
+    transport_message* message;
+    if (!route->sequenced || len == 0 || data[0] != '{') {
+        seq = 0;
+    } else if (seq == 0) {
+        seq = uplinkseq_next();
+    }
+    if (seq != 0) {
+        // the transports resend this very message, a caller resending its own data passes the seq
+        char stamp[40];
+        int stamp_len = snprintf(stamp, sizeof stamp, "{\"boot\":%u,\"seq\":%u%s", uplinkseq_get_boot_id(), seq, len > 2 ? "," : "");
+        message = transport_message_create_prefixed(route->uplink, stamp, stamp_len, data + 1, len - 1);
+    } else {
+        message = transport_message_create(route->uplink, data, len);
+    }
+    if (message == NULL) {
+        return seq;
+    }
+    message->on_delivered = on_delivered;
+    message->delivered_context = context;
+
+    switch (route->mode) {
+    case DATALINK_ROUTE_PRIMARY:
+    case DATALINK_ROUTE_FALLBACK:
+        transport_enqueue(datalink_route_target(route), route->lane, message);
+        break;
+    case DATALINK_ROUTE_MIRROR:
+        transport_enqueue(route->primary, route->lane, message);
+        transport_enqueue(route->secondary, route->lane, message);
+        break;
+    }
+    transport_message_release(message);
+    return seq;
+}
+
+static uint32_t datalink_uplink(datalink_class class, const char* data, int len)
+{
+    return datalink_uplink_confirmed(class, data, len, 0, NULL, NULL);
+}
+
 void publish_device_status()
 {
     if (__device_status.datalink_status != DATALINK_STATUS_CONNECTED)
         return;
 
-    int msg_id = esp_mqtt_client_publish(_config.mqtt_client, MQTT_BODY_DETECTION_PUBLISH_TOPIC,
-        __device_status.body_detected ? "true" : "false", 0, 1, 0);
-    UNUSED(msg_id);
+    const char* status = __device_status.body_detected ? "true" : "false";
+    datalink_uplink(DATALINK_CLASS_STATUS, status, strlen(status));
 }
 
 // For dev/debug only
-static void process_body_detection_enabled_downlink(const char* data, int data_len)
+static void process_body_detection_enabled_downlink(const router_message* message)
 {
     device_control_event event = {};
+    event.event_type = message->value_bool ? DEVICE_CONTROL_EVENT_BODY_DETECTION_ENABLED : DEVICE_CONTROL_EVENT_BODY_DETECTION_DISABLED;
+    device_control_send_event(&event);
+}
 
-    if (strncasecmp(data, "true", data_len) == 0) {
-        event.event_type = DEVICE_CONTROL_EVENT_BODY_DETECTION_ENABLED;
-        device_control_send_event(&event);
-        return;
-    }
-
-    if (strncasecmp(data, "false", data_len) == 0) {
-        event.event_type = DEVICE_CONTROL_EVENT_BODY_DETECTION_DISABLED;
-        device_control_send_event(&event);
-        return;
-    }
-
-    ESP_LOGE(LOG_TAG_MQTT, "invalid body detection enabled received: %.*s", data_len, data);
+static void process_body_detection_adaptive_downlink(const router_message* message)
+{
+    device_control_event event = {};
+    event.event_type = message->value_bool ? DEVICE_CONTROL_EVENT_BODY_DETECTION_ADAPTIVE_ENABLED : DEVICE_CONTROL_EVENT_BODY_DETECTION_ADAPTIVE_DISABLED;
+    device_control_send_event(&event);
 }
 
-static void process_body_detection_delay_downlink(const char* data, int data_len)
+static void process_body_detection_delay_downlink(const router_message* message)
 {
-    char delay_str[data_len + 1];
-    strncpy(delay_str, data, data_len)[data_len] = 0;
-    int delay = atoi(delay_str);
+    int delay = message->value_int;
 
     if (delay > 0) {
         device_control_event event = {};
@@ -154,37 +441,160 @@ static void process_body_detection_delay_downlink(const char* data, int data_len
         event.body_detection_delay_seconds = delay;
         device_control_send_event(&event);
     } else {
-        ESP_LOGE(LOG_TAG_MQTT, "invalid body detection delay received: %d (%.*s)", delay, data_len, data);
+        ESP_LOGE(LOG_TAG_MQTT, "invalid body detection delay received: %d", delay);
     }
 }
 
-static void process_downlink_data(const char* topic, int topic_len, const char* data, int data_len)
+static void process_alert_threshold_downlink(device_control_event_type event_type, const router_message* message)
 {
-    int result = 0;
+    if (message->value_int < 0) {
+        ESP_LOGE(LOG_TAG_MQTT, "invalid alert threshold received: %d", message->value_int);
+        return;
+    }
+    device_control_event event = {};
+    event.event_type = event_type;
+    event.alert_threshold_seconds = message->value_int;
+    device_control_send_event(&event);
+}
 
-    result = strncmp(topic, MQTT_CONFIG_BODY_DETECTION_ENABLED_TOPIC, topic_len);
-    if (result == 0) {
-        process_body_detection_enabled_downlink(data, data_len);
+static void process_alert_overstay_downlink(const router_message* message)
+{
+    process_alert_threshold_downlink(DEVICE_CONTROL_EVENT_ALERT_OVERSTAY_CHANGED, message);
+}
+
+static void process_alert_stuck_downlink(const router_message* message)
+{
+    process_alert_threshold_downlink(DEVICE_CONTROL_EVENT_ALERT_STUCK_CHANGED, message);
+}
+
+static void process_log_level_downlink(const router_message* message)
+{
+    const char* tag = message->wildcards[0];
+    int tag_len = message->wildcard_len[0];
+    esp_log_level_t level;
+    if (tag_len <= 0 || !applog_parse_level(message->data, message->data_len, &level)) {
+        ESP_LOGE(LOG_TAG_MQTT, "invalid log level received: %.*s = %.*s", tag_len, tag, message->data_len, message->data);
         return;
     }
 
-    result = strncmp(topic, MQTT_CONFIG_BODY_DETECTION_DELAY_TOPIC, topic_len);
-    if (result == 0) {
-        process_body_detection_delay_downlink(data, data_len);
+    char tag_str[tag_len + 1];
+    strncpy(tag_str, tag, tag_len)[tag_len] = 0;
+    applog_set_level(tag_str, level);
+}
+
+static void process_metrics_interval_downlink(const router_message* message)
+{
+    if (message->value_int <= 0) {
+        ESP_LOGE(LOG_TAG_MQTT, "invalid metrics interval received: %d", message->value_int);
         return;
     }
+    _config.metrics_interval_ms = message->value_int * 1000;
+    aziot_report_int(MQTT_CONFIG_METRICS_INTERVAL_TOPIC, message->value_int);
+}
 
-    ESP_LOGE(LOG_TAG_MQTT, "unrecognized topic or broken data, topic: %.*s, payload: %.*s", topic_len, topic, data_len, data);
+// Runs on the MQTT or IoT Hub task, the query itself runs on the datalink task
+static void process_history_query_downlink(const router_message* message)
+{
+    const cJSON* id = cJSON_GetObjectItemCaseSensitive(message->value_json, "id");
+    const cJSON* from = cJSON_GetObjectItemCaseSensitive(message->value_json, "from");
+    const cJSON* to = cJSON_GetObjectItemCaseSensitive(message->value_json, "to");
+    const cJSON* last = cJSON_GetObjectItemCaseSensitive(message->value_json, "last");
+
+    data_link_event event = { .event_type = DATA_LINK_EVENT_HISTORY_QUERY };
+    event.history_query.id = cJSON_IsNumber(id) ? (uint32_t)id->valuedouble : 0;
+    if (cJSON_IsNumber(last) && last->valuedouble > 0) {
+        event.history_query.last_count = (uint32_t)last->valuedouble;
+    } else if (cJSON_IsNumber(from) && cJSON_IsNumber(to) && from->valuedouble <= to->valuedouble) {
+        event.history_query.from_epoch_second = (uint32_t)from->valuedouble;
+        event.history_query.to_epoch_second = (uint32_t)to->valuedouble;
+    } else {
+        ESP_LOGE(LOG_TAG_MQTT, "invalid history query received: %.*s", message->data_len, message->data);
+        return;
+    }
+    datalink_send_event(&event);
+}
+
+// Config topics, relative to the device's config prefixes. Device twin desired properties
+// and cloud to device messages are routed through the same table
+static const router_route _downlink_routes[] = {
+    { MQTT_CONFIG_BODY_DETECTION_ENABLED_TOPIC, ROUTER_PAYLOAD_BOOL, process_body_detection_enabled_downlink },
+    { MQTT_CONFIG_BODY_DETECTION_DELAY_TOPIC, ROUTER_PAYLOAD_INT, process_body_detection_delay_downlink },
+    { MQTT_CONFIG_BODY_DETECTION_ADAPTIVE_TOPIC, ROUTER_PAYLOAD_BOOL, process_body_detection_adaptive_downlink },
+    { MQTT_CONFIG_LOG_LEVEL_TOPIC, ROUTER_PAYLOAD_RAW, process_log_level_downlink },
+    { MQTT_CONFIG_METRICS_INTERVAL_TOPIC, ROUTER_PAYLOAD_INT, process_metrics_interval_downlink },
+    { MQTT_CONFIG_ALERT_OVERSTAY_TOPIC, ROUTER_PAYLOAD_INT, process_alert_overstay_downlink },
+    { MQTT_CONFIG_ALERT_STUCK_TOPIC, ROUTER_PAYLOAD_INT, process_alert_stuck_downlink },
+    { MQTT_CONFIG_HISTORY_QUERY_TOPIC, ROUTER_PAYLOAD_JSON, process_history_query_downlink },
+};
+
+bool datalink_process_config(const char* topic, int topic_len, const char* data, int data_len)
+{
+    return router_dispatch(_config.downlink_router, topic, topic_len, data, data_len);
+}
+
+static void process_downlink_data(const char* full_topic, int full_topic_len, const char* data, int data_len)
+{
+    int topic_len;
+    topics_scope scope;
+    const char* topic = topics_match_config(full_topic, full_topic_len, &topic_len, &scope);
+    if (topic == NULL) {
+        ESP_LOGE(LOG_TAG_MQTT, "downlink not addressed to this device, topic: %.*s", full_topic_len, full_topic);
+        return;
+    }
+    ESP_LOGD(LOG_TAG_MQTT, "config %.*s, scope %d", topic_len, topic, scope);
+
+    datalink_process_config(topic, topic_len, data, data_len);
 }
 
 static void subscribe_mqtt_topics(esp_mqtt_client_handle_t client)
 {
-    esp_mqtt_client_subscribe(client, MQTT_CONFIG_SUBSCRIBE_TOPIC, 0);
+    for (int scope = 0; scope < TOPICS_SCOPE_COUNT; ++scope) {
+        esp_mqtt_client_subscribe(client, topics_get_config_subscription(scope), 0);
+    }
+    if (FLEET_SIM_ENABLED) {
+        fleet_sim_subscribe(client);
+    }
+}
+
+int datalink_mqtt_publish(const char* topic, const char* data, int len, int qos)
+{
+    if (!mqtt_transport_is_connected()) {
+        return -1;
+    }
+    return esp_mqtt_client_publish(_config.mqtt_client, topic, data, len, qos, 0);
+}
+
+int datalink_mqtt_subscribe(const char* topic, int qos)
+{
+    if (_config.mqtt_client == NULL) {
+        return -1;
+    }
+    return esp_mqtt_client_subscribe(_config.mqtt_client, topic, qos);
+}
+
+int datalink_mqtt_get_outbox_size(void)
+{
+    if (_config.mqtt_client == NULL) {
+        return -1;
+    }
+    return esp_mqtt_client_get_outbox_size(_config.mqtt_client);
+}
+
+bool datalink_send_event(data_link_event *event)
+{
+    eventbus_event *bus_event = eventbus_alloc(EVENTBUS_TOPIC_DATALINK);
+    if (bus_event == NULL) {
+        return false;
+    }
+    bus_event->datalink = *event;
+    eventbus_publish(bus_event);
+    return true;
 }
 
-void datalink_send_event(data_link_event *event)
+uint32_t datalink_get_mqtt_connected_seconds(void)
 {
-    xQueueSend(_config.datalink_event_queue, event, portMAX_DELAY);
+    int64_t since = _config.mqtt_connected_since_us;
+    return since ? (uint32_t)((esp_timer_get_time() - since) / 1000000) : 0;
 }
 
 void init_datalink(bool mqtt_enabled, bool azure_iot_enabled)
@@ -192,9 +602,25 @@ void init_datalink(bool mqtt_enabled, bool azure_iot_enabled)
     _config.enable_mqtt = mqtt_enabled;
     _config.enable_azure_iot = azure_iot_enabled;
 
-    _config.datalink_event_queue = xQueueCreate(20, sizeof(data_link_event));
+    // Azure IoT Hub identifies the device by its connection string, topics are MQTT only
+    init_topics();
+    init_uplinkseq();
+    init_sessionlog();
+    _config.downlink_router = router_create(_downlink_routes, sizeof _downlink_routes / sizeof _downlink_routes[0]);
+    _config.metrics_interval_ms = METRICS_INTERVAL_MS;
+    aziot_report_int(MQTT_CONFIG_METRICS_INTERVAL_TOPIC, METRICS_INTERVAL_MS / 1000);
+
+    _config.datalink_subscriber = eventbus_subscribe("datalink",
+        EVENTBUS_TOPIC_MASK(EVENTBUS_TOPIC_DATALINK) | EVENTBUS_TOPIC_MASK(EVENTBUS_TOPIC_DATALINK_URGENT),
+        EVENTBUS_PRIORITY_DATALINK,
+        EVENTBUS_OVERFLOW_BOUNDED_WAIT,
+        EVENTBUS_DATALINK_MAX_WAIT_MS / portTICK_PERIOD_MS);
     
+    transport_register(TRANSPORT_MQTT, &_mqtt_transport_ops, mqtt_enabled, mqtt_transport_notify);
+    transport_register(TRANSPORT_AZIOT, &_aziot_transport_ops, azure_iot_enabled, NULL);
+
     if (mqtt_enabled) {
+        _config.mqtt_uplink_ready = app_binary_semaphore_create();
         init_mqtt();
     }
 
@@ -203,32 +629,258 @@ void init_datalink(bool mqtt_enabled, bool azure_iot_enabled)
     }
 }
 
-static void datalink_process_body_detection_event(uint64_t start_epoch_second, uint64_t elapsed_second)
+void datalink_send_alert(int type, time_t start, uint32_t elapsed_second, uint32_t threshold_second)
+{
+    eventbus_event *bus_event = eventbus_alloc(EVENTBUS_TOPIC_DATALINK_URGENT);
+    if (bus_event == NULL) {
+        ESP_LOGE(LOG_TAG_MQTT, "no event for alert %s, dropped", overstay_get_alert_name(type));
+        return;
+    }
+    bus_event->datalink = (data_link_event) {
+        .event_type = DATA_LINK_EVENT_ALERT,
+        .alert_event = { type, start, elapsed_second, threshold_second },
+    };
+    eventbus_publish(bus_event);
+}
+
+static void datalink_process_alert_event(const data_link_alert_event* event)
+{
+    char data[96];
+    int len = snprintf(data, sizeof data, "{\"alert\":\"%s\",\"start\":%ld,\"elapsed\":%u,\"threshold\":%u}",
+        overstay_get_alert_name(event->type), (long)event->start, event->elapsed_second, event->threshold_second);
+    datalink_uplink(DATALINK_CLASS_ALERT, data, len);
+}
+
+int datalink_format_body_detection(char* data, size_t len, uint64_t start_epoch_second, uint64_t elapsed_ms)
+{
+    return snprintf(data, len, datalink_msg_body_detection, start_epoch_second, elapsed_ms / 1000, elapsed_ms);
+}
+
+static void datalink_process_body_detection_event(const data_link_body_detection_event* event)
 {
     static const int BUFFER_LEN = 100;
     char data[BUFFER_LEN + 1];
-    size_t len = snprintf((char *)data, BUFFER_LEN, datalink_msg_body_detection, start_epoch_second, elapsed_second);
+    uint64_t start_epoch_second = event->start_epoch_second;
+    uint64_t elapsed_second = event->elapsed_ms / 1000;
+    size_t len = datalink_format_body_detection(data, BUFFER_LEN, start_epoch_second, event->elapsed_ms);
     data[BUFFER_LEN] = 0;
-    aziot_send_str(data);
-    ESP_LOGI(LOG_TAG_MQTT, "sending body detection event, start epoch %" PRIu64 ", duration %" PRIu64 ", msg payload size: %" PRIu32,
-             start_epoch_second, elapsed_second, len);
+    uint32_t seq = datalink_uplink_confirmed(DATALINK_CLASS_SESSION, data, len, event->seq, event->on_delivered, event->delivered_context);
+    if (!event->logged) {
+        sessionlog_append((uint32_t)start_epoch_second, (uint32_t)elapsed_second, seq);
+        if (TRACE_REPLAY_ENABLED) {
+            trace_replay_record_session(start_epoch_second, elapsed_second);
+        }
+    }
+    APPLOG_I(LOG_TAG_MQTT, "sending body detection event, start epoch %u, duration %u, msg payload size: %u",
+             (uint32_t)start_epoch_second, (uint32_t)elapsed_second, len);
+}
+
+static void datalink_process_boot_timeline_event(void)
+{
+    char data[BOOT_TIMELINE_MAX_LEN];
+    int len = boot_format_timeline(data, sizeof data);
+    if (len >= (int)sizeof data) {
+        ESP_LOGE(LOG_TAG_MQTT, "boot timeline truncated, %d bytes", len);
+        return;
+    }
+    datalink_uplink(DATALINK_CLASS_TELEMETRY, data, len);
+    ESP_LOGI(LOG_TAG_MQTT, "sending boot timeline, msg payload size: %d", len);
+}
+
+static void datalink_process_load_test_event(uint32_t sequence)
+{
+    char data[LATENCY_BENCHMARK_UPLINK_PAYLOAD_BYTES + 1];
+    int len = snprintf(data, sizeof data, "{\"loadtest\": %u,\"pad\": \"", sequence);
+    while (len < LATENCY_BENCHMARK_UPLINK_PAYLOAD_BYTES - 2) {
+        data[len++] = 'x';
+    }
+    data[len++] = '"';
+    data[len++] = '}';
+    data[len] = 0;
+    datalink_uplink(DATALINK_CLASS_LOAD_TEST, data, len);
+}
+
+static void datalink_process_metrics(void)
+{
+    // too big for the task stack, and only this task formats metrics
+    static char data[METRICS_JSON_MAX_LEN];
+    metrics_sample();
+    const metrics_snapshot *snapshot = metrics_lock_latest();
+    int len = metrics_format_json(snapshot, data, sizeof data);
+    metrics_unlock_latest();
+    if (len >= (int)sizeof data) {
+        ESP_LOGE(LOG_TAG_MQTT, "metrics truncated, %d bytes", len);
+        return;
+    }
+    datalink_uplink(DATALINK_CLASS_TELEMETRY, data, len);
+    APPLOG_I(LOG_TAG_MQTT, "sending metrics, msg payload size: %d", len);
+}
+
+typedef struct datalink_history_reply_t {
+    bool active;
+    sessionlog_cursor cursor;
+    TickType_t waiting_since; // for room in the bulk lane
+    uint32_t id;
+    uint32_t part;
+    size_t total;
+    size_t count; // in the current chunk
+    int len;
+    bool truncated;
+    char data[SESSIONLOG_REPLY_MAX_LEN];
+} datalink_history_reply;
+
+// only this task runs queries, and the chunk is too big for its stack
+static datalink_history_reply _history_reply;
+
+static void datalink_history_flush(datalink_history_reply* reply, bool last)
+{
+    reply->len += snprintf(reply->data + reply->len, sizeof reply->data - reply->len, "]%s}",
+        !last ? "" : reply->truncated ? ",\"last\":true,\"truncated\":true" : ",\"last\":true");
+    datalink_uplink(DATALINK_CLASS_HISTORY, reply->data, reply->len);
+    ++reply->part;
+}
+
+static bool datalink_history_emit(const sessionlog_record* record, void* context)
+{
+    datalink_history_reply* reply = context;
+    if (reply->total == SESSIONLOG_QUERY_MAX_RECORDS) {
+        reply->truncated = true;
+        return false;
+    }
+    reply->len += snprintf(reply->data + reply->len, sizeof reply->data - reply->len, "%s[%u,%u,%u]",
+        reply->count ? "," : "", record->start_epoch_second, record->elapsed_second, sessionlog_record_seq(record));
+    ++reply->count;
+    ++reply->total;
+    return reply->count < SESSIONLOG_REPLY_RECORDS;
+}
+
+static void datalink_process_history_query(const data_link_history_query* query)
+{
+    _Static_assert(SESSIONLOG_REPLY_RECORDS * sizeof("[4294967295,4294967295,4294967295],") + 64 < SESSIONLOG_REPLY_MAX_LEN,
+        "SESSIONLOG_REPLY_MAX_LEN too small");
+    datalink_history_reply* reply = &_history_reply;
+
+    if (reply->active) {
+        ESP_LOGE(LOG_TAG_MQTT, "history query %u ignored, %u still running", query->id, reply->id);
+        return;
+    }
+    memset(reply, 0, sizeof *reply);
+    reply->id = query->id;
+    if (query->last_count) {
+        sessionlog_query_last(&reply->cursor, query->last_count);
+    } else {
+        sessionlog_query_range(&reply->cursor, query->from_epoch_second, query->to_epoch_second);
+    }
+    reply->active = true;
+    reply->waiting_since = xTaskGetTickCount();
+}
+
+// One chunk per call, from the event loop, so a long reply never holds up the events behind
+// it. Paced by the bulk lane of the transport the reply goes out on, a long reply must not push
+// telemetry out of it. Returns false while waiting for room
+static bool datalink_history_step(void)
+{
+    datalink_history_reply* reply = &_history_reply;
+
+    transport_stats stats;
+    transport_get_stats(datalink_route_target(&_class_routes[DATALINK_CLASS_HISTORY]), &stats);
+    if (stats.lanes[TRANSPORT_LANE_BULK].queued >= TRANSPORT_QUEUE_DEPTH / 2) {
+        if (stats.health == TRANSPORT_HEALTH_DOWN
+            || xTaskGetTickCount() - reply->waiting_since > SESSIONLOG_REPLY_STALL_MS / portTICK_PERIOD_MS) {
+            ESP_LOGE(LOG_TAG_MQTT, "history query %u stalled after %u chunks", reply->id, reply->part);
+            reply->active = false;
+        }
+        return false;
+    }
+
+    reply->count = 0;
+    reply->len = snprintf(reply->data, sizeof reply->data, "{\"id\":%u,\"part\":%u,\"sessions\":[", reply->id, reply->part);
+    // the final chunk, possibly empty, carries "last"
+    bool last = !sessionlog_query_resume(&reply->cursor, datalink_history_emit, reply) || reply->truncated;
+    datalink_history_flush(reply, last);
+    reply->waiting_since = xTaskGetTickCount();
+    if (last) {
+        reply->active = false;
+        ESP_LOGI(LOG_TAG_MQTT, "history query %u: %u sessions in %u chunks%s", reply->id, reply->total, reply->part,
+            reply->truncated ? ", truncated" : "");
+    }
+    return true;
+}
+
+// From the MQTT event or the aziot task
+static void datalink_session_summary_delivered(void* context)
+{
+    sessionstats_summary_delivered((int32_t)(intptr_t)context);
+}
+
+static void datalink_process_session_stats(void)
+{
+    static char data[SESSIONSTATS_SUMMARY_MAX_LEN];
+    if (!timeman_is_time_set()) {
+        return;
+    }
+    int32_t day;
+    int len = sessionstats_service(time(NULL), data, sizeof data, &day);
+    if (len == 0) {
+        return;
+    }
+    if (len >= (int)sizeof data) {
+        // it would never fit, don't retry it
+        ESP_LOGE(LOG_TAG_MQTT, "session summary truncated, %d bytes", len);
+        sessionstats_summary_delivered(day);
+        return;
+    }
+    datalink_uplink_confirmed(DATALINK_CLASS_SESSION_SUMMARY, data, len, 0, datalink_session_summary_delivered, (void*)(intptr_t)day);
+    ESP_LOGI(LOG_TAG_MQTT, "sending session summary, msg payload size: %d", len);
+    sessionstats_summary_sent(day);
 }
 
 static void datalink_event_loop_task(void *arg)
 {
     UNUSED(arg);
+    TickType_t metrics_due = xTaskGetTickCount() + _config.metrics_interval_ms / portTICK_PERIOD_MS;
     for (;;) {
         heap_caps_check_integrity_all(true);
-        data_link_event event = {};
-        if (xQueueReceive(_config.datalink_event_queue, &event, portMAX_DELAY)) {
-            switch (event.event_type) {
+
+        // metrics are sampled here rather than from a timer callback, so the timer service task
+        // never waits on the datalink queue
+        TickType_t wait = metrics_due - xTaskGetTickCount();
+        if ((int32_t)wait <= 0) {
+            datalink_process_metrics();
+            datalink_process_session_stats();
+            metrics_due = xTaskGetTickCount() + _config.metrics_interval_ms / portTICK_PERIOD_MS;
+            continue;
+        }
+        if (_history_reply.active) {
+            bool sent = datalink_history_step();
+            // straight on to the next chunk unless an event is waiting, else poll for room
+            wait = MIN(wait, sent ? 0 : SESSIONLOG_REPLY_POLL_MS / portTICK_PERIOD_MS);
+        }
+
+        eventbus_event *bus_event = eventbus_receive(_config.datalink_subscriber, wait);
+        if (bus_event != NULL) {
+            const data_link_event *event = &bus_event->datalink;
+            switch (event->event_type) {
                 case DATA_LINK_EVENT_BODY_DETECTION:
-                    datalink_process_body_detection_event(event.body_detection_event.start_epoch_second, event.body_detection_event.elapsed_second);
+                    datalink_process_body_detection_event(&event->body_detection_event);
+                    break;
+                case DATA_LINK_EVENT_BOOT_TIMELINE:
+                    datalink_process_boot_timeline_event();
+                    break;
+                case DATA_LINK_EVENT_LOAD_TEST:
+                    datalink_process_load_test_event(event->load_test_sequence);
+                    break;
+                case DATA_LINK_EVENT_HISTORY_QUERY:
+                    datalink_process_history_query(&event->history_query);
+                    break;
+                case DATA_LINK_EVENT_ALERT:
+                    datalink_process_alert_event(&event->alert_event);
                     break;
                 default:
-                    ESP_LOGE(LOG_TAG_MQTT, "uknown datalink event type: %d", event.event_type);
+                    ESP_LOGE(LOG_TAG_MQTT, "uknown datalink event type: %d", event->event_type);
                     break;
             }
+            eventbus_release(bus_event);
         }
     }
 }
@@ -237,11 +889,12 @@ void start_datalink(void)
 {
     if (_config.enable_mqtt) {
         start_mqtt();
+        app_task_start(APP_TASK_MQTT_UPLINK, mqtt_uplink_task, NULL);
     }
 
     if (_config.enable_azure_iot) {
         aziot_start();
     }
 
-    xTaskCreate(datalink_event_loop_task, "datalink_event_loop", 4096, NULL, 0, NULL);
+    app_task_start(APP_TASK_DATALINK, datalink_event_loop_task, NULL);
 }
\ No newline at end of file
@@ -25,7 +25,10 @@
 #ifndef DATALINK_H
 #define DATALINK_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "mqtt_client.h"
 
@@ -37,21 +40,63 @@ void start_datalink();
 void publish_device_status();
 
 typedef enum data_link_event_type_t {
-    DATA_LINK_EVENT_BODY_DETECTION
+    DATA_LINK_EVENT_BODY_DETECTION,
+    DATA_LINK_EVENT_BOOT_TIMELINE,
+    DATA_LINK_EVENT_LOAD_TEST, // latency benchmark builds only
+    DATA_LINK_EVENT_HISTORY_QUERY,
+    DATA_LINK_EVENT_ALERT,
 } data_link_event_type;
 
 typedef struct data_link_body_detection_event_t {
     uint64_t start_epoch_second;
-    uint64_t elapsed_second;
+    uint64_t elapsed_ms;
+    uint32_t seq; // 0 takes the next one, a resend carries the seq of its first send
+    bool logged; // already in the flash history, from an earlier send
+    // may be NULL. Called from a transport's task once it got the session acknowledged
+    void (*on_delivered)(void* context);
+    void* delivered_context;
 } data_link_body_detection_event;
 
+typedef struct data_link_alert_event_t {
+    int type; // overstay_alert_type
+    time_t start;
+    uint32_t elapsed_second;
+    uint32_t threshold_second;
+} data_link_alert_event;
+
+// Either a time range or the last count sessions
+typedef struct data_link_history_query_t {
+    uint32_t id; // echoed in every reply chunk
+    uint32_t from_epoch_second;
+    uint32_t to_epoch_second;
+    uint32_t last_count; // 0 for a range
+} data_link_history_query;
+
 typedef struct data_link_event_t {
     data_link_event_type event_type;
     union {
         data_link_body_detection_event body_detection_event;
+        uint32_t load_test_sequence;
+        data_link_history_query history_query;
+        data_link_alert_event alert_event;
     };
 } data_link_event;
 
-void datalink_send_event(data_link_event *event);
+// Returns false if the event couldn't be queued
+bool datalink_send_event(data_link_event *event);
+// Handed to the datalink task ahead of its other events, formatted and sequenced there and
+// uplinked ahead of every other lane. The caller only waits while the datalink queue is full
+void datalink_send_alert(int type, time_t start, uint32_t elapsed_second, uint32_t threshold_second);
+// The session uplink payload, returns its length
+int datalink_format_body_detection(char* data, size_t len, uint64_t start_epoch_second, uint64_t elapsed_ms);
+// Applies a config topic relative to the device's config prefix, from any downlink
+bool datalink_process_config(const char* topic, int topic_len, const char* data, int data_len);
+// 0 while the MQTT client is not connected
+uint32_t datalink_get_mqtt_connected_seconds(void);
+
+// Straight to the MQTT client, bypassing the uplink queues. For the fleet simulator
+int datalink_mqtt_publish(const char* topic, const char* data, int len, int qos); // -1 while not connected
+int datalink_mqtt_subscribe(const char* topic, int qos); // -1 without an MQTT client
+int datalink_mqtt_get_outbox_size(void); // -1 without an MQTT client
 
 #endif // DATALINK_H
@@ -26,41 +26,98 @@
 #include <time.h>
 
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
 #include "freertos/task.h"
 #include "freertos/timers.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs.h"
 
 #include "global.h"
 
+#include "applog.h"
+#include "aziot.h"
 #include "bodydetection.h"
+#include "boot.h"
 #include "datalink.h"
 #include "devicecontrollogic.h"
+#include "eventbus.h"
+#include "gracelearn.h"
 #include "led.h"
+#include "overstay.h"
+#include "sessionstats.h"
+#include "status.h"
+#include "tasks.h"
 #include "timeman.h"
+#include "tracereplay.h"
 #include "wifi.h"
 
 #define NVS_KEY_CONFIG_BODY_DETECTION_ENABLED "bodydet"
 #define NVS_KEY_CONFIG_BODY_DETECTION_GRACE_PERIOD "bodydetdelay"
+#define NVS_KEY_CONFIG_BODY_DETECTION_ADAPTIVE "bodydetadapt"
 
 typedef struct body_detection_info_t {
     time_t start_time; // 0 if out of grace period
+    int64_t start_us; // monotonic, durations never see wall clock steps
+    int64_t gone_us; // monotonic, last time the body left, 0 if unknown
 } body_detection_info;
 
 typedef struct device_control_config_t {
     bool body_detection_enabled;
+    bool body_detected; // as of the last edge handled
     uint body_detection_delay_seconds;
+    bool body_detection_adaptive;
     body_detection_info body_detection_info;
 } device_control_config;
 
 static device_control_config _config;
 
-static xQueueHandle _device_control_event_queue;
+static eventbus_subscriber* _device_control_subscriber;
 static TimerHandle_t _body_detection_grace_period_timer;
+// bumped whenever the grace period timer is started or stopped, an expiry of an older one is stale
+static volatile uint32_t _grace_period_generation;
 static nvs_handle _nvs_config_handle;
 static TickType_t _body_detection_delay_grace_period_ticks;
+static unsigned int _body_detection_grace_period_seconds; // in effect, configured or learned
+static device_control_latency_stats _edge_latency;
+static volatile uint32_t _session_count; // completed since boot
+
+// Trace replay runs sessions on its own virtual clock, grace periods included
+#if TRACE_REPLAY_ENABLED
+#define GRACE_PERIOD_TICKS(seconds) ((seconds) * 1000 / TRACE_REPLAY_SPEEDUP / portTICK_PERIOD_MS)
+
+static int64_t device_control_monotonic_us(int64_t timer_us)
+{
+    return trace_replay_monotonic_us(timer_us);
+}
+
+static int64_t device_control_epoch_offset_us(void)
+{
+    return (int64_t)TRACE_REPLAY_EPOCH * 1000000;
+}
+
+static bool device_control_is_time_set(void)
+{
+    return true;
+}
+#else
+#define GRACE_PERIOD_TICKS(seconds) ((seconds) * 1000 / portTICK_PERIOD_MS)
+
+static int64_t device_control_monotonic_us(int64_t timer_us)
+{
+    return timer_us;
+}
+
+static int64_t device_control_epoch_offset_us(void)
+{
+    return timeman_get_epoch_offset_us();
+}
+
+static bool device_control_is_time_set(void)
+{
+    return timeman_is_time_set();
+}
+#endif
 
 
 
@@ -75,95 +132,220 @@ inline static void write_nvs_config_body_detection_grace_period(uint delay)
     nvs_set_u32(_nvs_config_handle, NVS_KEY_CONFIG_BODY_DETECTION_GRACE_PERIOD, delay);
 }
 
+inline static void write_nvs_config_body_detection_adaptive(bool adaptive)
+{
+    nvs_set_u8(_nvs_config_handle, NVS_KEY_CONFIG_BODY_DETECTION_ADAPTIVE, adaptive);
+}
+
+// Picks the learned grace period in adaptive mode, once there is one. Takes effect the next
+// time the body leaves, a grace period already running keeps its length
+static void update_grace_period(void)
+{
+    unsigned int seconds = _config.body_detection_delay_seconds;
+    if (_config.body_detection_adaptive && gracelearn_get() != 0) {
+        seconds = gracelearn_get();
+    }
+    if (seconds == _body_detection_grace_period_seconds) {
+        return;
+    }
+    _body_detection_grace_period_seconds = seconds;
+    _body_detection_delay_grace_period_ticks = MAX(GRACE_PERIOD_TICKS(seconds), 1);
+    APPLOG_I(LOG_TAG_DEVICE_CONTROL, "grace period now %us", seconds);
+}
+
+// Runs in the timer service task, which must never block. The session is closed by device control
 void body_detection_grace_period_timeout(TimerHandle_t xTimer)
 {
     UNUSED(xTimer);
-    time_t now;
-    time(&now);
-
-    unsigned int elapsed = now - _config.body_detection_info.start_time;
+    device_control_event event = {
+        .event_type = DEVICE_CONTROL_EVENT_BODY_DETECTION_GRACE_PERIOD_EXPIRED,
+        .grace_period_generation = _grace_period_generation,
+    };
+    device_control_send_event(&event);
+}
 
-    ESP_LOGI(LOG_TAG_DEVICE_CONTROL, "body detection grace period timed out. total time elapsed: %us", elapsed);
+// end_us is the monotonic time the grace period expired, the session runs from edge to expiry
+static void body_detection_session_end(int64_t end_us)
+{
+    uint32_t elapsed_ms = (end_us - _config.body_detection_info.start_us) / 1000;
+    unsigned int elapsed = elapsed_ms / 1000;
+
+    APPLOG_I(LOG_TAG_DEVICE_CONTROL, "body detection grace period timed out. total time elapsed: %ums", elapsed_ms);
+
+    eventbus_event* event = eventbus_alloc(EVENTBUS_TOPIC_DATALINK);
+    if (event != NULL) {
+        event->datalink.event_type = DATA_LINK_EVENT_BODY_DETECTION;
+        event->datalink.body_detection_event = (data_link_body_detection_event) {
+            .start_epoch_second = _config.body_detection_info.start_time,
+            .elapsed_ms = elapsed_ms,
+        };
+        eventbus_publish(event);
+    }
 
-    // TODO: add it to mqtt send queue
-    data_link_event event = {
-        .event_type = DATA_LINK_EVENT_BODY_DETECTION,
-        .body_detection_event = {
-            .elapsed_second = elapsed,
-            .start_epoch_second = _config.body_detection_info.start_time }
-    };
-    datalink_send_event(&event);
+    sessionstats_record(_config.body_detection_info.start_time, elapsed);
+    overstay_on_session_end(_config.body_detection_info.start_time, elapsed);
+    ++_session_count;
 
     // reset
     _config.body_detection_info.start_time = 0;
 }
 
+// Ready to report is the first cloud connection, on whichever transport comes up first
+static void device_control_mark_ready(void)
+{
+    if (boot_is_ready()) {
+        return;
+    }
+    boot_mark_ready();
+    data_link_event timeline = { .event_type = DATA_LINK_EVENT_BOOT_TIMELINE };
+    datalink_send_event(&timeline);
+}
+
+// PIR edge, stamped by the bus in the ISR, to the state change in device control
+static void record_edge_latency(int64_t published_us)
+{
+    int64_t latency = esp_timer_get_time() - published_us;
+    unsigned int bucket = 0;
+    while (bucket < DEVICE_CONTROL_LATENCY_BUCKETS - 1 && (latency >> (bucket + 1)) > 0) {
+        ++bucket;
+    }
+
+    if (_edge_latency.count == 0 || latency < _edge_latency.min_us) {
+        _edge_latency.min_us = latency;
+    }
+    _edge_latency.max_us = MAX(_edge_latency.max_us, latency);
+    _edge_latency.total_us += latency;
+    ++_edge_latency.histogram[bucket];
+    ++_edge_latency.count;
+}
+
 static void device_control_task(void* arg)
 {
     UNUSED(arg);
     for (;;) {
         heap_caps_check_integrity_all(true);
-        device_control_event event = {};
-        if (xQueueReceive(_device_control_event_queue, &event, portMAX_DELAY)) {
-            switch (event.event_type) {
+        eventbus_event* bus_event = eventbus_receive(_device_control_subscriber, portMAX_DELAY);
+        if (bus_event != NULL) {
+            const device_control_event* event = &bus_event->device_control;
+            switch (event->event_type) {
             // Body detection
 
             // enable body detection
             case DEVICE_CONTROL_EVENT_BODY_DETECTION_ENABLED:
                 _config.body_detection_enabled = true;
                 write_nvs_config_body_detection_enabled(true);
+                aziot_report_bool(MQTT_CONFIG_BODY_DETECTION_ENABLED_TOPIC, true);
                 break;
 
             // disable body detection
             case DEVICE_CONTROL_EVENT_BODY_DETECTION_DISABLED:
                 _config.body_detection_enabled = false;
                 write_nvs_config_body_detection_enabled(false);
+                aziot_report_bool(MQTT_CONFIG_BODY_DETECTION_ENABLED_TOPIC, false);
                 break;
 
             // set body detection grace
             case DEVICE_CONTROL_EVENT_BODY_DETECTION_DELAY_CHANGED:
-                _config.body_detection_delay_seconds = event.body_detection_delay_seconds;
-                write_nvs_config_body_detection_grace_period(event.body_detection_delay_seconds);
-                _body_detection_delay_grace_period_ticks = _config.body_detection_delay_seconds * 1000 / portTICK_PERIOD_MS;
+                _config.body_detection_delay_seconds = event->body_detection_delay_seconds;
+                write_nvs_config_body_detection_grace_period(event->body_detection_delay_seconds);
+                aziot_report_int(MQTT_CONFIG_BODY_DETECTION_DELAY_TOPIC, event->body_detection_delay_seconds);
+                update_grace_period();
+                break;
+
+            // learn the grace period from the gaps between detections
+            case DEVICE_CONTROL_EVENT_BODY_DETECTION_ADAPTIVE_ENABLED:
+            case DEVICE_CONTROL_EVENT_BODY_DETECTION_ADAPTIVE_DISABLED:
+                _config.body_detection_adaptive = event->event_type == DEVICE_CONTROL_EVENT_BODY_DETECTION_ADAPTIVE_ENABLED;
+                write_nvs_config_body_detection_adaptive(_config.body_detection_adaptive);
+                aziot_report_bool(MQTT_CONFIG_BODY_DETECTION_ADAPTIVE_TOPIC, _config.body_detection_adaptive);
+                update_grace_period();
+                break;
+
+            // grace period over, the session ends
+            case DEVICE_CONTROL_EVENT_BODY_DETECTION_GRACE_PERIOD_EXPIRED:
+                // an edge handled since the timer fired restarted or stopped it, and may have closed
+                // this session already. The body may also have come back with its edge still queued,
+                // then the session goes on
+                if (event->grace_period_generation == _grace_period_generation
+                    && _config.body_detection_info.start_time != 0 && !get_body_detected()) {
+                    body_detection_session_end(device_control_monotonic_us(bus_event->published_us));
+                }
+                break;
+
+            // live session monitor
+            case DEVICE_CONTROL_EVENT_OVERSTAY_CHECK:
+                if (_config.body_detection_enabled && device_control_is_time_set()) {
+                    overstay_check(device_control_monotonic_us(esp_timer_get_time()), _config.body_detection_info.start_time,
+                        _config.body_detection_info.start_us, _config.body_detected);
+                }
+                break;
+            case DEVICE_CONTROL_EVENT_ALERT_OVERSTAY_CHANGED:
+                overstay_set_threshold(OVERSTAY_THRESHOLD_OVERSTAY, event->alert_threshold_seconds);
+                break;
+            case DEVICE_CONTROL_EVENT_ALERT_STUCK_CHANGED:
+                overstay_set_threshold(OVERSTAY_THRESHOLD_STUCK, event->alert_threshold_seconds);
                 break;
 
             // body detection triggered
             case DEVICE_CONTROL_EVENT_BODY_DETECTION_TRIGGERED: {
-                int detected = get_body_detected();
-                if (_config.body_detection_enabled && timeman_is_time_set()) { // only if time is set
+                // the level sampled with the edge, the pin may have moved on while it was queued
+                int detected = event->body_detected;
+                int64_t edge_us = device_control_monotonic_us(bus_event->published_us);
+                _config.body_detected = detected;
+                overstay_on_edge((edge_us + device_control_epoch_offset_us()) / 1000000, edge_us);
+                if (_config.body_detection_enabled && device_control_is_time_set()) { // only if time is set
                     if (detected) {
                         // stop the grace period timer, since
                         // 1. if it's in grace period now: we're merging two detections
                         // 2. if it's not in grace period: the timer isn't running anyway
                         // TODO:
+                        ++_grace_period_generation;
                         xTimerStop(_body_detection_grace_period_timer, portMAX_DELAY);
 
+                        // every gap feeds the histogram, merged or not, so departures are seen too
+
+                        // the expiry never arrived, e.g. dropped by a full bus. Close the session it would have
+                        int64_t grace_us = (int64_t)_body_detection_grace_period_seconds * 1000000;
+                        if (_config.body_detection_info.start_time != 0 && _config.body_detection_info.gone_us != 0
+                            && edge_us - _config.body_detection_info.gone_us > grace_us) {
+                            body_detection_session_end(_config.body_detection_info.gone_us + grace_us);
+                        }
+
+                        if (_config.body_detection_info.gone_us != 0) {
+                            uint32_t learned = gracelearn_get();
+                            gracelearn_record_gap((edge_us - _config.body_detection_info.gone_us) / 1000000);
+                            if (gracelearn_get() != learned) {
+                                aziot_report_int(MQTT_CONFIG_BODY_DETECTION_LEARNED_TOPIC, gracelearn_get());
+                                update_grace_period();
+                            }
+                        }
+                        _config.body_detection_info.gone_us = 0;
+
                         if (_config.body_detection_info.start_time == 0) {
                             // if this is a new detection, i.e. not in grace period
                             // store the time now as start time
                             // TODO:
-                            time_t now;
-                            time(&now);
-                            _config.body_detection_info.start_time = now;
-                            ESP_LOGI(LOG_TAG_DEVICE_CONTROL, "body detected out of grace period. start time of current detection is reset");
+                            // the epoch start is derived once from the edge, the duration stays monotonic
+                            _config.body_detection_info.start_us = edge_us;
+                            _config.body_detection_info.start_time = (edge_us + device_control_epoch_offset_us()) / 1000000;
+                            APPLOG_I(LOG_TAG_DEVICE_CONTROL, "body detected out of grace period. start time of current detection is reset");
                         } else {
                             // else, i.e. detected in grace period
                             // the start time is not changed
                             // TODO:
                             // do nothing
-                            ESP_LOGI(LOG_TAG_DEVICE_CONTROL, "body detected in grace period. start time of current detection kept");
+                            APPLOG_I(LOG_TAG_DEVICE_CONTROL, "body detected in grace period. start time of current detection kept");
                         }
                     } else {
                         // body has gone. start the grace period timer
-
-                        // xTimerChangePeriod is used becaust that the grace period could be changed. nowhere changes the timer period to new value
-                        // this function will start the dormant timer as well
-
-                        ESP_LOGI(LOG_TAG_DEVICE_CONTROL, "body no longer detected. grace period timer started");
-                        //xTimerChangePeriod(_body_detection_grace_period_timer, _body_detection_delay_grace_period_ticks, portMAX_DELAY);
-                        xTimerStart(_body_detection_grace_period_timer, portMAX_DELAY);
+                        // xTimerChangePeriod applies the grace period in effect and starts the dormant timer as well
+                        _config.body_detection_info.gone_us = edge_us;
+                        APPLOG_I(LOG_TAG_DEVICE_CONTROL, "body no longer detected. grace period timer started");
+                        ++_grace_period_generation;
+                        xTimerChangePeriod(_body_detection_grace_period_timer, _body_detection_delay_grace_period_ticks, portMAX_DELAY);
                     }
                 }
+                record_edge_latency(bus_event->published_us);
                 break;
             }
 
@@ -186,9 +368,24 @@ static void device_control_task(void* arg)
                 break;
             case DEVICE_CONTROL_EVENT_WIFI_FAILED:
                 break;
+
+            // IoT Hub
+            case DEVICE_CONTROL_EVENT_AZIOT_CONNECTED:
+                __device_status.cloud_status = DATALINK_STATUS_CONNECTED;
+                ESP_LOGI(LOG_TAG_DEVICE_CONTROL, "cloud connected");
+                device_control_mark_ready();
+                break;
+            case DEVICE_CONTROL_EVENT_MQTT_CONNECTED:
+                device_control_mark_ready();
+                break;
+            case DEVICE_CONTROL_EVENT_AZIOT_DISCONNECTED:
+                __device_status.cloud_status = DATALINK_STATUS_DISCONNECTED;
+                ESP_LOGI(LOG_TAG_DEVICE_CONTROL, "cloud disconnected");
+                break;
             default:
                 break;
             }
+            eventbus_release(bus_event);
         }
     }
 }
@@ -222,29 +419,96 @@ static void read_config_from_nvs()
     } else {
         ESP_LOGI(LOG_TAG_DEVICE_CONTROL, "config - body detection delay: %d", _config.body_detection_delay_seconds);
     }
+
+    uint8_t u8bodydet_adaptive;
+    err = nvs_get_u8(_nvs_config_handle, NVS_KEY_CONFIG_BODY_DETECTION_ADAPTIVE, &u8bodydet_adaptive);
+    _config.body_detection_adaptive = u8bodydet_adaptive;
+    if (err != ESP_OK) {
+        ESP_LOGE(LOG_TAG_DEVICE_CONTROL, "failed to read NVS config body detection adaptive: %s", esp_err_to_name(err));
+        _config.body_detection_adaptive = BODY_DETECTION_DEFAULT_ADAPTIVE;
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            write_nvs_config_body_detection_adaptive(BODY_DETECTION_DEFAULT_ADAPTIVE);
+        }
+    } else {
+        ESP_LOGI(LOG_TAG_DEVICE_CONTROL, "config - body detection adaptive: %s", u8bodydet_adaptive ? "enabled" : "disabled");
+    }
 }
 
 void init_device_control_logic()
 {
     memset(&_config, 0, sizeof _config);
     read_config_from_nvs();
-
-    _body_detection_delay_grace_period_ticks = _config.body_detection_delay_seconds * 1000 / portTICK_PERIOD_MS;
-    _body_detection_grace_period_timer = xTimerCreate("body_detection_timer",
+    init_sessionstats();
+    init_overstay();
+    aziot_report_bool(MQTT_CONFIG_BODY_DETECTION_ENABLED_TOPIC, _config.body_detection_enabled);
+    aziot_report_int(MQTT_CONFIG_BODY_DETECTION_DELAY_TOPIC, _config.body_detection_delay_seconds);
+    aziot_report_bool(MQTT_CONFIG_BODY_DETECTION_ADAPTIVE_TOPIC, _config.body_detection_adaptive);
+
+    update_grace_period();
+    _body_detection_grace_period_timer = app_timer_create(APP_TIMER_BODY_DETECTION_GRACE_PERIOD,
+        "body_detection_timer",
         _body_detection_delay_grace_period_ticks,
         pdFALSE,
-        (void*)0,
         body_detection_grace_period_timeout);
 
-    _device_control_event_queue = xQueueCreate(20, sizeof(device_control_event));
+    _device_control_subscriber = eventbus_subscribe("device_control",
+        EVENTBUS_TOPIC_MASK(EVENTBUS_TOPIC_DEVICE_CONTROL),
+        EVENTBUS_PRIORITY_DEVICE_CONTROL,
+        EVENTBUS_OVERFLOW_COALESCE,
+        0);
 }
 
 void start_device_control_logic()
 {
-    xTaskCreate(device_control_task, "device_control_task", 4096, NULL, 0, NULL);
+    app_task_start(APP_TASK_DEVICE_CONTROL, device_control_task, NULL);
+    start_overstay();
 }
 
 void device_control_send_event(device_control_event* event)
 {
-    xQueueSend(_device_control_event_queue, event, portMAX_DELAY);
+    eventbus_event* bus_event = eventbus_alloc(EVENTBUS_TOPIC_DEVICE_CONTROL);
+    if (bus_event == NULL) {
+        return;
+    }
+    bus_event->device_control = *event;
+    eventbus_publish(bus_event);
+}
+
+time_t device_control_get_body_detection_start_time(void)
+{
+    return _config.body_detection_info.start_time;
+}
+
+unsigned int device_control_get_body_detection_grace_period(void)
+{
+    return _body_detection_grace_period_seconds;
+}
+
+uint32_t device_control_get_session_count(void)
+{
+    return _session_count;
+}
+
+void device_control_get_edge_latency(device_control_latency_stats* stats)
+{
+    *stats = _edge_latency;
+}
+
+void device_control_reset_edge_latency(void)
+{
+    memset(&_edge_latency, 0, sizeof _edge_latency);
+}
+
+// Upper bound of the histogram bucket the percentile falls into
+int64_t device_control_latency_percentile(const device_control_latency_stats* stats, unsigned int percentile)
+{
+    uint32_t target = (stats->count * percentile + 99) / 100;
+    uint32_t seen = 0;
+    for (unsigned int i = 0; i < DEVICE_CONTROL_LATENCY_BUCKETS; ++i) {
+        seen += stats->histogram[i];
+        if (seen >= target && seen > 0) {
+            return MIN((int64_t)2 << i, stats->max_us);
+        }
+    }
+    return stats->max_us;
 }
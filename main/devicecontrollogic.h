@@ -25,6 +25,9 @@
 #ifndef DEVICECONTROLFLOW_H
 #define DEVICECONTROLFLOW_H
 
+#include <stdint.h>
+#include <time.h>
+
 #include "global.h"
 
 void init_device_control_logic();
@@ -35,6 +38,13 @@ typedef enum device_control_event_type_t {
     DEVICE_CONTROL_EVENT_BODY_DETECTION_DISABLED,
     DEVICE_CONTROL_EVENT_BODY_DETECTION_TRIGGERED,
     DEVICE_CONTROL_EVENT_BODY_DETECTION_DELAY_CHANGED,
+    DEVICE_CONTROL_EVENT_BODY_DETECTION_ADAPTIVE_ENABLED,
+    DEVICE_CONTROL_EVENT_BODY_DETECTION_ADAPTIVE_DISABLED,
+    DEVICE_CONTROL_EVENT_BODY_DETECTION_GRACE_PERIOD_EXPIRED,
+    DEVICE_CONTROL_EVENT_OVERSTAY_CHECK,
+    // one type per threshold, so coalescing never drops one for the other
+    DEVICE_CONTROL_EVENT_ALERT_OVERSTAY_CHANGED,
+    DEVICE_CONTROL_EVENT_ALERT_STUCK_CHANGED,
 
     DEVICE_CONTROL_EVENT_WIFI_DISCONNECTED,
     DEVICE_CONTROL_EVENT_WIFI_ASSOCIATED,
@@ -43,17 +53,38 @@ typedef enum device_control_event_type_t {
     DEVICE_CONTROL_EVENT_WIFI_FAILED,
 
     DEVICE_CONTROL_EVENT_MQTT_CONNECTED,
-    DEVICE_CONTROL_EVENT_MQTT_DISCONNECTED
+    DEVICE_CONTROL_EVENT_MQTT_DISCONNECTED,
+
+    DEVICE_CONTROL_EVENT_AZIOT_CONNECTED,
+    DEVICE_CONTROL_EVENT_AZIOT_DISCONNECTED
 } device_control_event_type;
 
+#define DEVICE_CONTROL_LATENCY_BUCKETS 21 // log2 microseconds, the last one catches everything above 1s
+
+typedef struct device_control_latency_stats_t {
+    uint32_t count;
+    int64_t min_us;
+    int64_t max_us;
+    int64_t total_us;
+    uint32_t histogram[DEVICE_CONTROL_LATENCY_BUCKETS];
+} device_control_latency_stats;
+
 typedef struct device_control_event_t {
     device_control_event_type event_type;
     union {
         int body_detected;
         unsigned int body_detection_delay_seconds;
+        unsigned int alert_threshold_seconds;
+        uint32_t grace_period_generation; // of the timer that expired
     };
 } device_control_event;
 
 void device_control_send_event(device_control_event *event);
+time_t device_control_get_body_detection_start_time(void);
+unsigned int device_control_get_body_detection_grace_period(void);
+uint32_t device_control_get_session_count(void);
+void device_control_get_edge_latency(device_control_latency_stats *stats);
+void device_control_reset_edge_latency(void);
+int64_t device_control_latency_percentile(const device_control_latency_stats *stats, unsigned int percentile);
 
 #endif // DEVICECONTROLFLOW_H
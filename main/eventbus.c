@@ -0,0 +1,451 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "global.h"
+
+#include "applog.h"
+#include "eventbus.h"
+#include "tasks.h"
+
+struct eventbus_subscriber_t {
+    const char* name;
+    uint32_t topic_mask;
+    int priority;
+    eventbus_overflow_policy policy;
+    TickType_t max_wait;
+
+    eventbus_event* ring[EVENTBUS_SUBSCRIBER_DEPTH];
+    size_t head;
+    size_t count;
+
+    eventbus_subscriber_stats stats;
+
+    SemaphoreHandle_t ready; // given whenever an event is queued
+    SemaphoreHandle_t space; // given whenever an event is taken out
+};
+
+typedef struct eventbus_config_t {
+    eventbus_event pool[EVENTBUS_POOL_SIZE];
+    eventbus_event* free_blocks[EVENTBUS_POOL_SIZE];
+    size_t free_count;
+    size_t free_low_water_mark;
+    uint32_t pool_exhausted;
+
+    eventbus_subscriber subscribers[EVENTBUS_MAX_SUBSCRIBERS];
+    eventbus_subscriber* dispatch_order[EVENTBUS_MAX_SUBSCRIBERS]; // sorted by priority, descending
+    size_t subscriber_count;
+} eventbus_config;
+
+static eventbus_config _config;
+static portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+
+void init_eventbus(void)
+{
+    memset(&_config, 0, sizeof _config);
+
+    for (size_t i = 0; i < EVENTBUS_POOL_SIZE; ++i) {
+        _config.free_blocks[i] = &_config.pool[i];
+    }
+    _config.free_count = EVENTBUS_POOL_SIZE;
+    _config.free_low_water_mark = EVENTBUS_POOL_SIZE;
+}
+
+eventbus_subscriber* eventbus_subscribe(const char* name, uint32_t topic_mask, int priority, eventbus_overflow_policy policy, TickType_t max_wait)
+{
+    SemaphoreHandle_t ready = app_binary_semaphore_create();
+    SemaphoreHandle_t space = app_binary_semaphore_create();
+    eventbus_subscriber* subscriber = NULL;
+
+    // boot phases subscribe concurrently, and events may already be flowing
+    portENTER_CRITICAL(&_lock);
+    if (_config.subscriber_count < EVENTBUS_MAX_SUBSCRIBERS) {
+        subscriber = &_config.subscribers[_config.subscriber_count];
+        subscriber->name = name;
+        subscriber->topic_mask = topic_mask;
+        subscriber->priority = priority;
+        subscriber->policy = policy;
+        subscriber->max_wait = max_wait;
+        subscriber->ready = ready;
+        subscriber->space = space;
+
+        size_t pos = _config.subscriber_count;
+        while (pos > 0 && _config.dispatch_order[pos - 1]->priority < priority) {
+            _config.dispatch_order[pos] = _config.dispatch_order[pos - 1];
+            --pos;
+        }
+        _config.dispatch_order[pos] = subscriber;
+        ++_config.subscriber_count;
+    }
+    portEXIT_CRITICAL(&_lock);
+
+    if (subscriber == NULL) {
+        ESP_LOGE(LOG_TAG_EVENTBUS, "too many subscribers, %s rejected", name);
+        abort();
+    }
+
+    ESP_LOGI(LOG_TAG_EVENTBUS, "%s subscribed, topics 0x%x, priority %d", name, topic_mask, priority);
+    return subscriber;
+}
+
+static eventbus_event* eventbus_pool_take(eventbus_topic topic)
+{
+    eventbus_event* event = NULL;
+
+    portENTER_CRITICAL_SAFE(&_lock);
+    if (_config.free_count > 0) {
+        event = _config.free_blocks[--_config.free_count];
+        _config.free_low_water_mark = MIN(_config.free_low_water_mark, _config.free_count);
+    } else {
+        ++_config.pool_exhausted;
+    }
+    portEXIT_CRITICAL_SAFE(&_lock);
+
+    if (event != NULL) {
+        memset(event, 0, sizeof *event);
+        event->topic = topic;
+        atomic_init(&event->refcount, 1);
+    }
+    return event;
+}
+
+eventbus_event* eventbus_alloc(eventbus_topic topic)
+{
+    eventbus_event* event = eventbus_pool_take(topic);
+    if (event == NULL) {
+        ESP_LOGE(LOG_TAG_EVENTBUS, "event pool exhausted, topic %d", topic);
+    }
+    return event;
+}
+
+eventbus_event* eventbus_alloc_from_isr(eventbus_topic topic)
+{
+    return eventbus_pool_take(topic);
+}
+
+void eventbus_release(eventbus_event* event)
+{
+    if (atomic_fetch_sub(&event->refcount, 1) != 1) {
+        return;
+    }
+
+    portENTER_CRITICAL_SAFE(&_lock);
+    _config.free_blocks[_config.free_count++] = event;
+    portEXIT_CRITICAL_SAFE(&_lock);
+}
+
+static int eventbus_event_type(const eventbus_event* event)
+{
+    switch (event->topic) {
+    case EVENTBUS_TOPIC_DEVICE_CONTROL:
+        return event->device_control.event_type;
+    case EVENTBUS_TOPIC_DATALINK:
+    case EVENTBUS_TOPIC_DATALINK_URGENT:
+        return event->datalink.event_type;
+    default:
+        return -1;
+    }
+}
+
+// Only events where the newest one supersedes the older ones. Edges, expiries and connection
+// transitions each matter on their own, losing one leaves the consumer in a stale state. A
+// falling edge replacing a rising one loses the session start and its timestamp. So does
+// every alert
+static bool eventbus_is_coalescible(const eventbus_event* event)
+{
+    if (event->topic == EVENTBUS_TOPIC_DATALINK_URGENT) {
+        return false;
+    }
+    if (event->topic != EVENTBUS_TOPIC_DEVICE_CONTROL) {
+        return true;
+    }
+    switch (event->device_control.event_type) {
+    case DEVICE_CONTROL_EVENT_BODY_DETECTION_TRIGGERED:
+    case DEVICE_CONTROL_EVENT_BODY_DETECTION_GRACE_PERIOD_EXPIRED:
+    case DEVICE_CONTROL_EVENT_WIFI_DISCONNECTED:
+    case DEVICE_CONTROL_EVENT_WIFI_ASSOCIATED:
+    case DEVICE_CONTROL_EVENT_WIFI_CONNECTED:
+    case DEVICE_CONTROL_EVENT_WIFI_CONNECTING:
+    case DEVICE_CONTROL_EVENT_WIFI_FAILED:
+    case DEVICE_CONTROL_EVENT_MQTT_CONNECTED:
+    case DEVICE_CONTROL_EVENT_MQTT_DISCONNECTED:
+    case DEVICE_CONTROL_EVENT_AZIOT_CONNECTED:
+    case DEVICE_CONTROL_EVENT_AZIOT_DISCONNECTED:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// Called with the lock held and the ring full. Removes the oldest queued event of the same
+// type, so the new one can go to the tail and order is kept. Returns it, or NULL if none matched
+static eventbus_event* eventbus_coalesce(eventbus_subscriber* subscriber, eventbus_event* event)
+{
+    if (!eventbus_is_coalescible(event)) {
+        return NULL;
+    }
+    int type = eventbus_event_type(event);
+    for (size_t i = 0; i < subscriber->count; ++i) {
+        size_t pos = (subscriber->head + i) % EVENTBUS_SUBSCRIBER_DEPTH;
+        eventbus_event* queued = subscriber->ring[pos];
+        if (queued->topic == event->topic && eventbus_event_type(queued) == type) {
+            for (size_t j = i + 1; j < subscriber->count; ++j) {
+                size_t next = (subscriber->head + j) % EVENTBUS_SUBSCRIBER_DEPTH;
+                subscriber->ring[pos] = subscriber->ring[next];
+                pos = next;
+            }
+            --subscriber->count;
+            return queued;
+        }
+    }
+    return NULL;
+}
+
+// Called with the lock held and room in the ring. Urgent events go behind the urgent ones
+// already queued and ahead of everything else
+static void eventbus_enqueue(eventbus_subscriber* subscriber, eventbus_event* event)
+{
+    size_t pos = subscriber->count;
+    if (event->topic == EVENTBUS_TOPIC_DATALINK_URGENT) {
+        pos = 0;
+        while (pos < subscriber->count && subscriber->ring[(subscriber->head + pos) % EVENTBUS_SUBSCRIBER_DEPTH]->topic == EVENTBUS_TOPIC_DATALINK_URGENT) {
+            ++pos;
+        }
+        for (size_t i = subscriber->count; i > pos; --i) {
+            subscriber->ring[(subscriber->head + i) % EVENTBUS_SUBSCRIBER_DEPTH] = subscriber->ring[(subscriber->head + i - 1) % EVENTBUS_SUBSCRIBER_DEPTH];
+        }
+    }
+    subscriber->ring[(subscriber->head + pos) % EVENTBUS_SUBSCRIBER_DEPTH] = event;
+    ++subscriber->count;
+}
+
+// Returns false if the event was dropped. Never blocks unless the subscriber asks for a
+// bounded wait, and never from an ISR
+static bool eventbus_deliver(eventbus_subscriber* subscriber, eventbus_event* event, bool from_isr, BaseType_t* woken)
+{
+    eventbus_event* evicted = NULL;
+    bool delivered = false;
+    bool wakeup = true;
+    bool may_wait = subscriber->policy == EVENTBUS_OVERFLOW_BOUNDED_WAIT && !from_isr && subscriber->max_wait > 0;
+    bool waiting = false;
+    TickType_t wait_start = 0;
+
+    for (;;) {
+        portENTER_CRITICAL_SAFE(&_lock);
+        if (subscriber->count == EVENTBUS_SUBSCRIBER_DEPTH) {
+            switch (subscriber->policy) {
+            case EVENTBUS_OVERFLOW_DROP_OLDEST:
+                evicted = subscriber->ring[subscriber->head];
+                subscriber->head = (subscriber->head + 1) % EVENTBUS_SUBSCRIBER_DEPTH;
+                --subscriber->count;
+                ++subscriber->stats.evicted;
+                break;
+            case EVENTBUS_OVERFLOW_COALESCE:
+                evicted = eventbus_coalesce(subscriber, event);
+                if (evicted != NULL) {
+                    ++subscriber->stats.coalesced;
+                    wakeup = false; // count ends up unchanged, the subscriber already knows
+                }
+                break;
+            default:
+                break;
+            }
+        }
+        if (!delivered && subscriber->count < EVENTBUS_SUBSCRIBER_DEPTH) {
+            eventbus_enqueue(subscriber, event);
+            subscriber->stats.high_water_mark = MAX(subscriber->stats.high_water_mark, subscriber->count);
+            delivered = true;
+        }
+        if (delivered) {
+            ++subscriber->stats.delivered;
+        }
+        portEXIT_CRITICAL_SAFE(&_lock);
+
+        if (delivered || !may_wait) {
+            break;
+        }
+
+        TickType_t now = xTaskGetTickCount();
+        if (!waiting) {
+            waiting = true;
+            wait_start = now;
+            ++subscriber->stats.waited;
+        } else if (now - wait_start >= subscriber->max_wait) {
+            break;
+        }
+        xSemaphoreTake(subscriber->space, subscriber->max_wait - (now - wait_start));
+    }
+
+    if (evicted != NULL) {
+        eventbus_release(evicted);
+    }
+
+    if (!delivered) {
+        portENTER_CRITICAL_SAFE(&_lock);
+        ++subscriber->stats.dropped;
+        portEXIT_CRITICAL_SAFE(&_lock);
+        eventbus_release(event);
+        return false;
+    }
+
+    if (!wakeup) {
+        return true;
+    }
+
+    if (from_isr) {
+        xSemaphoreGiveFromISR(subscriber->ready, woken);
+    } else {
+        xSemaphoreGive(subscriber->ready);
+    }
+    return true;
+}
+
+static void eventbus_dispatch(eventbus_event* event, bool from_isr, BaseType_t* woken)
+{
+    event->published_us = esp_timer_get_time();
+
+    eventbus_subscriber* dispatch_order[EVENTBUS_MAX_SUBSCRIBERS];
+    size_t subscriber_count;
+
+    portENTER_CRITICAL_SAFE(&_lock);
+    subscriber_count = _config.subscriber_count;
+    memcpy(dispatch_order, _config.dispatch_order, sizeof(eventbus_subscriber*) * subscriber_count);
+    portEXIT_CRITICAL_SAFE(&_lock);
+
+    for (size_t i = 0; i < subscriber_count; ++i) {
+        eventbus_subscriber* subscriber = dispatch_order[i];
+        if (!(subscriber->topic_mask & EVENTBUS_TOPIC_MASK(event->topic))) {
+            continue;
+        }
+
+        atomic_fetch_add(&event->refcount, 1);
+        if (!eventbus_deliver(subscriber, event, from_isr, woken)) {
+            // subscriber names are literals, safe to defer
+            APPLOG_W(LOG_TAG_EVENTBUS, "%s queue full, event dropped, topic %d, total dropped %u",
+                (uint32_t)(uintptr_t)subscriber->name, event->topic, subscriber->stats.dropped);
+        }
+    }
+
+    // publisher's reference
+    eventbus_release(event);
+}
+
+void eventbus_publish(eventbus_event* event)
+{
+    eventbus_dispatch(event, false, NULL);
+}
+
+void eventbus_publish_from_isr(eventbus_event* event, BaseType_t* higher_priority_task_woken)
+{
+    eventbus_dispatch(event, true, higher_priority_task_woken);
+}
+
+eventbus_event* eventbus_receive(eventbus_subscriber* subscriber, TickType_t ticks_to_wait)
+{
+    for (;;) {
+        eventbus_event* event = NULL;
+
+        portENTER_CRITICAL(&_lock);
+        if (subscriber->count > 0) {
+            event = subscriber->ring[subscriber->head];
+            subscriber->head = (subscriber->head + 1) % EVENTBUS_SUBSCRIBER_DEPTH;
+            --subscriber->count;
+        }
+        portEXIT_CRITICAL(&_lock);
+
+        if (event != NULL) {
+            xSemaphoreGive(subscriber->space);
+            return event;
+        }
+
+        if (xSemaphoreTake(subscriber->ready, ticks_to_wait) != pdTRUE) {
+            return NULL;
+        }
+    }
+}
+
+size_t eventbus_get_pending(const eventbus_subscriber* subscriber)
+{
+    return subscriber->count;
+}
+
+size_t eventbus_get_subscriber_count(void)
+{
+    return _config.subscriber_count;
+}
+
+eventbus_subscriber* eventbus_get_subscriber(size_t index)
+{
+    return index < _config.subscriber_count ? _config.dispatch_order[index] : NULL;
+}
+
+const char* eventbus_get_subscriber_name(const eventbus_subscriber* subscriber)
+{
+    return subscriber->name;
+}
+
+void eventbus_get_subscriber_stats(const eventbus_subscriber* subscriber, eventbus_subscriber_stats* stats)
+{
+    portENTER_CRITICAL(&_lock);
+    *stats = subscriber->stats;
+    stats->pending = subscriber->count;
+    portEXIT_CRITICAL(&_lock);
+}
+
+void eventbus_get_pool_stats(eventbus_pool_stats* stats)
+{
+    portENTER_CRITICAL(&_lock);
+    stats->free = _config.free_count;
+    stats->low_water_mark = _config.free_low_water_mark;
+    stats->exhausted = _config.pool_exhausted;
+    portEXIT_CRITICAL(&_lock);
+}
+
+void eventbus_log_stats(void)
+{
+    eventbus_pool_stats pool;
+    eventbus_get_pool_stats(&pool);
+    ESP_LOGI(LOG_TAG_EVENTBUS, "pool: free %u/%u, low water mark %u, exhausted %u",
+        pool.free, EVENTBUS_POOL_SIZE, pool.low_water_mark, pool.exhausted);
+
+    for (size_t i = 0; i < _config.subscriber_count; ++i) {
+        eventbus_subscriber_stats stats;
+        eventbus_get_subscriber_stats(_config.dispatch_order[i], &stats);
+        ESP_LOGI(LOG_TAG_EVENTBUS, "%s: pending %u, high water mark %u/%u, delivered %u, dropped %u, evicted %u, coalesced %u, waited %u",
+            _config.dispatch_order[i]->name, stats.pending, stats.high_water_mark, EVENTBUS_SUBSCRIBER_DEPTH,
+            stats.delivered, stats.dropped, stats.evicted, stats.coalesced, stats.waited);
+    }
+}
+
+size_t eventbus_get_static_size(void)
+{
+    return sizeof _config;
+}
@@ -0,0 +1,115 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#ifndef EVENTBUS_H
+#define EVENTBUS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "datalink.h"
+#include "devicecontrollogic.h"
+
+typedef enum eventbus_topic_t {
+    EVENTBUS_TOPIC_DEVICE_CONTROL,
+    EVENTBUS_TOPIC_DATALINK,
+    EVENTBUS_TOPIC_DATALINK_URGENT, // data_link_event too, queued ahead of every non-urgent event
+    EVENTBUS_TOPIC_BENCHMARK, // microbenchmark builds only
+} eventbus_topic;
+
+#define EVENTBUS_TOPIC_MASK(topic) (1u << (topic))
+
+// What happens when a subscriber's queue is full. Only BOUNDED_WAIT ever blocks the
+// publisher, and never from an ISR. Subscribers fed by ISRs, the timer service task or
+// the WiFi/MQTT event loops must use one of the non-blocking policies. Body detection edges,
+// grace period expiries and connection transitions are never coalesced, see
+// eventbus_is_coalescible.
+typedef enum eventbus_overflow_policy_t {
+    EVENTBUS_OVERFLOW_DROP_NEWEST, // the event being published is dropped
+    EVENTBUS_OVERFLOW_DROP_OLDEST, // the oldest queued event is evicted
+    EVENTBUS_OVERFLOW_COALESCE, // the queued event of the same type gives way, the new one is appended. Otherwise drop newest
+    EVENTBUS_OVERFLOW_BOUNDED_WAIT, // publisher waits up to max_wait, then drop newest
+} eventbus_overflow_policy;
+
+// Events live in a fixed pool. The publisher fills a block once and every subscriber
+// receives a pointer to the same block. The block returns to the pool when the last
+// reference is released.
+typedef struct eventbus_event_t {
+    eventbus_topic topic;
+    union {
+        device_control_event device_control;
+        data_link_event datalink;
+    };
+    int64_t published_us; // esp_timer time, stamped by the bus
+    atomic_int refcount;
+} eventbus_event;
+
+typedef struct eventbus_subscriber_t eventbus_subscriber;
+
+typedef struct eventbus_subscriber_stats_t {
+    uint32_t delivered;
+    uint32_t dropped;
+    uint32_t evicted;
+    uint32_t coalesced;
+    uint32_t waited; // deliveries that had to wait for space
+    size_t pending;
+    size_t high_water_mark;
+} eventbus_subscriber_stats;
+
+typedef struct eventbus_pool_stats_t {
+    size_t free;
+    size_t low_water_mark;
+    uint32_t exhausted;
+} eventbus_pool_stats;
+
+void init_eventbus(void);
+
+// Higher priority subscribers get the event first
+eventbus_subscriber* eventbus_subscribe(const char* name, uint32_t topic_mask, int priority, eventbus_overflow_policy policy, TickType_t max_wait);
+
+// Returns NULL if the pool is exhausted
+eventbus_event* eventbus_alloc(eventbus_topic topic);
+eventbus_event* eventbus_alloc_from_isr(eventbus_topic topic);
+
+// Takes over the publisher's reference
+void eventbus_publish(eventbus_event* event);
+void eventbus_publish_from_isr(eventbus_event* event, BaseType_t* higher_priority_task_woken);
+
+// Returns NULL on timeout. Release the event when done with it
+eventbus_event* eventbus_receive(eventbus_subscriber* subscriber, TickType_t ticks_to_wait);
+void eventbus_release(eventbus_event* event);
+
+size_t eventbus_get_pending(const eventbus_subscriber* subscriber);
+size_t eventbus_get_subscriber_count(void);
+eventbus_subscriber* eventbus_get_subscriber(size_t index);
+const char* eventbus_get_subscriber_name(const eventbus_subscriber* subscriber);
+void eventbus_get_subscriber_stats(const eventbus_subscriber* subscriber, eventbus_subscriber_stats* stats);
+void eventbus_get_pool_stats(eventbus_pool_stats* stats);
+void eventbus_log_stats(void);
+size_t eventbus_get_static_size(void);
+
+#endif // EVENTBUS_H
@@ -0,0 +1,246 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+#include "global.h"
+
+#include "datalink.h"
+#include "fleetsim.h"
+#include "tasks.h"
+#include "topics.h"
+#include "transport.h"
+
+#if FLEET_SIM_ENABLED
+
+#define FLEET_SIM_PAYLOAD "{\"sim\":%lld,\"s\":%u,\"d\":%u}"
+
+typedef struct fleet_sim_device_t {
+    char session_topic[MQTT_TOPIC_MAX_LEN];
+    bool occupied;
+    int64_t occupied_since_us;
+    int64_t next_change_us;
+} fleet_sim_device;
+
+typedef struct fleet_sim_latency_t {
+    uint32_t count;
+    int64_t total_us;
+    int64_t max_us;
+} fleet_sim_latency;
+
+typedef struct fleet_sim_state_t {
+    fleet_sim_device devices[FLEET_SIM_DEVICES];
+    char session_subscription[MQTT_TOPIC_MAX_LEN];
+    char ping_topic[MQTT_TOPIC_MAX_LEN];
+
+    // per report interval, the MQTT task updates them while the simulator reads and resets
+    portMUX_TYPE lock;
+    uint32_t published;
+    uint32_t publish_failed;
+    fleet_sim_latency sessions;
+    fleet_sim_latency pings;
+} fleet_sim_state;
+
+static fleet_sim_state _state = {
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+// Exponentially distributed, in real time
+static int64_t fleet_sim_draw_us(uint32_t mean_seconds)
+{
+    float uniform = (esp_random() + 1.0f) / 4294967297.0f; // (0, 1]
+    return (int64_t)(-logf(uniform) * mean_seconds * 1000000 / FLEET_SIM_SPEEDUP);
+}
+
+static void fleet_sim_record_latency(fleet_sim_latency* latency, int64_t published_us)
+{
+    int64_t us = esp_timer_get_time() - published_us;
+    portENTER_CRITICAL(&_state.lock);
+    ++latency->count;
+    latency->total_us += us;
+    latency->max_us = MAX(latency->max_us, us);
+    portEXIT_CRITICAL(&_state.lock);
+}
+
+static void fleet_sim_publish(const char* topic, int64_t now, unsigned int start, unsigned int duration)
+{
+    char data[64];
+    int len = snprintf(data, sizeof data, FLEET_SIM_PAYLOAD, now, start, duration);
+    bool sent = datalink_mqtt_publish(topic, data, len, FLEET_SIM_QOS) >= 0;
+
+    portENTER_CRITICAL(&_state.lock);
+    if (sent) {
+        ++_state.published;
+    } else {
+        ++_state.publish_failed;
+    }
+    portEXIT_CRITICAL(&_state.lock);
+}
+
+static void fleet_sim_step(fleet_sim_device* device, int64_t now)
+{
+    if (now < device->next_change_us) {
+        return;
+    }
+
+    if (device->occupied) {
+        // same session as datalink, virtual seconds
+        unsigned int duration = (now - device->occupied_since_us) * FLEET_SIM_SPEEDUP / 1000000;
+        fleet_sim_publish(device->session_topic, now, device->occupied_since_us / 1000000, duration);
+        device->next_change_us = now + fleet_sim_draw_us(FLEET_SIM_MEAN_VACANT_SECONDS);
+    } else {
+        device->occupied_since_us = now;
+        device->next_change_us = now + fleet_sim_draw_us(FLEET_SIM_MEAN_OCCUPIED_SECONDS);
+    }
+    device->occupied = !device->occupied;
+}
+
+static void fleet_sim_report(uint32_t interval_ms)
+{
+    portENTER_CRITICAL(&_state.lock);
+    uint32_t published = _state.published;
+    uint32_t failed = _state.publish_failed;
+    fleet_sim_latency sessions = _state.sessions;
+    fleet_sim_latency pings = _state.pings;
+    _state.published = 0;
+    _state.publish_failed = 0;
+    memset(&_state.sessions, 0, sizeof _state.sessions);
+    memset(&_state.pings, 0, sizeof _state.pings);
+    portEXIT_CRITICAL(&_state.lock);
+
+    ESP_LOGI(LOG_TAG_BENCHMARK, "fleet of %d: %u published (%u/min), %u failed, %u outbox bytes",
+        FLEET_SIM_DEVICES, published, published * 60000 / interval_ms, failed, datalink_mqtt_get_outbox_size());
+    ESP_LOGI(LOG_TAG_BENCHMARK, "fleet of %d: sessions %u back, latency mean %lldus max %lldus; config push %u back, mean %lldus max %lldus",
+        FLEET_SIM_DEVICES, sessions.count, sessions.count ? sessions.total_us / sessions.count : 0, sessions.max_us,
+        pings.count, pings.count ? pings.total_us / pings.count : 0, pings.max_us);
+}
+
+static void fleet_sim_task(void* arg)
+{
+    UNUSED(arg);
+    int64_t next_report = esp_timer_get_time() + FLEET_SIM_REPORT_INTERVAL_MS * 1000LL;
+    int64_t next_ping = esp_timer_get_time() + FLEET_SIM_CONFIG_PUSH_INTERVAL_MS * 1000LL;
+
+    for (;;) {
+        int64_t now = esp_timer_get_time();
+        for (int i = 0; i < FLEET_SIM_DEVICES; ++i) {
+            fleet_sim_step(&_state.devices[i], now);
+        }
+        if (now >= next_ping) {
+            fleet_sim_publish(_state.ping_topic, now, 0, 0);
+            next_ping += FLEET_SIM_CONFIG_PUSH_INTERVAL_MS * 1000LL;
+        }
+        if (now >= next_report) {
+            fleet_sim_report(FLEET_SIM_REPORT_INTERVAL_MS);
+            next_report += FLEET_SIM_REPORT_INTERVAL_MS * 1000LL;
+        }
+        vTaskDelay(FLEET_SIM_TICK_MS / portTICK_PERIOD_MS);
+    }
+}
+
+void fleet_sim_subscribe(esp_mqtt_client_handle_t client)
+{
+    // before start_fleet_sim it subscribes itself
+    if (_state.session_subscription[0] != 0) {
+        esp_mqtt_client_subscribe(client, _state.session_subscription, FLEET_SIM_QOS);
+    }
+}
+
+bool fleet_sim_process_message(const char* topic, int topic_len, const char* data, int data_len)
+{
+    // our payload, the device's own sessions don't carry it
+    char payload[64];
+    if (data_len <= 0 || data_len >= (int)sizeof payload) {
+        return false;
+    }
+    memcpy(payload, data, data_len);
+    payload[data_len] = 0;
+    long long published_us;
+    if (sscanf(payload, "{\"sim\":%lld", &published_us) != 1) {
+        return false;
+    }
+
+    // the ping comes back through the group config subscription, sessions through the simulator's
+    int ping_len = strlen(_state.ping_topic);
+    bool ping = topic_len == ping_len && memcmp(topic, _state.ping_topic, ping_len) == 0;
+    fleet_sim_record_latency(ping ? &_state.pings : &_state.sessions, published_us);
+    return true;
+}
+
+void start_fleet_sim(void)
+{
+    if (!transport_is_enabled(TRANSPORT_MQTT)) {
+        ESP_LOGE(LOG_TAG_BENCHMARK, "fleet simulator needs MQTT, not started");
+        return;
+    }
+
+    // virtual devices sit next to this one, so the broker sees the real topic shape
+    for (int i = 0; i < FLEET_SIM_DEVICES; ++i) {
+        fleet_sim_device* device = &_state.devices[i];
+        snprintf(device->session_topic, MQTT_TOPIC_MAX_LEN, MQTT_TOPIC_ROOT "/%s/%s/%.20s-%03d/s/" MQTT_SESSION_PUBLISH_TOPIC,
+            topics_get_site(), topics_get_group(), topics_get_device_id(), i);
+        device->next_change_us = esp_timer_get_time() + fleet_sim_draw_us(FLEET_SIM_MEAN_VACANT_SECONDS);
+    }
+    snprintf(_state.session_subscription, MQTT_TOPIC_MAX_LEN, MQTT_TOPIC_ROOT "/%s/%s/+/s/" MQTT_SESSION_PUBLISH_TOPIC,
+        topics_get_site(), topics_get_group());
+    snprintf(_state.ping_topic, MQTT_TOPIC_MAX_LEN, MQTT_TOPIC_ROOT "/%s/%s/" MQTT_TOPIC_ALL "/c/" FLEET_SIM_CONFIG_PUSH_TOPIC,
+        topics_get_site(), topics_get_group());
+    datalink_mqtt_subscribe(_state.session_subscription, FLEET_SIM_QOS);
+
+    ESP_LOGW(LOG_TAG_BENCHMARK, "fleet simulator enabled, %d virtual devices at QoS %d, time runs %dx",
+        FLEET_SIM_DEVICES, FLEET_SIM_QOS, FLEET_SIM_SPEEDUP);
+    app_task_start(APP_TASK_FLEET_SIM, fleet_sim_task, NULL);
+}
+
+#else
+
+void start_fleet_sim(void)
+{
+}
+
+void fleet_sim_subscribe(esp_mqtt_client_handle_t client)
+{
+    UNUSED(client);
+}
+
+bool fleet_sim_process_message(const char* topic, int topic_len, const char* data, int data_len)
+{
+    UNUSED(topic);
+    UNUSED(topic_len);
+    UNUSED(data);
+    UNUSED(data_len);
+    return false;
+}
+
+#endif // FLEET_SIM_ENABLED
@@ -35,23 +35,228 @@
 #define LED_1_PIN 4
 
 #define MQTT_BROKER_URL "mqtt://10.128.1.5"
-#define MQTT_BODY_DETECTION_PUBLISH_TOPIC "/status/poopal/bodydet"
+// mqtts:// verifies the broker against MQTT_BROKER_CA_PEM when creddef.h defines it,
+// e.g. the CA of a local mosquitto TLS listener.
+// Reconnects are what cost, a TLS handshake is hundreds of ms of CPU, so the session is
+// persistent (the broker keeps subscriptions and QoS 1 backlog) and keep-alive is long
+// enough to ride out short Wi-Fi stalls.
+#define MQTT_KEEPALIVE_SECONDS 120
+#define MQTT_RECONNECT_TIMEOUT_MS 5000
 
-#define MQTT_CONFIG_SUBSCRIBE_TOPIC "/config/poopal/#"
-#define MQTT_CONFIG_BODY_DETECTION_ENABLED_TOPIC "/config/poopal/bodydet/enabled"
-#define MQTT_CONFIG_BODY_DETECTION_DELAY_TOPIC "/config/poopal/bodydet/delay"
+// Topics are <root>/<site>/<group>/<device>/<kind>/<suffix>, kind is s (status, uplink) or
+// c (config, downlink). Config can target a device, its group (device "all"), its site
+// (group and device "all") or the whole fleet, so backends subscribe with + at fixed levels.
+// Segments are short on purpose, MQTT 3.1.1 has no topic aliases.
+// Device id, site and group are provisioned in NVS, see topics.c. The id falls back to the MAC.
+#define MQTT_TOPIC_ROOT "pp"
+#define MQTT_TOPIC_ALL "all"
+#define MQTT_TOPIC_DEFAULT_SITE "default"
+#define MQTT_TOPIC_DEFAULT_GROUP "default"
+#define MQTT_TOPIC_SEGMENT_MAX_LEN 24
+#define MQTT_TOPIC_MAX_LEN 96
+
+#define MQTT_BODY_DETECTION_PUBLISH_TOPIC "bd"
+#define MQTT_SESSION_PUBLISH_TOPIC "ss"
+#define MQTT_TELEMETRY_PUBLISH_TOPIC "tm"
+#define MQTT_LOAD_TEST_PUBLISH_TOPIC "lt"
+#define MQTT_SESSION_SUMMARY_PUBLISH_TOPIC "sm"
+#define MQTT_HISTORY_REPLY_PUBLISH_TOPIC "hr"
+#define MQTT_ALERT_PUBLISH_TOPIC "al"
+
+// relative to <root>/<site>/<group>/<device>/c/
+#define MQTT_CONFIG_BODY_DETECTION_ENABLED_TOPIC "bd/en"
+#define MQTT_CONFIG_BODY_DETECTION_DELAY_TOPIC "bd/delay"
+#define MQTT_CONFIG_BODY_DETECTION_ADAPTIVE_TOPIC "bd/adaptive"
+#define MQTT_CONFIG_BODY_DETECTION_LEARNED_TOPIC "bd/learned" // reported only
+#define MQTT_CONFIG_LOG_LEVEL_TOPIC "log/+" // + is the tag or "*", payload none/error/warn/info/debug/verbose
+#define MQTT_CONFIG_METRICS_INTERVAL_TOPIC "metrics/interval" // seconds, from the next report on
+#define MQTT_CONFIG_ALERT_OVERSTAY_TOPIC "alert/overstay" // seconds, 0 disables
+#define MQTT_CONFIG_ALERT_STUCK_TOPIC "alert/stuck" // seconds detecting without an edge, 0 disables
+#define MQTT_CONFIG_HISTORY_QUERY_TOPIC "history/query" // {"id":1,"from":T1,"to":T2} or {"id":1,"last":N}, replies on "hr"
+
+// Azure device twin. Desired properties are flattened into the config topics above, e.g.
+// {"bd":{"en":true}} is bd/en. Twin property names can't contain '.', so '_' in a name
+// stands for '.', e.g. {"log":{"app_led":"debug"}}. Reported properties use the same paths,
+// changes within AZIOT_REPORTED_BATCH_MS go out as one patch.
+#define AZIOT_TWIN_MAX_DEPTH 4
+#define AZIOT_TWIN_PATH_MAX_LEN 48
+#define AZIOT_REPORTED_MAX_PROPERTIES 16
+#define AZIOT_REPORTED_STRING_MAX_LEN 32
+#define AZIOT_REPORTED_BATCH_MS 2000
+#define AZIOT_REPORTED_FIRMWARE_VERSION "fw"
+#define AZIOT_REPORTED_DESIRED_VERSION "cfg/version"
+#define AZIOT_C2D_TOPIC_PROPERTY "topic" // cloud to device messages carry their config topic here
+
+// The SDK reconnects with exponential backoff and jitter, so a site coming back from an outage
+// doesn't hit the hub all at once. 0 retries forever
+#define AZIOT_RETRY_TIMEOUT_SECONDS 0
+#define AZIOT_KEEPALIVE_SECONDS 240
+#define AZIOT_DO_WORK_INTERVAL_MS 100
+#define AZIOT_BURST_INTERVAL_MS 10 // while connected with queued sends, e.g. right after a reconnect
+
+// Downlink routing, see router.c. ROUTER_INDEX_SIZE must be a power of two, at least twice the routes
+#define ROUTER_MAX_ROUTES 32
+#define ROUTER_INDEX_SIZE 64
+#define ROUTER_MAX_SHAPES 4 // distinct sets of "+" positions
+#define ROUTER_MAX_JSON_LEN 512
+#define ROUTER_INSTANCES (1 + MICROBENCH_ENABLED)
+
+// Uplink transports, see transport.c. Each has its own lanes and in-flight window, a full
+// lane drops its oldest message. A transport is degraded when it holds over half a lane's
+// worth of messages, its window has been full for TRANSPORT_STALL_MS or a message failed
+// within the last TRANSPORT_STALL_MS.
+// While both have messages waiting, sessions get TRANSPORT_LANE_SESSION_WEIGHT sends for
+// every TRANSPORT_LANE_BULK_WEIGHT of telemetry and history. Each session send takes up to
+// TRANSPORT_LANE_SESSION_BATCH queued sessions as one JSON array
+#define TRANSPORT_QUEUE_DEPTH 8 // per lane
+#define TRANSPORT_LANE_SESSION_WEIGHT 4
+#define TRANSPORT_LANE_SESSION_BATCH 4
+#define TRANSPORT_LANE_BULK_WEIGHT 1
+#define TRANSPORT_MQTT_WINDOW 4
+#define TRANSPORT_AZIOT_WINDOW 4
+#define TRANSPORT_STALL_MS 10000
+#define TRANSPORT_MQTT_PUMP_INTERVAL_MS 1000
 
 #define SMOOTH_AVERAGE_WEIGHT 0.5f
 
 #define DEVICE_STATUS_COLLECT_INTERVAL_MS 500
 
+// Statically allocated task stacks and RTOS objects, see tasks.h
+#define APP_STATIC_RAM_BUDGET_BYTES (40 * 1024)
+
+#define BOOT_MAX_PHASES 16
+#define BOOT_TIMELINE_MAX_LEN 512
+
+#define EVENTBUS_POOL_SIZE 48
+#define EVENTBUS_SUBSCRIBER_DEPTH 20
+#define EVENTBUS_MAX_SUBSCRIBERS 8
+#define EVENTBUS_PRIORITY_DEVICE_CONTROL 10
+#define EVENTBUS_PRIORITY_DATALINK 5
+#define EVENTBUS_DATALINK_MAX_WAIT_MS 100
+
 #define BODY_DETECTION_PIN 21
 #define BODY_DETECTION_DEFAULT_ENABLED true
 #define BODY_DETECTION_DEFAULT_GRACE_PERIOD_SECONDS 5
+#define BODY_DETECTION_DEFAULT_ADAPTIVE false
+
+// Adaptive grace period, learned from the last GRACELEARN_WINDOW gaps between detections.
+// Until GRACELEARN_MIN_GAPS are seen the configured delay is used
+#define GRACELEARN_WINDOW 256
+#define GRACELEARN_MIN_GAPS 40
+#define GRACELEARN_MIN_SECONDS 3
+#define GRACELEARN_MAX_SECONDS 120
 #define BODY_DETECTION_LOW_ACTIVE true // Inverted?
 
+// Battery mode: deep sleep between PIR edges, sessions are buffered in RTC memory and uplinked in batches.
+// BODY_DETECTION_PIN has to be an RTC IO for ext0 wakeup, otherwise the device stays awake.
+#define SLEEP_LOG_ENABLED false
+#define SLEEP_LOG_CAPACITY 32
+#define SLEEP_LOG_FLUSH_SESSIONS 16
+#define SLEEP_LOG_FLUSH_MAX_AGE_SECONDS (6 * 60 * 60)
+#define SLEEP_LOG_FLUSH_TIMEOUT_MS 60000
+
 #define DEVICE_STATUS_PUBLISH_INTERVAL_MS 2000
 
+// Edge to state change latency benchmark under heavy uplink load. It drives BODY_DETECTION_PIN
+// as an output so edges go through the real ISR path, disconnect the PIR sensor before enabling
+#define LATENCY_BENCHMARK_ENABLED 0
+#define LATENCY_BENCHMARK_EDGES 200
+#define LATENCY_BENCHMARK_EDGE_INTERVAL_MS 50
+#define LATENCY_BENCHMARK_BOUND_US 5000
+#define LATENCY_BENCHMARK_UPLINK_PAYLOAD_BYTES 512
+#define LATENCY_BENCHMARK_UPLINK_MAX_PENDING 8
+
+// Replays captured PIR edge traces (tracereplay.c) through device control, the grace period timer
+// and the session uplink, and checks the sessions against what the backend recorded. Device
+// control runs on a virtual clock TRACE_REPLAY_SPEEDUP times real time starting at
+// TRACE_REPLAY_EPOCH, the PIR sensor is ignored. Keep the speedup low enough that a tick is
+// well under a second of virtual time
+#define TRACE_REPLAY_ENABLED 0
+#define TRACE_REPLAY_SPEEDUP 10
+#define TRACE_REPLAY_EPOCH 1600000000
+#define TRACE_REPLAY_TOLERANCE_SECONDS 1
+#define TRACE_REPLAY_MAX_SESSIONS 32
+
+// Simulates FLEET_SIM_DEVICES more devices next to this one on the same MQTT connection to size
+// the broker: each publishes sessions with random occupancy on its own topic, and a config push
+// goes to the group every FLEET_SIM_CONFIG_PUSH_INTERVAL_MS. Both come back through the broker's
+// wildcard matching, the round trip is reported with the publish rate. Needs MQTT
+#define FLEET_SIM_ENABLED 0
+#define FLEET_SIM_DEVICES 64
+#define FLEET_SIM_QOS 1
+#define FLEET_SIM_SPEEDUP 60 // a virtual minute per second
+#define FLEET_SIM_MEAN_OCCUPIED_SECONDS 300
+#define FLEET_SIM_MEAN_VACANT_SECONDS 900
+#define FLEET_SIM_TICK_MS 50
+#define FLEET_SIM_CONFIG_PUSH_INTERVAL_MS 5000
+#define FLEET_SIM_CONFIG_PUSH_TOPIC "sim/ping" // no route, devices ignore it
+#define FLEET_SIM_REPORT_INTERVAL_MS 10000
+
+// Times the formatting, routing, bus and filter hot paths at boot and logs one JSON line per bench.
+// Results are kept in NVS with the ELF SHA of the build that produced them, the next different
+// build reports its delta against them. The first run saves a baseline, MICROBENCH_SAVE_BASELINE
+// makes every run replace it
+#define MICROBENCH_ENABLED 0
+#define MICROBENCH_SAVE_BASELINE 0
+#define MICROBENCH_REPEATS 9
+
+// Deferred logging: hot paths record into a ring that a low priority task formats onto UART.
+// APPLOG_RING_SIZE must be a power of two.
+#define APPLOG_RING_SIZE 64
+#define APPLOG_MAX_TAG_LEVELS 16
+#define APPLOG_DRAIN_INTERVAL_MS 20
+
+// Runtime metrics, sampled and uplinked by the datalink task. CPU shares are per mille of one
+// core over the interval, so they need CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+#define METRICS_INTERVAL_MS (5 * 60 * 1000)
+
+// Per day and per hour of day session aggregates, kept on the device and uplinked once the day is
+// over. Days and hours are in UTC plus SESSIONSTATS_UTC_OFFSET_SECONDS. Checked on every metrics
+// report, persisted to NVS at most every SESSIONSTATS_PERSIST_INTERVAL_S and when a day closes
+#define SESSIONSTATS_UTC_OFFSET_SECONDS 0
+#define SESSIONSTATS_PERSIST_INTERVAL_S (15 * 60)
+#define SESSIONSTATS_SUMMARY_MAX_LEN 800
+// resent until a transport confirms it
+#define SESSIONSTATS_SUMMARY_RETRY_S (10 * 60)
+// Per hour of day moving average of session length, the baseline for long stay alerts
+#define SESSIONSTATS_BASELINE_WEIGHT 0.05f
+#define SESSIONSTATS_BASELINE_MIN_SESSIONS 20
+
+// Live session monitor, checked every OVERSTAY_CHECK_INTERVAL_MS while body detection is on.
+// Alerts go out ahead of every queued uplink, once per session (stuck: once per edge):
+// overstay past the configured threshold, long stay past OVERSTAY_BASELINE_FACTOR times the
+// learned baseline of the hour, stuck when the sensor detects without an edge for too long
+#define OVERSTAY_CHECK_INTERVAL_MS 10000
+#define OVERSTAY_DEFAULT_SECONDS (60 * 60)
+#define OVERSTAY_STUCK_DEFAULT_SECONDS (4 * 60 * 60)
+#define OVERSTAY_BASELINE_FACTOR 4
+#define OVERSTAY_LONG_STAY_MIN_SECONDS (15 * 60)
+
+// Session history in the "sessionlog" partition (partitions.csv), 255 sessions per 4 KB sector,
+// the oldest sector is erased when it's full. Queries stream back in chunks over Azure IoT,
+// MQTT while it's down, one chunk per datalink loop while that transport's bulk lane has room,
+// checked every SESSIONLOG_REPLY_POLL_MS. They give up if it doesn't drain within
+// SESSIONLOG_REPLY_STALL_MS
+#define SESSIONLOG_PARTITION_LABEL "sessionlog"
+#define SESSIONLOG_PARTITION_SUBTYPE 0x40
+#define SESSIONLOG_MAX_SECTORS 64
+#define SESSIONLOG_REPLY_RECORDS 20
+#define SESSIONLOG_REPLY_MAX_LEN 900
+#define SESSIONLOG_QUERY_MAX_RECORDS 4096
+#define SESSIONLOG_REPLY_STALL_MS 30000
+#define SESSIONLOG_REPLY_POLL_MS 100
+
+// Sessions, alerts and summaries carry "boot" and "seq" for deduplication, see uplinkseq.h
+#define UPLINKSEQ_RESERVE_BLOCK 64
+#define METRICS_MAX_TASKS 24
+#define METRICS_JSON_MAX_LEN 2048
+
+// Local diagnostics: Prometheus text at /metrics, JSON at /status
+#define HTTP_SERVER_ENABLED true
+#define HTTP_SERVER_PORT 80
+#define HTTP_SERVER_CHUNK_LEN 256
+#define HTTP_SERVER_METRICS_MAX_AGE_MS 1000
+
 #define LOG_TAG_WIFI "app.wifi"
 #define LOG_TAG_APP "app"
 #define LOG_TAG_MQTT "app.mqtt"
@@ -60,6 +265,18 @@
 #define LOG_TAG_LED "app.led"
 #define LOG_TAG_TIMEMAN "app.timeman"
 #define LOG_TAG_AZIOT "app.aziot"
+#define LOG_TAG_SLEEP_LOG "app.sleeplog"
+#define LOG_TAG_EVENTBUS "app.eventbus"
+#define LOG_TAG_BENCHMARK "app.bench"
+#define LOG_TAG_APPLOG "app.log"
+#define LOG_TAG_METRICS "app.metrics"
+#define LOG_TAG_HTTP "app.http"
+#define LOG_TAG_TOPICS "app.topics"
+#define LOG_TAG_ROUTER "app.router"
+#define LOG_TAG_TRANSPORT "app.transport"
+#define LOG_TAG_SESSION_STATS "app.stats"
+#define LOG_TAG_SESSION_LOG "app.history"
+#define LOG_TAG_UPLINK_SEQ "app.seq"
 
 
 #define UNUSED(x) (void)(x)
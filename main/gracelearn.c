@@ -0,0 +1,110 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include <stdint.h>
+
+#include "esp_log.h"
+
+#include "global.h"
+
+#include "gracelearn.h"
+
+// Upper bounds in seconds, roughly logarithmic so bucket index works as log(gap).
+// The last bucket catches every departure longer than that
+static const uint16_t _bucket_limits[] = { 1, 2, 3, 4, 6, 8, 11, 15, 20, 30, 45, 60, 90, 120, 180, 300, 600, UINT16_MAX };
+#define GRACELEARN_BUCKETS (sizeof _bucket_limits / sizeof _bucket_limits[0])
+
+static uint16_t _histogram[GRACELEARN_BUCKETS];
+static uint32_t _total;
+static uint32_t _learned_seconds;
+
+static unsigned int gracelearn_bucket_of(uint32_t gap_second)
+{
+    unsigned int i = 0;
+    while (i < GRACELEARN_BUCKETS - 1 && gap_second >= _bucket_limits[i]) {
+        ++i;
+    }
+    return i;
+}
+
+// Otsu's split on the log scaled histogram: the cut maximizing the between class variance
+// separates dropouts from departures without assuming either distribution
+static uint32_t gracelearn_split(void)
+{
+    float sum = 0;
+    for (unsigned int i = 0; i < GRACELEARN_BUCKETS; ++i) {
+        sum += (float)i * _histogram[i];
+    }
+
+    float best = -1;
+    unsigned int best_cut = 0;
+    uint32_t below = 0;
+    float below_sum = 0;
+    for (unsigned int cut = 0; cut < GRACELEARN_BUCKETS - 1; ++cut) {
+        below += _histogram[cut];
+        below_sum += (float)cut * _histogram[cut];
+        uint32_t above = _total - below;
+        if (below == 0 || above == 0) {
+            continue;
+        }
+        float mean_below = below_sum / below;
+        float mean_above = (sum - below_sum) / above;
+        float variance = (float)below * above * (mean_below - mean_above) * (mean_below - mean_above);
+        if (variance > best) {
+            best = variance;
+            best_cut = cut;
+        }
+    }
+    // gaps below the limit of the cut bucket are merged into the visit
+    return MIN(MAX(_bucket_limits[best_cut], GRACELEARN_MIN_SECONDS), GRACELEARN_MAX_SECONDS);
+}
+
+void gracelearn_record_gap(uint32_t gap_second)
+{
+    ++_histogram[gracelearn_bucket_of(gap_second)];
+    ++_total;
+
+    // halve everything once the window is full, so old habits fade out
+    if (_total >= GRACELEARN_WINDOW) {
+        _total = 0;
+        for (unsigned int i = 0; i < GRACELEARN_BUCKETS; ++i) {
+            _histogram[i] /= 2;
+            _total += _histogram[i];
+        }
+    }
+
+    if (_total < GRACELEARN_MIN_GAPS) {
+        return;
+    }
+    uint32_t learned = gracelearn_split();
+    if (learned != _learned_seconds) {
+        ESP_LOGI(LOG_TAG_DEVICE_CONTROL, "learned grace period: %us over %u gaps", learned, _total);
+        _learned_seconds = learned;
+    }
+}
+
+uint32_t gracelearn_get(void)
+{
+    return _learned_seconds;
+}
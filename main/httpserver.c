@@ -0,0 +1,340 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_http_server.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "global.h"
+
+#include "boot.h"
+#include "devicecontrollogic.h"
+#include "eventbus.h"
+#include "httpserver.h"
+#include "metrics.h"
+#include "status.h"
+#include "tasks.h"
+#include "topics.h"
+#include "transport.h"
+
+// Responses are streamed as chunks. Constant text and formatted values are gathered into one
+// small buffer on the server task stack and flushed when it fills up, only constant text longer
+// than the whole buffer goes out straight from flash.
+typedef struct http_writer_t {
+    httpd_req_t* req;
+    char buffer[HTTP_SERVER_CHUNK_LEN];
+    size_t len;
+    esp_err_t err;
+} http_writer;
+
+static httpd_handle_t _server;
+// httpd runs one handler at a time on its task, a single scrape copy is enough
+static metrics_snapshot _scrape_snapshot;
+
+static void http_writer_flush(http_writer* writer)
+{
+    if (writer->len > 0 && writer->err == ESP_OK) {
+        writer->err = httpd_resp_send_chunk(writer->req, writer->buffer, writer->len);
+    }
+    writer->len = 0;
+}
+
+static void http_writer_const(http_writer* writer, const char* text)
+{
+    size_t len = strlen(text);
+    if (len > sizeof writer->buffer - writer->len) {
+        http_writer_flush(writer);
+    }
+    if (len <= sizeof writer->buffer) {
+        memcpy(writer->buffer + writer->len, text, len);
+        writer->len += len;
+    } else if (writer->err == ESP_OK) {
+        writer->err = httpd_resp_send_chunk(writer->req, text, len);
+    }
+}
+
+static void http_writer_printf(http_writer* writer, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+static void http_writer_printf(http_writer* writer, const char* format, ...)
+{
+    va_list args;
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        size_t space = sizeof writer->buffer - writer->len;
+        va_start(args, format);
+        int len = vsnprintf(writer->buffer + writer->len, space, format, args);
+        va_end(args);
+        if (len < (int)space) {
+            writer->len += len;
+            return;
+        }
+        // didn't fit, send what's buffered and retry into an empty buffer
+        http_writer_flush(writer);
+    }
+    ESP_LOGE(LOG_TAG_HTTP, "line longer than %d bytes dropped", HTTP_SERVER_CHUNK_LEN);
+}
+
+static esp_err_t http_writer_finish(http_writer* writer)
+{
+    http_writer_flush(writer);
+    if (writer->err == ESP_OK) {
+        writer->err = httpd_resp_send_chunk(writer->req, NULL, 0);
+    }
+    return writer->err;
+}
+
+static void http_metric_gauge(http_writer* writer, const char* type_line, const char* name, long long value)
+{
+    http_writer_const(writer, type_line);
+    http_writer_printf(writer, "%s %lld\n", name, value);
+}
+
+#define HTTP_METRIC(writer, type, name, value) \
+    http_metric_gauge(writer, "# TYPE " name " " type "\n", name, value)
+
+static esp_err_t http_metrics_handler(httpd_req_t* req)
+{
+    http_writer writer = { .req = req };
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+
+    // a copy, so a slow scraper never holds up the sampler while the socket blocks
+    metrics_snapshot* snapshot = &_scrape_snapshot;
+    metrics_refresh(HTTP_SERVER_METRICS_MAX_AGE_MS);
+    memcpy(snapshot, metrics_lock_latest(), sizeof *snapshot);
+    metrics_unlock_latest();
+
+    HTTP_METRIC(&writer, "gauge", "poopal_uptime_seconds", snapshot->uptime_seconds);
+    HTTP_METRIC(&writer, "gauge", "poopal_heap_free_bytes", snapshot->heap_free);
+    HTTP_METRIC(&writer, "gauge", "poopal_heap_min_free_bytes", snapshot->heap_min_free);
+    HTTP_METRIC(&writer, "gauge", "poopal_heap_largest_free_block_bytes", snapshot->heap_largest_block);
+    HTTP_METRIC(&writer, "gauge", "poopal_wifi_rssi_dbm", snapshot->wifi.rssi);
+    HTTP_METRIC(&writer, "counter", "poopal_wifi_retries_total", snapshot->wifi.retries);
+    HTTP_METRIC(&writer, "counter", "poopal_wifi_disconnects_total", snapshot->wifi.disconnects);
+    HTTP_METRIC(&writer, "gauge", "poopal_mqtt_connected_seconds", snapshot->mqtt_connected_seconds);
+    HTTP_METRIC(&writer, "gauge", "poopal_hub_connected_seconds", snapshot->aziot_connected_seconds);
+    HTTP_METRIC(&writer, "counter", "poopal_log_dropped_total", snapshot->log_dropped);
+    HTTP_METRIC(&writer, "gauge", "poopal_eventbus_pool_free", snapshot->pool.free);
+    HTTP_METRIC(&writer, "gauge", "poopal_eventbus_pool_low_water_mark", snapshot->pool.low_water_mark);
+    HTTP_METRIC(&writer, "counter", "poopal_eventbus_pool_exhausted_total", snapshot->pool.exhausted);
+
+    http_writer_const(&writer, "# TYPE poopal_eventbus_pending gauge\n");
+    for (size_t i = 0; i < snapshot->subscriber_count; ++i) {
+        http_writer_printf(&writer, "poopal_eventbus_pending{subscriber=\"%s\"} %u\n",
+            snapshot->subscribers[i].name, snapshot->subscribers[i].stats.pending);
+    }
+    http_writer_const(&writer, "# TYPE poopal_eventbus_high_water_mark gauge\n");
+    for (size_t i = 0; i < snapshot->subscriber_count; ++i) {
+        http_writer_printf(&writer, "poopal_eventbus_high_water_mark{subscriber=\"%s\"} %u\n",
+            snapshot->subscribers[i].name, snapshot->subscribers[i].stats.high_water_mark);
+    }
+    http_writer_const(&writer, "# TYPE poopal_eventbus_delivered_total counter\n");
+    for (size_t i = 0; i < snapshot->subscriber_count; ++i) {
+        http_writer_printf(&writer, "poopal_eventbus_delivered_total{subscriber=\"%s\"} %u\n",
+            snapshot->subscribers[i].name, snapshot->subscribers[i].stats.delivered);
+    }
+    http_writer_const(&writer, "# TYPE poopal_eventbus_dropped_total counter\n");
+    for (size_t i = 0; i < snapshot->subscriber_count; ++i) {
+        http_writer_printf(&writer, "poopal_eventbus_dropped_total{subscriber=\"%s\"} %u\n",
+            snapshot->subscribers[i].name, snapshot->subscribers[i].stats.dropped);
+    }
+
+    http_writer_const(&writer, "# TYPE poopal_task_cpu_permille gauge\n");
+    for (size_t i = 0; i < snapshot->task_count; ++i) {
+        const metrics_task* task = &snapshot->tasks[i];
+        http_writer_printf(&writer, "poopal_task_cpu_permille{task=\"%s\",core=\"%d\"} %u\n",
+            task->name, task->core == tskNO_AFFINITY ? -1 : task->core, task->cpu_permille);
+    }
+    http_writer_const(&writer, "# TYPE poopal_task_stack_free_bytes gauge\n");
+    for (size_t i = 0; i < snapshot->task_count; ++i) {
+        http_writer_printf(&writer, "poopal_task_stack_free_bytes{task=\"%s\"} %u\n",
+            snapshot->tasks[i].name, snapshot->tasks[i].stack_high_water_mark);
+    }
+
+    http_writer_const(&writer, "# TYPE poopal_transport_health gauge\n");
+    for (int id = 0; id < TRANSPORT_COUNT; ++id) {
+        http_writer_printf(&writer, "poopal_transport_health{transport=\"%s\"} %d\n",
+            transport_get_name(id), snapshot->transports[id].health);
+    }
+    http_writer_const(&writer, "# TYPE poopal_transport_queued gauge\n");
+    for (int id = 0; id < TRANSPORT_COUNT; ++id) {
+        http_writer_printf(&writer, "poopal_transport_queued{transport=\"%s\"} %u\n",
+            transport_get_name(id), snapshot->transports[id].queued);
+    }
+    http_writer_const(&writer, "# TYPE poopal_transport_sent_total counter\n");
+    for (int id = 0; id < TRANSPORT_COUNT; ++id) {
+        http_writer_printf(&writer, "poopal_transport_sent_total{transport=\"%s\"} %u\n",
+            transport_get_name(id), snapshot->transports[id].sent);
+    }
+    http_writer_const(&writer, "# TYPE poopal_transport_dropped_total counter\n");
+    for (int id = 0; id < TRANSPORT_COUNT; ++id) {
+        http_writer_printf(&writer, "poopal_transport_dropped_total{transport=\"%s\"} %u\n",
+            transport_get_name(id), snapshot->transports[id].dropped + snapshot->transports[id].failed);
+    }
+
+    http_writer_const(&writer, "# TYPE poopal_transport_lane_queued gauge\n");
+    for (int id = 0; id < TRANSPORT_COUNT; ++id) {
+        for (int lane = 0; lane < TRANSPORT_LANE_COUNT; ++lane) {
+            http_writer_printf(&writer, "poopal_transport_lane_queued{transport=\"%s\",lane=\"%s\"} %u\n",
+                transport_get_name(id), transport_get_lane_name(lane), snapshot->transports[id].lanes[lane].queued);
+        }
+    }
+    http_writer_const(&writer, "# TYPE poopal_transport_lane_sent_total counter\n");
+    for (int id = 0; id < TRANSPORT_COUNT; ++id) {
+        for (int lane = 0; lane < TRANSPORT_LANE_COUNT; ++lane) {
+            http_writer_printf(&writer, "poopal_transport_lane_sent_total{transport=\"%s\",lane=\"%s\"} %u\n",
+                transport_get_name(id), transport_get_lane_name(lane), snapshot->transports[id].lanes[lane].sent);
+        }
+    }
+    http_writer_const(&writer, "# TYPE poopal_transport_lane_dropped_total counter\n");
+    for (int id = 0; id < TRANSPORT_COUNT; ++id) {
+        for (int lane = 0; lane < TRANSPORT_LANE_COUNT; ++lane) {
+            http_writer_printf(&writer, "poopal_transport_lane_dropped_total{transport=\"%s\",lane=\"%s\"} %u\n",
+                transport_get_name(id), transport_get_lane_name(lane), snapshot->transports[id].lanes[lane].dropped);
+        }
+    }
+    http_writer_const(&writer, "# TYPE poopal_transport_lane_latency_ms gauge\n");
+    for (int id = 0; id < TRANSPORT_COUNT; ++id) {
+        for (int lane = 0; lane < TRANSPORT_LANE_COUNT; ++lane) {
+            const transport_lane_stats* stats = &snapshot->transports[id].lanes[lane];
+            const char* name = transport_get_name(id);
+            const char* lane_name = transport_get_lane_name(lane);
+            http_writer_printf(&writer, "poopal_transport_lane_latency_ms{transport=\"%s\",lane=\"%s\",stat=\"last\"} %u\n",
+                name, lane_name, stats->latency_last_ms);
+            http_writer_printf(&writer, "poopal_transport_lane_latency_ms{transport=\"%s\",lane=\"%s\",stat=\"max\"} %u\n",
+                name, lane_name, stats->latency_max_ms);
+            http_writer_printf(&writer, "poopal_transport_lane_latency_ms{transport=\"%s\",lane=\"%s\",stat=\"avg\"} %u\n",
+                name, lane_name, stats->latency_avg_ms);
+        }
+    }
+
+    http_writer_const(&writer, "# TYPE poopal_transport_connects_total counter\n");
+    for (int id = 0; id < TRANSPORT_COUNT; ++id) {
+        http_writer_printf(&writer, "poopal_transport_connects_total{transport=\"%s\"} %u\n",
+            transport_get_name(id), snapshot->transports[id].connects);
+    }
+    http_writer_const(&writer, "# TYPE poopal_transport_connect_ms gauge\n");
+    for (int id = 0; id < TRANSPORT_COUNT; ++id) {
+        http_writer_printf(&writer, "poopal_transport_connect_ms{transport=\"%s\",stat=\"last\"} %u\n",
+            transport_get_name(id), snapshot->transports[id].connect_last_ms);
+        http_writer_printf(&writer, "poopal_transport_connect_ms{transport=\"%s\",stat=\"max\"} %u\n",
+            transport_get_name(id), snapshot->transports[id].connect_max_ms);
+    }
+
+    HTTP_METRIC(&writer, "gauge", "poopal_body_detected", __device_status.body_detected);
+    HTTP_METRIC(&writer, "counter", "poopal_sessions_total", device_control_get_session_count());
+
+    device_control_latency_stats latency;
+    device_control_get_edge_latency(&latency);
+    http_writer_const(&writer, "# TYPE poopal_edge_latency_us summary\n");
+    http_writer_printf(&writer, "poopal_edge_latency_us{quantile=\"0.5\"} %lld\n", device_control_latency_percentile(&latency, 50));
+    http_writer_printf(&writer, "poopal_edge_latency_us{quantile=\"0.99\"} %lld\n", device_control_latency_percentile(&latency, 99));
+    http_writer_printf(&writer, "poopal_edge_latency_us_sum %lld\npoopal_edge_latency_us_count %u\n", latency.total_us, latency.count);
+
+    return http_writer_finish(&writer);
+}
+
+static esp_err_t http_status_handler(httpd_req_t* req)
+{
+    http_writer writer = { .req = req };
+    httpd_resp_set_type(req, "application/json");
+
+    http_writer_printf(&writer, "{\"device\":[\"%s\",\"%s\",\"%s\"],", topics_get_device_id(), topics_get_site(), topics_get_group());
+    http_writer_printf(&writer, "\"status\":{\"body_detected\":%d,\"fan_enabled\":%d,\"wifi\":%d,\"datalink\":%d,\"cloud\":%d},",
+        __device_status.body_detected, __device_status.fan_enabled,
+        __device_status.wifi_status, __device_status.datalink_status, __device_status.cloud_status);
+
+    // [pending, high water mark, delivered, dropped], live rather than from the metrics snapshot
+    http_writer_const(&writer, "\"bus\":{");
+    for (size_t i = 0; i < eventbus_get_subscriber_count(); ++i) {
+        const eventbus_subscriber* subscriber = eventbus_get_subscriber(i);
+        eventbus_subscriber_stats stats;
+        eventbus_get_subscriber_stats(subscriber, &stats);
+        http_writer_printf(&writer, "%s\"%s\":[%u,%u,%u,%u]", i ? "," : "", eventbus_get_subscriber_name(subscriber),
+            stats.pending, stats.high_water_mark, stats.delivered, stats.dropped);
+    }
+
+    device_control_latency_stats latency;
+    device_control_get_edge_latency(&latency);
+    http_writer_printf(&writer, "},\"sessions\":{\"count\":%u,\"current_start\":%lld,\"grace_period\":%u},"
+        "\"edge_latency_us\":{\"count\":%u,\"min\":%lld,\"p50\":%lld,\"p99\":%lld,\"max\":%lld},",
+        device_control_get_session_count(), (long long)device_control_get_body_detection_start_time(),
+        device_control_get_body_detection_grace_period(), latency.count, latency.count ? latency.min_us : 0,
+        device_control_latency_percentile(&latency, 50), device_control_latency_percentile(&latency, 99), latency.max_us);
+
+    // the timeline is already a JSON object, drop its braces and splice it in
+    char timeline[BOOT_TIMELINE_MAX_LEN];
+    int len = boot_format_timeline(timeline, sizeof timeline);
+    if (len < (int)sizeof timeline && len > 2) {
+        timeline[len - 1] = 0;
+        http_writer_const(&writer, timeline + 1);
+    } else {
+        http_writer_const(&writer, "\"boot\":null");
+    }
+    http_writer_const(&writer, "}");
+
+    return http_writer_finish(&writer);
+}
+
+static const httpd_uri_t _metrics_uri = {
+    .uri = "/metrics",
+    .method = HTTP_GET,
+    .handler = http_metrics_handler,
+};
+
+static const httpd_uri_t _status_uri = {
+    .uri = "/status",
+    .method = HTTP_GET,
+    .handler = http_status_handler,
+};
+
+void start_http_server(void)
+{
+    if (!HTTP_SERVER_ENABLED || _server != NULL) {
+        return;
+    }
+
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.server_port = HTTP_SERVER_PORT;
+    config.stack_size = APP_HTTP_SERVER_STACK_SIZE;
+    config.task_priority = APP_HTTP_SERVER_PRIORITY;
+    config.core_id = APP_HTTP_SERVER_CORE;
+    config.max_open_sockets = 2;
+    config.lru_purge_enable = true;
+
+    esp_err_t err = httpd_start(&_server, &config);
+    if (err != ESP_OK) {
+        ESP_LOGE(LOG_TAG_HTTP, "failed to start http server: %s", esp_err_to_name(err));
+        _server = NULL;
+        return;
+    }
+
+    httpd_register_uri_handler(_server, &_metrics_uri);
+    httpd_register_uri_handler(_server, &_status_uri);
+    ESP_LOGI(LOG_TAG_HTTP, "http server started on port %d", HTTP_SERVER_PORT);
+}
@@ -0,0 +1,111 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "driver/gpio.h"
+#include "esp_log.h"
+
+#include "global.h"
+
+#include "aziot.h"
+#include "devicecontrollogic.h"
+#include "eventbus.h"
+#include "latencybench.h"
+#include "tasks.h"
+
+#if LATENCY_BENCHMARK_ENABLED
+
+// Keeps the uplink saturated through the real datalink and Azure IoT path
+static void uplink_load_task(void* arg)
+{
+    UNUSED(arg);
+    uint32_t sequence = 0;
+
+    for (;;) {
+        if (aziot_get_pending_count() >= LATENCY_BENCHMARK_UPLINK_MAX_PENDING) {
+            vTaskDelay(1);
+            continue;
+        }
+
+        eventbus_event* event = eventbus_alloc(EVENTBUS_TOPIC_DATALINK);
+        if (event != NULL) {
+            event->datalink.event_type = DATA_LINK_EVENT_LOAD_TEST;
+            event->datalink.load_test_sequence = sequence++;
+            eventbus_publish(event);
+        }
+        vTaskDelay(1);
+    }
+}
+
+static void latency_benchmark_task(void* arg)
+{
+    UNUSED(arg);
+    const TickType_t xDelay = LATENCY_BENCHMARK_EDGE_INTERVAL_MS / portTICK_PERIOD_MS;
+
+    // read back our own output, the ISR sees the edges as if they came from the PIR
+    gpio_set_direction(BODY_DETECTION_PIN, GPIO_MODE_INPUT_OUTPUT);
+    int level = gpio_get_level(BODY_DETECTION_PIN);
+
+    for (unsigned int round = 1;; ++round) {
+        device_control_reset_edge_latency();
+
+        for (int i = 0; i < LATENCY_BENCHMARK_EDGES; ++i) {
+            level = !level;
+            gpio_set_level(BODY_DETECTION_PIN, level);
+            vTaskDelay(xDelay);
+        }
+
+        device_control_latency_stats stats;
+        device_control_get_edge_latency(&stats);
+        if (stats.count == 0) {
+            ESP_LOGE(LOG_TAG_BENCHMARK, "round %u: no edges reached device control", round);
+            continue;
+        }
+
+        int64_t p50 = device_control_latency_percentile(&stats, 50);
+        int64_t p99 = device_control_latency_percentile(&stats, 99);
+        ESP_LOGI(LOG_TAG_BENCHMARK, "round %u: %u/%d edges, latency min %lldus, mean %lldus, p50 <=%lldus, p99 <=%lldus, max %lldus, pending uplinks %d",
+            round, stats.count, LATENCY_BENCHMARK_EDGES, stats.min_us, stats.total_us / stats.count,
+            p50, p99, stats.max_us, aziot_get_pending_count());
+        ESP_LOGI(LOG_TAG_BENCHMARK, "round %u: %s, max %lldus against bound %dus",
+            round, stats.max_us <= LATENCY_BENCHMARK_BOUND_US ? "PASS" : "FAIL", stats.max_us, LATENCY_BENCHMARK_BOUND_US);
+    }
+}
+
+void start_latency_benchmark(void)
+{
+    ESP_LOGW(LOG_TAG_BENCHMARK, "latency benchmark enabled, driving body detection pin %d", BODY_DETECTION_PIN);
+    app_task_start(APP_TASK_UPLINK_LOAD, uplink_load_task, NULL);
+    app_task_start(APP_TASK_LATENCY_BENCHMARK, latency_benchmark_task, NULL);
+}
+
+#else
+
+void start_latency_benchmark(void)
+{
+}
+
+#endif // LATENCY_BENCHMARK_ENABLED
@@ -32,7 +32,9 @@
 
 #include "global.h"
 
+#include "applog.h"
 #include "led.h"
+#include "tasks.h"
 
 #define LED1_TIMER LEDC_TIMER_0
 
@@ -190,9 +192,9 @@ void init_led()
     // Initialize fade service.
     ledc_fade_func_install(0);
 
-    led_control_event_group = xEventGroupCreate();
+    led_control_event_group = app_event_group_create(APP_EVENT_GROUP_LED);
 
-    xTaskCreate(task_led_control_led1, "task_led_control_1", 1024, NULL, 0, NULL);
+    app_task_start(APP_TASK_LED, task_led_control_led1, NULL);
 }
 
 void set_led_on(Led led)
@@ -200,7 +202,7 @@ void set_led_on(Led led)
     led_info[led].ctrl = LED_ON;
     led_status[led] = 1;
     xEventGroupSetBits(led_control_event_group, LED_CONTROL_EVENT_GROUP_BIT(led));
-    ESP_LOGI(LOG_TAG_LED, "setting led %d on", led);
+    APPLOG_I(LOG_TAG_LED, "setting led %d on", led);
 }
 
 void set_led_off(Led led)
@@ -208,7 +210,7 @@ void set_led_off(Led led)
     led_info[led].ctrl = LED_OFF;
     led_status[led] = 0;
     xEventGroupSetBits(led_control_event_group, LED_CONTROL_EVENT_GROUP_BIT(led));
-    ESP_LOGI(LOG_TAG_LED, "setting led %d off", led);
+    APPLOG_I(LOG_TAG_LED, "setting led %d off", led);
 }
 
 void set_led_flash(Led led, int on_time_ms)
@@ -217,7 +219,7 @@ void set_led_flash(Led led, int on_time_ms)
     led_info[led].on_time_ms = on_time_ms;
     led_status[led] = 0;
     xEventGroupSetBits(led_control_event_group, LED_CONTROL_EVENT_GROUP_BIT(led));
-    ESP_LOGI(LOG_TAG_LED, "setting led %d flash, on %dms", led, on_time_ms);
+    APPLOG_I(LOG_TAG_LED, "setting led %d flash, on %dms", led, on_time_ms);
 }
 
 void set_led_on_off(Led led, int on_off)
@@ -234,7 +236,7 @@ void set_led_fade_out(Led led, int off_time_ms)
     led_info[led].ctrl = LED_FADE_OUT;
     led_info[led].off_time_ms = off_time_ms;
     xEventGroupSetBits(led_control_event_group, LED_CONTROL_EVENT_GROUP_BIT(led));
-    ESP_LOGI(LOG_TAG_LED, "setting led %d fade out, off %dms", led, off_time_ms);
+    APPLOG_I(LOG_TAG_LED, "setting led %d fade out, off %dms", led, off_time_ms);
 }
 
 void set_led_fade_in_out(Led led, int on_time_ms, int off_time_ms)
@@ -243,7 +245,7 @@ void set_led_fade_in_out(Led led, int on_time_ms, int off_time_ms)
     led_info[led].on_time_ms = on_time_ms;
     led_info[led].off_time_ms = off_time_ms;
     xEventGroupSetBits(led_control_event_group, LED_CONTROL_EVENT_GROUP_BIT(led));
-    ESP_LOGI(LOG_TAG_LED, "setting led %d fade in/out, on %dms, off %dms", led, on_time_ms, off_time_ms);
+    APPLOG_I(LOG_TAG_LED, "setting led %d fade in/out, on %dms, off %dms", led, on_time_ms, off_time_ms);
 }
 
 void set_led_fade_in(Led led, int on_time_ms)
@@ -251,5 +253,5 @@ void set_led_fade_in(Led led, int on_time_ms)
     led_info[led].ctrl = LED_FADE_IN;
     led_info[led].on_time_ms = on_time_ms;
     xEventGroupSetBits(led_control_event_group, LED_CONTROL_EVENT_GROUP_BIT(led));
-    ESP_LOGI(LOG_TAG_LED, "setting led %d fade in, on %dms", led, on_time_ms);
+    APPLOG_I(LOG_TAG_LED, "setting led %d fade in, on %dms", led, on_time_ms);
 }
@@ -34,26 +34,119 @@
 
 #include "global.h"
 
+#include "applog.h"
 #include "bodydetection.h"
+#include "boot.h"
 #include "datalink.h"
 #include "devicecontrollogic.h"
+#include "eventbus.h"
+#include "fleetsim.h"
+#include "httpserver.h"
+#include "latencybench.h"
 #include "led.h"
+#include "metrics.h"
+#include "microbench.h"
+#include "sleeplog.h"
 #include "status.h"
 #include "tasks.h"
+#include "tracereplay.h"
 #include "wifi.h"
 
+typedef enum boot_phase_id_t {
+    BOOT_PHASE_NVS,
+    BOOT_PHASE_CORE,
+    BOOT_PHASE_LED,
+    BOOT_PHASE_DEVICE_CONTROL,
+    BOOT_PHASE_BODY_DETECTION,
+    BOOT_PHASE_WIFI,
+    BOOT_PHASE_DATALINK_INIT,
+    BOOT_PHASE_DATALINK_START,
+    BOOT_PHASE_HTTP_SERVER,
+    BOOT_PHASE_COUNT
+} boot_phase_id;
+
+static void boot_nvs(void)
+{
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        err = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(err);
+}
+
+static void boot_core(void)
+{
+    gpio_install_isr_service(ESP_INTR_FLAG_DEFAULT);
+    init_eventbus();
+    init_metrics();
+}
+
+static void boot_device_control(void)
+{
+    init_device_control_logic();
+    start_device_control_logic();
+}
+
+static void boot_body_detection(void)
+{
+    init_body_detection();
+    start_body_detection();
+}
+
+static void boot_wifi(void)
+{
+    init_wifi();
+
+    const unsigned char ssid[] = WIFI_SSID;
+    const unsigned char cred[] = WIFI_PASS;
+    set_wifi_security(WIFI_SEC_WPA_WPA2_PSK, ssid, sizeof ssid, cred, sizeof cred);
+
+    start_wifi();
+    connect_wifi();
+}
+
+static void boot_datalink_init(void)
+{
+    init_datalink(false, true);
+}
+
+// Association runs in the background once connect_wifi returns, so everything else overlaps it
+static const boot_phase _boot_phases[BOOT_PHASE_COUNT] = {
+    [BOOT_PHASE_NVS] = { "nvs", boot_nvs, 0 },
+    [BOOT_PHASE_CORE] = { "core", boot_core, 0 },
+    [BOOT_PHASE_LED] = { "led", init_led, 0 },
+    [BOOT_PHASE_DEVICE_CONTROL] = { "device_control", boot_device_control, // drives the LED
+        BOOT_PHASE_BIT(BOOT_PHASE_NVS) | BOOT_PHASE_BIT(BOOT_PHASE_CORE) | BOOT_PHASE_BIT(BOOT_PHASE_LED) },
+    [BOOT_PHASE_BODY_DETECTION] = { "body_detection", boot_body_detection,
+        BOOT_PHASE_BIT(BOOT_PHASE_DEVICE_CONTROL) },
+    [BOOT_PHASE_WIFI] = { "wifi", boot_wifi,
+        BOOT_PHASE_BIT(BOOT_PHASE_NVS) | BOOT_PHASE_BIT(BOOT_PHASE_DEVICE_CONTROL) },
+    [BOOT_PHASE_DATALINK_INIT] = { "datalink_init", boot_datalink_init, // device id and topics from NVS
+        BOOT_PHASE_BIT(BOOT_PHASE_NVS) | BOOT_PHASE_BIT(BOOT_PHASE_CORE) },
+    [BOOT_PHASE_DATALINK_START] = { "datalink_start", start_datalink,
+        BOOT_PHASE_BIT(BOOT_PHASE_DATALINK_INIT) | BOOT_PHASE_BIT(BOOT_PHASE_WIFI) },
+    [BOOT_PHASE_HTTP_SERVER] = { "http_server", start_http_server, // binds once the netif exists
+        BOOT_PHASE_BIT(BOOT_PHASE_CORE) | BOOT_PHASE_BIT(BOOT_PHASE_WIFI) },
+};
+
 void app_main()
 {
+    bool sleep_log = SLEEP_LOG_ENABLED && sleep_log_is_available();
+    if (sleep_log && !sleep_log_handle_wakeup()) {
+        // woken up by a PIR edge and it's been recorded. no flush due, skip NVS, WiFi and Azure entirely
+        sleep_log_enter_deep_sleep();
+    }
+
     ESP_LOGI(LOG_TAG_APP, "Starting up..");
     ESP_LOGI(LOG_TAG_APP, "Free memory: %d bytes", esp_get_free_heap_size());
     ESP_LOGI(LOG_TAG_APP, "IDF version: %s", esp_get_idf_version());
 
-    esp_log_level_set("*", ESP_LOG_INFO);
-    esp_log_level_set("MQTT_CLIENT", ESP_LOG_VERBOSE);
-    esp_log_level_set("TRANSPORT_TCP", ESP_LOG_VERBOSE);
-    esp_log_level_set("TRANSPORT_SSL", ESP_LOG_VERBOSE);
-    esp_log_level_set("TRANSPORT", ESP_LOG_VERBOSE);
-    esp_log_level_set("OUTBOX", ESP_LOG_VERBOSE);
+    // MQTT client and transport tags used to be VERBOSE here. Raise them at runtime over
+    // MQTT_CONFIG_LOG_LEVEL_TOPIC when debugging instead of paying for it on every message
+    init_applog();
+    applog_set_level("*", ESP_LOG_INFO);
+    start_applog();
 
     // LED
     /*
@@ -74,30 +167,26 @@ void app_main()
     gpio_set_level(15, 1);
 */
 
-    esp_err_t err = nvs_flash_init();
-    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        err = nvs_flash_init();
-    }
-    ESP_ERROR_CHECK(err);
+    boot_run(_boot_phases, BOOT_PHASE_COUNT);
 
-    gpio_install_isr_service(ESP_INTR_FLAG_DEFAULT);
-
-    init_led();
-    init_device_control_logic();
-    init_body_detection();
-    init_wifi();
-
-    const unsigned char ssid[] = WIFI_SSID;
-    const unsigned char cred[] = WIFI_PASS;
-    set_wifi_security(WIFI_SEC_WPA_WPA2_PSK, ssid, sizeof ssid, cred, sizeof cred);
-
-    start_device_control_logic();
-    start_body_detection();
-    start_wifi();
+    if (LATENCY_BENCHMARK_ENABLED) {
+        start_latency_benchmark();
+    }
+    if (TRACE_REPLAY_ENABLED) {
+        start_trace_replay();
+    }
+    if (FLEET_SIM_ENABLED) {
+        start_fleet_sim();
+    }
+    if (MICROBENCH_ENABLED) {
+        start_microbench();
+    }
 
-    connect_wifi();
+    app_tasks_log_ram_budget();
 
-    init_datalink(false, true);
-    start_datalink();
+    if (sleep_log) {
+        start_sleep_log_flush();
+    } else if (SLEEP_LOG_ENABLED) {
+        ESP_LOGE(LOG_TAG_APP, "sleep log unavailable: body detection pin %d is not an RTC IO", BODY_DETECTION_PIN);
+    }
 }
@@ -0,0 +1,226 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "global.h"
+
+#include "applog.h"
+#include "aziot.h"
+#include "datalink.h"
+#include "eventbus.h"
+#include "metrics.h"
+#include "tasks.h"
+#include "transport.h"
+#include "wifi.h"
+
+typedef struct metrics_runtime_t {
+    TaskHandle_t handle;
+    uint32_t runtime;
+} metrics_runtime;
+
+typedef struct metrics_config_t {
+    SemaphoreHandle_t lock;
+    metrics_snapshot latest;
+
+    // sampling state, guarded by lock as well
+    TaskStatus_t task_status[METRICS_MAX_TASKS];
+    metrics_runtime previous[METRICS_MAX_TASKS];
+    size_t previous_count;
+    uint32_t previous_total_runtime;
+    int64_t previous_us;
+} metrics_config;
+
+static metrics_config _config;
+
+void init_metrics(void)
+{
+    _config.lock = app_binary_semaphore_create();
+    xSemaphoreGive(_config.lock);
+}
+
+static uint32_t metrics_previous_runtime(TaskHandle_t handle)
+{
+    for (size_t i = 0; i < _config.previous_count; ++i) {
+        if (_config.previous[i].handle == handle) {
+            return _config.previous[i].runtime;
+        }
+    }
+    // created since the previous sample
+    return 0;
+}
+
+static void metrics_sample_tasks(metrics_snapshot* snapshot)
+{
+    uint32_t total_runtime = 0;
+    UBaseType_t count = uxTaskGetSystemState(_config.task_status, METRICS_MAX_TASKS, &total_runtime);
+    if (count == 0) {
+        ESP_LOGW(LOG_TAG_METRICS, "more than %d tasks, task metrics skipped", METRICS_MAX_TASKS);
+    }
+
+    uint32_t total_delta = total_runtime - _config.previous_total_runtime;
+    snapshot->task_count = count;
+    for (UBaseType_t i = 0; i < count; ++i) {
+        const TaskStatus_t* status = &_config.task_status[i];
+        metrics_task* task = &snapshot->tasks[i];
+
+        strncpy(task->name, status->pcTaskName, sizeof task->name - 1)[sizeof task->name - 1] = 0;
+        task->core = status->xCoreID;
+        task->stack_high_water_mark = status->usStackHighWaterMark;
+        uint32_t delta = status->ulRunTimeCounter - metrics_previous_runtime(status->xHandle);
+        task->cpu_permille = total_delta ? (uint16_t)((uint64_t)delta * 1000 / total_delta) : 0;
+    }
+
+    for (UBaseType_t i = 0; i < count; ++i) {
+        _config.previous[i].handle = _config.task_status[i].xHandle;
+        _config.previous[i].runtime = _config.task_status[i].ulRunTimeCounter;
+    }
+    _config.previous_count = count;
+    _config.previous_total_runtime = total_runtime;
+}
+
+void metrics_sample(void)
+{
+    xSemaphoreTake(_config.lock, portMAX_DELAY);
+
+    metrics_snapshot* snapshot = &_config.latest;
+    int64_t now = esp_timer_get_time();
+    ++snapshot->sequence;
+    snapshot->uptime_seconds = (uint32_t)(now / 1000000);
+    snapshot->interval_ms = (uint32_t)((now - _config.previous_us) / 1000);
+    _config.previous_us = now;
+
+    snapshot->heap_free = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    snapshot->heap_min_free = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    snapshot->heap_largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+
+    metrics_sample_tasks(snapshot);
+
+    snapshot->subscriber_count = eventbus_get_subscriber_count();
+    for (size_t i = 0; i < snapshot->subscriber_count; ++i) {
+        const eventbus_subscriber* subscriber = eventbus_get_subscriber(i);
+        snapshot->subscribers[i].name = eventbus_get_subscriber_name(subscriber);
+        eventbus_get_subscriber_stats(subscriber, &snapshot->subscribers[i].stats);
+    }
+    eventbus_get_pool_stats(&snapshot->pool);
+
+    wifi_get_stats(&snapshot->wifi);
+    snapshot->mqtt_connected_seconds = datalink_get_mqtt_connected_seconds();
+    snapshot->aziot_connected_seconds = aziot_get_connected_seconds();
+    snapshot->log_dropped = applog_get_dropped();
+    for (int id = 0; id < TRANSPORT_COUNT; ++id) {
+        transport_get_stats(id, &snapshot->transports[id]);
+    }
+
+    xSemaphoreGive(_config.lock);
+}
+
+void metrics_refresh(uint32_t max_age_ms)
+{
+    // racy read, worst case two callers both sample
+    if (_config.latest.sequence == 0 || esp_timer_get_time() - _config.previous_us > (int64_t)max_age_ms * 1000) {
+        metrics_sample();
+    }
+}
+
+const metrics_snapshot* metrics_lock_latest(void)
+{
+    xSemaphoreTake(_config.lock, portMAX_DELAY);
+    return &_config.latest;
+}
+
+void metrics_unlock_latest(void)
+{
+    xSemaphoreGive(_config.lock);
+}
+
+int metrics_format_json(const metrics_snapshot* snapshot, char* buffer, size_t len)
+{
+    int pos = snprintf(buffer, len,
+        "{\"metrics\":{\"seq\":%u,\"up\":%u,\"interval\":%u,\"heap\":[%u,%u,%u],"
+        "\"wifi\":[%d,%u,%u],\"mqtt_up\":%u,\"hub_up\":%u,\"log_dropped\":%u,\"pool\":[%u,%u,%u],\"bus\":{",
+        snapshot->sequence, snapshot->uptime_seconds, snapshot->interval_ms,
+        snapshot->heap_free, snapshot->heap_min_free, snapshot->heap_largest_block,
+        snapshot->wifi.rssi, snapshot->wifi.retries, snapshot->wifi.disconnects,
+        snapshot->mqtt_connected_seconds, snapshot->aziot_connected_seconds, snapshot->log_dropped,
+        snapshot->pool.free, snapshot->pool.low_water_mark, snapshot->pool.exhausted);
+
+    // subscriber: [pending, high water mark, delivered, dropped]
+    for (size_t i = 0; i < snapshot->subscriber_count && pos < (int)len; ++i) {
+        const eventbus_subscriber_stats* stats = &snapshot->subscribers[i].stats;
+        pos += snprintf(buffer + pos, len - pos, "%s\"%s\":[%u,%u,%u,%u]", i ? "," : "",
+            snapshot->subscribers[i].name, stats->pending, stats->high_water_mark, stats->delivered, stats->dropped);
+    }
+    if (pos < (int)len) {
+        pos += snprintf(buffer + pos, len - pos, "},\"tx\":{");
+    }
+
+    // transport: [health, queued, high water mark, in flight, sent, dropped, failed, connects, last and max connect ms]
+    for (int id = 0; id < TRANSPORT_COUNT && pos < (int)len; ++id) {
+        const transport_stats* stats = &snapshot->transports[id];
+        pos += snprintf(buffer + pos, len - pos, "%s\"%s\":[%d,%u,%u,%u,%u,%u,%u,%u,%u,%u]", id ? "," : "",
+            transport_get_name(id), stats->health, stats->queued, stats->high_water_mark, stats->in_flight,
+            stats->sent, stats->dropped, stats->failed, stats->connects, stats->connect_last_ms, stats->connect_max_ms);
+    }
+    if (pos < (int)len) {
+        pos += snprintf(buffer + pos, len - pos, "},\"lanes\":{");
+    }
+
+    // lane, per transport: [queued, sent, dropped, last, max and average latency ms]
+    for (int id = 0; id < TRANSPORT_COUNT && pos < (int)len; ++id) {
+        pos += snprintf(buffer + pos, len - pos, "%s\"%s\":{", id ? "," : "", transport_get_name(id));
+        for (int lane = 0; lane < TRANSPORT_LANE_COUNT && pos < (int)len; ++lane) {
+            const transport_lane_stats* stats = &snapshot->transports[id].lanes[lane];
+            pos += snprintf(buffer + pos, len - pos, "%s\"%s\":[%u,%u,%u,%u,%u,%u]", lane ? "," : "",
+                transport_get_lane_name(lane), stats->queued, stats->sent, stats->dropped,
+                stats->latency_last_ms, stats->latency_max_ms, stats->latency_avg_ms);
+        }
+        if (pos < (int)len) {
+            pos += snprintf(buffer + pos, len - pos, "}");
+        }
+    }
+    if (pos < (int)len) {
+        pos += snprintf(buffer + pos, len - pos, "},\"tasks\":{");
+    }
+
+    // task: [core, cpu per mille, stack high water mark]
+    for (size_t i = 0; i < snapshot->task_count && pos < (int)len; ++i) {
+        const metrics_task* task = &snapshot->tasks[i];
+        pos += snprintf(buffer + pos, len - pos, "%s\"%s\":[%d,%u,%u]", i ? "," : "",
+            task->name, task->core == tskNO_AFFINITY ? -1 : task->core, task->cpu_permille, task->stack_high_water_mark);
+    }
+    if (pos < (int)len) {
+        pos += snprintf(buffer + pos, len - pos, "}}}");
+    }
+    return pos;
+}
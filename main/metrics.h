@@ -0,0 +1,89 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "global.h"
+
+#include "eventbus.h"
+#include "transport.h"
+#include "wifi.h"
+
+typedef struct metrics_task_t {
+    char name[configMAX_TASK_NAME_LEN];
+    int core; // tskNO_AFFINITY for unpinned tasks
+    uint16_t cpu_permille; // share of one core since the previous sample
+    uint32_t stack_high_water_mark; // bytes never used
+} metrics_task;
+
+typedef struct metrics_subscriber_t {
+    const char* name;
+    eventbus_subscriber_stats stats;
+} metrics_subscriber;
+
+typedef struct metrics_snapshot_t {
+    uint32_t sequence; // 0 until the first sample
+    uint32_t uptime_seconds;
+    uint32_t interval_ms;
+
+    size_t heap_free;
+    size_t heap_min_free;
+    size_t heap_largest_block;
+
+    size_t task_count;
+    metrics_task tasks[METRICS_MAX_TASKS];
+
+    size_t subscriber_count;
+    metrics_subscriber subscribers[EVENTBUS_MAX_SUBSCRIBERS];
+    eventbus_pool_stats pool;
+
+    wifi_stats wifi;
+    uint32_t mqtt_connected_seconds;
+    uint32_t aziot_connected_seconds;
+    uint32_t log_dropped;
+    transport_stats transports[TRANSPORT_COUNT];
+} metrics_snapshot;
+
+void init_metrics(void);
+
+// Called by the datalink task every METRICS_INTERVAL_MS. CPU shares cover the time since
+// the previous sample, whoever took it
+void metrics_sample(void);
+// Samples only if the latest snapshot is older than max_age_ms
+void metrics_refresh(uint32_t max_age_ms);
+
+// The snapshot stays valid and unchanged until metrics_unlock_latest
+const metrics_snapshot* metrics_lock_latest(void);
+void metrics_unlock_latest(void);
+
+// Same return convention as snprintf
+int metrics_format_json(const metrics_snapshot* snapshot, char* buffer, size_t len);
+
+#endif
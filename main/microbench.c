@@ -0,0 +1,245 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#include "global.h"
+
+#include "datalink.h"
+#include "eventbus.h"
+#include "microbench.h"
+#include "router.h"
+#include "tasks.h"
+#include "topics.h"
+
+#if MICROBENCH_ENABLED
+
+#define NVS_NAMESPACE_MICROBENCH "bench"
+#define NVS_KEY_MICROBENCH_ELF "elf"
+#define NVS_KEY_MICROBENCH_RESULTS "results"
+#define MICROBENCH_ELF_SHA_LEN 16 // hex digits, as printed at boot
+
+typedef struct microbench_t {
+    const char* name;
+    void (*run)(uint32_t iterations);
+    uint32_t iterations;
+} microbench;
+
+static const router* _router;
+static eventbus_subscriber* _subscriber;
+static char _config_topic[MQTT_TOPIC_MAX_LEN];
+static int _config_topic_len;
+static volatile uint32_t _sink; // keeps results alive
+
+static void bench_format_session(uint32_t iterations)
+{
+    char data[101];
+    for (uint32_t i = 0; i < iterations; ++i) {
+        _sink += datalink_format_body_detection(data, sizeof data, 1600000000 + i, (i & 0xff) * 1001);
+    }
+}
+
+static void bench_route_handler(const router_message* message)
+{
+    _sink += message->value_int;
+}
+
+// Same shapes as datalink's downlink routes, without their side effects
+static const router_route _routes[] = {
+    { MQTT_CONFIG_BODY_DETECTION_ENABLED_TOPIC, ROUTER_PAYLOAD_BOOL, bench_route_handler },
+    { MQTT_CONFIG_BODY_DETECTION_DELAY_TOPIC, ROUTER_PAYLOAD_INT, bench_route_handler },
+    { MQTT_CONFIG_LOG_LEVEL_TOPIC, ROUTER_PAYLOAD_RAW, bench_route_handler },
+    { MQTT_CONFIG_METRICS_INTERVAL_TOPIC, ROUTER_PAYLOAD_INT, bench_route_handler },
+};
+
+// The whole downlink chain: scope match on the full topic, then dispatch
+static void bench_downlink(uint32_t iterations)
+{
+    for (uint32_t i = 0; i < iterations; ++i) {
+        int suffix_len;
+        topics_scope scope;
+        const char* suffix = topics_match_config(_config_topic, _config_topic_len, &suffix_len, &scope);
+        _sink += router_dispatch(_router, suffix, suffix_len, "30", 2);
+    }
+}
+
+static void bench_eventbus_device_control(uint32_t iterations)
+{
+    for (uint32_t i = 0; i < iterations; ++i) {
+        eventbus_event* event = eventbus_alloc(EVENTBUS_TOPIC_BENCHMARK);
+        if (event == NULL) {
+            continue;
+        }
+        event->device_control.event_type = DEVICE_CONTROL_EVENT_BODY_DETECTION_TRIGGERED;
+        event->device_control.body_detected = i & 1;
+        eventbus_publish(event);
+        event = eventbus_receive(_subscriber, 0);
+        if (event == NULL) {
+            continue;
+        }
+        _sink += event->device_control.body_detected;
+        eventbus_release(event);
+    }
+}
+
+static void bench_eventbus_datalink(uint32_t iterations)
+{
+    for (uint32_t i = 0; i < iterations; ++i) {
+        eventbus_event* event = eventbus_alloc(EVENTBUS_TOPIC_BENCHMARK);
+        if (event == NULL) {
+            continue;
+        }
+        event->datalink.event_type = DATA_LINK_EVENT_BODY_DETECTION;
+        event->datalink.body_detection_event.start_epoch_second = 1600000000 + i;
+        event->datalink.body_detection_event.elapsed_ms = i & 0xffff;
+        eventbus_publish(event);
+        event = eventbus_receive(_subscriber, 0);
+        if (event == NULL) {
+            continue;
+        }
+        _sink += event->datalink.body_detection_event.elapsed_ms;
+        eventbus_release(event);
+    }
+}
+
+static void bench_smooth_average(uint32_t iterations)
+{
+    float average = 0;
+    for (uint32_t i = 0; i < iterations; ++i) {
+        average = smooth_average((float)(i & 0xff), average);
+    }
+    _sink += (uint32_t)average;
+}
+
+static const microbench _benches[] = {
+    { "format_session", bench_format_session, 2000 },
+    { "downlink_route", bench_downlink, 2000 },
+    { "bus_device_control", bench_eventbus_device_control, 2000 },
+    { "bus_datalink", bench_eventbus_datalink, 2000 },
+    { "smooth_average", bench_smooth_average, 20000 },
+};
+
+#define MICROBENCH_COUNT (sizeof(_benches) / sizeof(_benches[0]))
+
+static int compare_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nanoseconds per iteration, median and min over MICROBENCH_REPEATS
+static void microbench_measure(const microbench* bench, uint32_t* median, uint32_t* min)
+{
+    uint32_t samples[MICROBENCH_REPEATS];
+    bench->run(bench->iterations / 10); // warm the caches
+    for (int i = 0; i < MICROBENCH_REPEATS; ++i) {
+        int64_t start = esp_timer_get_time();
+        bench->run(bench->iterations);
+        samples[i] = (uint32_t)((esp_timer_get_time() - start) * 1000 / bench->iterations);
+    }
+    qsort(samples, MICROBENCH_REPEATS, sizeof samples[0], compare_u32);
+    *median = samples[MICROBENCH_REPEATS / 2];
+    *min = samples[0];
+}
+
+// Results are kept per build, so two builds flashed one after the other compare
+static bool microbench_load_baseline(nvs_handle handle, char* elf, uint32_t* results)
+{
+    size_t elf_len = MICROBENCH_ELF_SHA_LEN + 1;
+    size_t results_len = MICROBENCH_COUNT * sizeof(uint32_t);
+    return nvs_get_str(handle, NVS_KEY_MICROBENCH_ELF, elf, &elf_len) == ESP_OK
+        && nvs_get_blob(handle, NVS_KEY_MICROBENCH_RESULTS, results, &results_len) == ESP_OK
+        && results_len == MICROBENCH_COUNT * sizeof(uint32_t);
+}
+
+static void microbench_task(void* arg)
+{
+    UNUSED(arg);
+    char elf[MICROBENCH_ELF_SHA_LEN + 1];
+    esp_ota_get_app_elf_sha256(elf, sizeof elf);
+
+    nvs_handle handle;
+    ESP_ERROR_CHECK(nvs_open(NVS_NAMESPACE_MICROBENCH, NVS_READWRITE, &handle));
+    char baseline_elf[MICROBENCH_ELF_SHA_LEN + 1] = "";
+    uint32_t baseline[MICROBENCH_COUNT];
+    bool has_baseline = microbench_load_baseline(handle, baseline_elf, baseline);
+    bool compare = has_baseline && strcmp(baseline_elf, elf) != 0;
+
+    // one JSON object per line, grep "bench" out of the log
+    uint32_t results[MICROBENCH_COUNT];
+    for (size_t i = 0; i < MICROBENCH_COUNT; ++i) {
+        uint32_t min;
+        microbench_measure(&_benches[i], &results[i], &min);
+        if (compare) {
+            int delta = baseline[i] ? (int)(((int64_t)results[i] - baseline[i]) * 1000 / baseline[i]) : 0;
+            ESP_LOGI(LOG_TAG_BENCHMARK, "{\"bench\":\"%s\",\"elf\":\"%s\",\"iterations\":%u,\"ns\":%u,\"ns_min\":%u,"
+                "\"baseline_elf\":\"%s\",\"baseline_ns\":%u,\"delta_permille\":%d}",
+                _benches[i].name, elf, _benches[i].iterations, results[i], min, baseline_elf, baseline[i], delta);
+        } else {
+            ESP_LOGI(LOG_TAG_BENCHMARK, "{\"bench\":\"%s\",\"elf\":\"%s\",\"iterations\":%u,\"ns\":%u,\"ns_min\":%u}",
+                _benches[i].name, elf, _benches[i].iterations, results[i], min);
+        }
+    }
+
+    if (!has_baseline || MICROBENCH_SAVE_BASELINE) {
+        nvs_set_str(handle, NVS_KEY_MICROBENCH_ELF, elf);
+        nvs_set_blob(handle, NVS_KEY_MICROBENCH_RESULTS, results, sizeof results);
+        nvs_commit(handle);
+        ESP_LOGI(LOG_TAG_BENCHMARK, "results saved as the baseline for build %s", elf);
+    }
+    nvs_close(handle);
+    app_task_exit(APP_TASK_MICROBENCH);
+}
+
+void start_microbench(void)
+{
+    _router = router_create(_routes, sizeof _routes / sizeof _routes[0]);
+    _subscriber = eventbus_subscribe("microbench", EVENTBUS_TOPIC_MASK(EVENTBUS_TOPIC_BENCHMARK),
+        0, EVENTBUS_OVERFLOW_DROP_NEWEST, 0);
+    _config_topic_len = snprintf(_config_topic, sizeof _config_topic, "%.*s%s",
+        (int)strlen(topics_get_config_subscription(TOPICS_SCOPE_DEVICE)) - 1, topics_get_config_subscription(TOPICS_SCOPE_DEVICE),
+        MQTT_CONFIG_BODY_DETECTION_DELAY_TOPIC);
+
+    ESP_LOGW(LOG_TAG_BENCHMARK, "microbenchmarks enabled, %u benches", MICROBENCH_COUNT);
+    app_task_start(APP_TASK_MICROBENCH, microbench_task, NULL);
+}
+
+#else
+
+void start_microbench(void)
+{
+}
+
+#endif // MICROBENCH_ENABLED
@@ -0,0 +1,174 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "global.h"
+
+#include "aziot.h"
+#include "datalink.h"
+#include "devicecontrollogic.h"
+#include "overstay.h"
+#include "sessionstats.h"
+#include "tasks.h"
+
+#define NVS_KEY_CONFIG_OVERSTAY "overstay"
+#define NVS_KEY_CONFIG_STUCK "stuck"
+
+typedef struct overstay_config_t {
+    uint32_t thresholds[2]; // by overstay_threshold, seconds
+    time_t last_edge; // 0 before the first one
+    int64_t last_edge_us;
+    bool alerted[OVERSTAY_ALERT_COUNT]; // once per session, stuck once per edge
+    TimerHandle_t timer;
+} overstay_config;
+
+static overstay_config _config;
+
+static const char* const _alert_names[OVERSTAY_ALERT_COUNT] = {
+    [OVERSTAY_ALERT_OVERSTAY] = "overstay",
+    [OVERSTAY_ALERT_LONG_STAY] = "long_stay",
+    [OVERSTAY_ALERT_STUCK] = "stuck",
+    [OVERSTAY_ALERT_ENDED] = "ended",
+};
+
+static const char* const _threshold_keys[] = {
+    [OVERSTAY_THRESHOLD_OVERSTAY] = NVS_KEY_CONFIG_OVERSTAY,
+    [OVERSTAY_THRESHOLD_STUCK] = NVS_KEY_CONFIG_STUCK,
+};
+
+static const char* const _threshold_topics[] = {
+    [OVERSTAY_THRESHOLD_OVERSTAY] = MQTT_CONFIG_ALERT_OVERSTAY_TOPIC,
+    [OVERSTAY_THRESHOLD_STUCK] = MQTT_CONFIG_ALERT_STUCK_TOPIC,
+};
+
+// Timer service task, must not block
+static void overstay_timeout(TimerHandle_t timer)
+{
+    UNUSED(timer);
+    device_control_event event = {
+        .event_type = DEVICE_CONTROL_EVENT_OVERSTAY_CHECK
+    };
+    device_control_send_event(&event);
+}
+
+static void overstay_raise(overstay_alert_type type, time_t start, uint32_t elapsed, uint32_t threshold)
+{
+    _config.alerted[type] = true;
+    ESP_LOGW(LOG_TAG_DEVICE_CONTROL, "alert %s: started %ld, %us, threshold %us",
+        _alert_names[type], (long)start, elapsed, threshold);
+    datalink_send_alert(type, start, elapsed, threshold);
+}
+
+void overstay_on_edge(time_t edge_time, int64_t edge_us)
+{
+    _config.last_edge = edge_time;
+    _config.last_edge_us = edge_us;
+    _config.alerted[OVERSTAY_ALERT_STUCK] = false;
+}
+
+void overstay_on_session_end(time_t start, uint32_t elapsed_second)
+{
+    if (_config.alerted[OVERSTAY_ALERT_OVERSTAY] || _config.alerted[OVERSTAY_ALERT_LONG_STAY]) {
+        overstay_raise(OVERSTAY_ALERT_ENDED, start, elapsed_second, 0);
+    }
+    _config.alerted[OVERSTAY_ALERT_OVERSTAY] = false;
+    _config.alerted[OVERSTAY_ALERT_LONG_STAY] = false;
+    _config.alerted[OVERSTAY_ALERT_ENDED] = false;
+}
+
+void overstay_check(int64_t now_us, time_t session_start, int64_t session_start_us, bool detected)
+{
+    uint32_t stuck = _config.thresholds[OVERSTAY_THRESHOLD_STUCK];
+    uint32_t since_edge = (now_us - _config.last_edge_us) / 1000000;
+    if (detected && stuck && _config.last_edge && !_config.alerted[OVERSTAY_ALERT_STUCK] && since_edge >= stuck) {
+        overstay_raise(OVERSTAY_ALERT_STUCK, _config.last_edge, since_edge, stuck);
+    }
+
+    if (session_start == 0) {
+        return;
+    }
+    uint32_t elapsed = (now_us - session_start_us) / 1000000;
+
+    uint32_t overstay = _config.thresholds[OVERSTAY_THRESHOLD_OVERSTAY];
+    if (overstay && elapsed >= overstay && !_config.alerted[OVERSTAY_ALERT_OVERSTAY]) {
+        overstay_raise(OVERSTAY_ALERT_OVERSTAY, session_start, elapsed, overstay);
+    }
+
+    // learned, only once the hour has seen enough sessions, and never below the floor
+    uint32_t baseline = sessionstats_get_baseline(session_start);
+    if (baseline == 0 || _config.alerted[OVERSTAY_ALERT_LONG_STAY] || _config.alerted[OVERSTAY_ALERT_OVERSTAY]) {
+        return;
+    }
+    uint32_t long_stay = MAX(baseline * OVERSTAY_BASELINE_FACTOR, OVERSTAY_LONG_STAY_MIN_SECONDS);
+    if (elapsed >= long_stay) {
+        overstay_raise(OVERSTAY_ALERT_LONG_STAY, session_start, elapsed, long_stay);
+    }
+}
+
+void overstay_set_threshold(overstay_threshold threshold, uint32_t seconds)
+{
+    _config.thresholds[threshold] = seconds;
+
+    nvs_handle handle;
+    if (nvs_open("config", NVS_READWRITE, &handle) == ESP_OK) {
+        nvs_set_u32(handle, _threshold_keys[threshold], seconds);
+        nvs_commit(handle);
+        nvs_close(handle);
+    }
+    aziot_report_int(_threshold_topics[threshold], seconds);
+    ESP_LOGI(LOG_TAG_DEVICE_CONTROL, "config - %s alert: %us", _threshold_keys[threshold], seconds);
+}
+
+const char* overstay_get_alert_name(overstay_alert_type type)
+{
+    return _alert_names[type];
+}
+
+void init_overstay(void)
+{
+    _config.thresholds[OVERSTAY_THRESHOLD_OVERSTAY] = OVERSTAY_DEFAULT_SECONDS;
+    _config.thresholds[OVERSTAY_THRESHOLD_STUCK] = OVERSTAY_STUCK_DEFAULT_SECONDS;
+
+    nvs_handle handle;
+    if (nvs_open("config", NVS_READONLY, &handle) == ESP_OK) {
+        nvs_get_u32(handle, NVS_KEY_CONFIG_OVERSTAY, &_config.thresholds[OVERSTAY_THRESHOLD_OVERSTAY]);
+        nvs_get_u32(handle, NVS_KEY_CONFIG_STUCK, &_config.thresholds[OVERSTAY_THRESHOLD_STUCK]);
+        nvs_close(handle);
+    }
+    aziot_report_int(MQTT_CONFIG_ALERT_OVERSTAY_TOPIC, _config.thresholds[OVERSTAY_THRESHOLD_OVERSTAY]);
+    aziot_report_int(MQTT_CONFIG_ALERT_STUCK_TOPIC, _config.thresholds[OVERSTAY_THRESHOLD_STUCK]);
+
+    _config.timer = app_timer_create(APP_TIMER_OVERSTAY_CHECK, "overstay_timer",
+        OVERSTAY_CHECK_INTERVAL_MS / portTICK_PERIOD_MS, pdTRUE, overstay_timeout);
+}
+
+void start_overstay(void)
+{
+    xTimerStart(_config.timer, portMAX_DELAY);
+}
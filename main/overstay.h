@@ -0,0 +1,59 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#ifndef OVERSTAY_H
+#define OVERSTAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef enum overstay_alert_type_t {
+    OVERSTAY_ALERT_OVERSTAY, // past the configured threshold
+    OVERSTAY_ALERT_LONG_STAY, // well past what is usual for the hour
+    OVERSTAY_ALERT_STUCK, // detecting with no edge for too long
+    OVERSTAY_ALERT_ENDED, // a session that raised an alert is over
+    OVERSTAY_ALERT_COUNT
+} overstay_alert_type;
+
+typedef enum overstay_threshold_t {
+    OVERSTAY_THRESHOLD_OVERSTAY,
+    OVERSTAY_THRESHOLD_STUCK,
+} overstay_threshold;
+
+// Needs NVS. Everything else runs on the device control task
+void init_overstay(void);
+void start_overstay(void);
+
+// Durations are measured on the monotonic clock in microseconds, the epoch times only label alerts
+void overstay_on_edge(time_t edge_time, int64_t edge_us);
+void overstay_on_session_end(time_t start, uint32_t elapsed_second);
+// Periodic, while a session may be live. session_start is 0 without one
+void overstay_check(int64_t now_us, time_t session_start, int64_t session_start_us, bool detected);
+// 0 disables
+void overstay_set_threshold(overstay_threshold threshold, uint32_t seconds);
+
+const char* overstay_get_alert_name(overstay_alert_type type);
+
+#endif // OVERSTAY_H
@@ -0,0 +1,312 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "esp_log.h"
+
+#include "global.h"
+
+#include "router.h"
+
+#define ROUTER_INDEX_MASK (ROUTER_INDEX_SIZE - 1)
+#define ROUTER_INDEX_EMPTY 0xff
+#define ROUTER_MAX_SEGMENTS 32 // shapes are bit masks over segments
+#define ROUTER_FNV_OFFSET 2166136261u
+#define ROUTER_FNV_PRIME 16777619u
+
+_Static_assert((ROUTER_INDEX_SIZE & ROUTER_INDEX_MASK) == 0, "ROUTER_INDEX_SIZE must be a power of two");
+_Static_assert(ROUTER_INDEX_SIZE >= 2 * ROUTER_MAX_ROUTES, "ROUTER_INDEX_SIZE must be at least twice ROUTER_MAX_ROUTES");
+_Static_assert(ROUTER_MAX_ROUTES < ROUTER_INDEX_EMPTY, "route index is a byte");
+
+typedef struct router_index_entry_t {
+    uint32_t hash;
+    uint8_t route;
+} router_index_entry;
+
+struct router_t {
+    const router_route* routes;
+    size_t count;
+    uint32_t shapes[ROUTER_MAX_SHAPES]; // bit n set: segment n is "+". Exact routes have shape 0
+    size_t shape_count;
+    router_index_entry index[ROUTER_INDEX_SIZE]; // open addressing, linear probing
+};
+
+static router _routers[ROUTER_INSTANCES];
+static size_t _router_count;
+
+static const char* const _payload_type_names[] = {
+    [ROUTER_PAYLOAD_RAW] = "raw",
+    [ROUTER_PAYLOAD_BOOL] = "bool",
+    [ROUTER_PAYLOAD_INT] = "int",
+    [ROUTER_PAYLOAD_JSON] = "json",
+};
+
+static inline uint32_t router_fnv(uint32_t hash, char c)
+{
+    return (hash ^ (uint8_t)c) * ROUTER_FNV_PRIME;
+}
+
+// FNV-1a over the topic, with the segments in shape hashed as "+". So a topic hashed with
+// a route's shape equals the hash of the route's pattern
+static uint32_t router_hash(const char* topic, int len, uint32_t shape)
+{
+    uint32_t hash = ROUTER_FNV_OFFSET;
+    uint32_t segment = 0;
+    bool masked = shape & 1;
+    if (masked) {
+        hash = router_fnv(hash, '+');
+    }
+    for (int i = 0; i < len; ++i) {
+        if (topic[i] == '/') {
+            hash = router_fnv(hash, '/');
+            ++segment;
+            masked = segment < ROUTER_MAX_SEGMENTS && ((shape >> segment) & 1);
+            if (masked) {
+                hash = router_fnv(hash, '+');
+            }
+        } else if (!masked) {
+            hash = router_fnv(hash, topic[i]);
+        }
+    }
+    return hash;
+}
+
+// Returns false if the pattern is unusable
+static bool router_shape(const char* pattern, uint32_t* shape)
+{
+    uint32_t segment = 0;
+    size_t wildcards = 0;
+    *shape = 0;
+    for (const char* p = pattern; ; ++p) {
+        bool segment_start = p == pattern || p[-1] == '/';
+        if (segment_start && p[0] == '+' && (p[1] == '/' || p[1] == 0)) {
+            *shape |= 1u << segment;
+            ++wildcards;
+        }
+        if (*p == 0) {
+            break;
+        }
+        if (*p == '/' && ++segment == ROUTER_MAX_SEGMENTS) {
+            return false;
+        }
+    }
+    return wildcards <= ROUTER_MAX_WILDCARDS && strchr(pattern, '#') == NULL;
+}
+
+// Verifies a hash hit and collects the wildcard segments
+static bool router_match(const char* pattern, const char* topic, int topic_len, router_message* message)
+{
+    const char* p = pattern;
+    int t = 0;
+    message->wildcard_count = 0;
+    for (;;) {
+        int segment_end = t;
+        while (segment_end < topic_len && topic[segment_end] != '/') {
+            ++segment_end;
+        }
+
+        if (p[0] == '+' && (p[1] == '/' || p[1] == 0)) {
+            message->wildcards[message->wildcard_count] = topic + t;
+            message->wildcard_len[message->wildcard_count] = segment_end - t;
+            ++message->wildcard_count;
+            ++p;
+        } else {
+            for (; t < segment_end; ++t, ++p) {
+                if (*p != topic[t]) {
+                    return false;
+                }
+            }
+            if (*p != '/' && *p != 0) {
+                return false;
+            }
+        }
+
+        t = segment_end;
+        if (*p == 0) {
+            return t == topic_len;
+        }
+        if (t == topic_len) {
+            return false;
+        }
+        // both are at a '/'
+        ++p;
+        ++t;
+    }
+}
+
+router* router_create(const router_route* routes, size_t count)
+{
+    if (_router_count == ROUTER_INSTANCES || count > ROUTER_MAX_ROUTES) {
+        ESP_LOGE(LOG_TAG_ROUTER, "cannot create router with %u routes", count);
+        abort();
+    }
+
+    router* r = &_routers[_router_count++];
+    r->routes = routes;
+    r->count = count;
+    r->shape_count = 0;
+    memset(r->index, ROUTER_INDEX_EMPTY, sizeof r->index);
+
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t shape;
+        if (!router_shape(routes[i].pattern, &shape)) {
+            ESP_LOGE(LOG_TAG_ROUTER, "invalid route pattern: %s", routes[i].pattern);
+            abort();
+        }
+
+        size_t s = 0;
+        while (s < r->shape_count && r->shapes[s] != shape) {
+            ++s;
+        }
+        if (s == r->shape_count) {
+            if (s == ROUTER_MAX_SHAPES) {
+                ESP_LOGE(LOG_TAG_ROUTER, "more than %d wildcard shapes, at %s", ROUTER_MAX_SHAPES, routes[i].pattern);
+                abort();
+            }
+            r->shapes[r->shape_count++] = shape;
+        }
+
+        uint32_t hash = router_hash(routes[i].pattern, strlen(routes[i].pattern), 0);
+        uint32_t slot = hash & ROUTER_INDEX_MASK;
+        while (r->index[slot].route != ROUTER_INDEX_EMPTY) {
+            slot = (slot + 1) & ROUTER_INDEX_MASK;
+        }
+        r->index[slot].hash = hash;
+        r->index[slot].route = i;
+    }
+
+    return r;
+}
+
+static const router_route* router_lookup(const router* r, const char* topic, int topic_len, router_message* message)
+{
+    for (size_t s = 0; s < r->shape_count; ++s) {
+        uint32_t hash = router_hash(topic, topic_len, r->shapes[s]);
+        for (uint32_t slot = hash & ROUTER_INDEX_MASK; r->index[slot].route != ROUTER_INDEX_EMPTY; slot = (slot + 1) & ROUTER_INDEX_MASK) {
+            const router_route* route = &r->routes[r->index[slot].route];
+            if (r->index[slot].hash == hash && router_match(route->pattern, topic, topic_len, message)) {
+                return route;
+            }
+        }
+    }
+    return NULL;
+}
+
+static bool router_equals(const char* data, int data_len, const char* str)
+{
+    return (int)strlen(str) == data_len && strncasecmp(data, str, data_len) == 0;
+}
+
+static bool router_decode_bool(router_message* message)
+{
+    if (router_equals(message->data, message->data_len, "true") || router_equals(message->data, message->data_len, "on")
+        || router_equals(message->data, message->data_len, "1")) {
+        message->value_bool = true;
+        return true;
+    }
+    if (router_equals(message->data, message->data_len, "false") || router_equals(message->data, message->data_len, "off")
+        || router_equals(message->data, message->data_len, "0")) {
+        message->value_bool = false;
+        return true;
+    }
+    return false;
+}
+
+static bool router_decode_int(router_message* message)
+{
+    char str[16];
+    if (message->data_len <= 0 || message->data_len >= (int)sizeof str) {
+        return false;
+    }
+    strncpy(str, message->data, message->data_len)[message->data_len] = 0;
+
+    char* end;
+    errno = 0;
+    long value = strtol(str, &end, 10);
+    if (*end != 0 || errno == ERANGE || value < INT32_MIN || value > INT32_MAX) {
+        return false;
+    }
+    message->value_int = value;
+    return true;
+}
+
+bool router_dispatch(const router* r, const char* topic, int topic_len, const char* data, int data_len)
+{
+    router_message message = {
+        .topic = topic,
+        .topic_len = topic_len,
+        .data = data,
+        .data_len = data_len,
+    };
+
+    const router_route* route = router_lookup(r, topic, topic_len, &message);
+    if (route == NULL) {
+        ESP_LOGE(LOG_TAG_ROUTER, "no route for topic: %.*s", topic_len, topic);
+        return false;
+    }
+
+    bool decoded = true;
+    switch (route->payload_type) {
+    case ROUTER_PAYLOAD_RAW:
+        break;
+    case ROUTER_PAYLOAD_BOOL:
+        decoded = router_decode_bool(&message);
+        break;
+    case ROUTER_PAYLOAD_INT:
+        decoded = router_decode_int(&message);
+        break;
+    case ROUTER_PAYLOAD_JSON:
+        if (data_len > ROUTER_MAX_JSON_LEN) {
+            decoded = false;
+            break;
+        }
+        {
+            // cJSON needs a terminated string, MQTT payloads aren't
+            char json_str[data_len + 1];
+            strncpy(json_str, data, data_len)[data_len] = 0;
+            cJSON* json = cJSON_Parse(json_str);
+            if (json == NULL) {
+                decoded = false;
+                break;
+            }
+            message.value_json = json;
+            route->handler(&message);
+            cJSON_Delete(json);
+        }
+        return true;
+    }
+
+    if (!decoded) {
+        ESP_LOGE(LOG_TAG_ROUTER, "invalid %s payload for %s: %.*s", _payload_type_names[route->payload_type],
+            route->pattern, data_len, data);
+        return false;
+    }
+
+    route->handler(&message);
+    return true;
+}
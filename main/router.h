@@ -0,0 +1,79 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cJSON.h"
+
+#define ROUTER_MAX_WILDCARDS 4
+
+typedef enum router_payload_type_t {
+    ROUTER_PAYLOAD_RAW,
+    ROUTER_PAYLOAD_BOOL, // true/false, on/off, 1/0
+    ROUTER_PAYLOAD_INT, // decimal, the whole payload must be a number
+    ROUTER_PAYLOAD_JSON, // parsed with cJSON, freed after the handler returns
+} router_payload_type;
+
+typedef struct router_message_t {
+    const char* topic;
+    int topic_len;
+    // "+" segments of the pattern, in order. Not NUL terminated
+    const char* wildcards[ROUTER_MAX_WILDCARDS];
+    int wildcard_len[ROUTER_MAX_WILDCARDS];
+    size_t wildcard_count;
+
+    const char* data;
+    int data_len;
+    union {
+        bool value_bool;
+        int value_int;
+        const cJSON* value_json;
+    };
+} router_message;
+
+typedef void (*router_handler)(const router_message* message);
+
+// pattern: "/" separated, a segment may be "+" to match any single segment
+typedef struct router_route_t {
+    const char* pattern;
+    router_payload_type payload_type;
+    router_handler handler;
+} router_route;
+
+typedef struct router_t router;
+
+// Routes have to outlive the router, i.e. a static const table
+router* router_create(const router_route* routes, size_t count);
+
+// Exact topics take one hash lookup, wildcard routes one more lookup per distinct set of
+// "+" positions, regardless of how many routes there are.
+// Returns false if no route matched or the payload didn't decode
+bool router_dispatch(const router* router, const char* topic, int topic_len, const char* data, int data_len);
+
+#endif
@@ -0,0 +1,302 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+
+#include "global.h"
+
+#include "sessionlog.h"
+
+// The partition is a ring of sectors. Each starts with a header holding its generation, which
+// orders the ring, and the start of its first session, which is the sparse time index.
+// Records are appended into erased flash, an erased start marks the end.
+#define SESSIONLOG_SECTOR_SIZE 4096
+#define SESSIONLOG_HEADER_MAGIC 0x534c4f47 // "SLOG"
+#define SESSIONLOG_RECORD_MAGIC 0x5e55104e
+#define SESSIONLOG_ERASED 0xffffffff
+#define SESSIONLOG_RECORDS_PER_SECTOR ((SESSIONLOG_SECTOR_SIZE - sizeof(sessionlog_header)) / sizeof(sessionlog_record))
+#define SESSIONLOG_READ_BATCH 16
+
+typedef struct sessionlog_header_t {
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t first_start_epoch_second;
+    uint32_t reserved;
+} sessionlog_header;
+
+_Static_assert(sizeof(sessionlog_header) == sizeof(sessionlog_record), "header takes one record slot");
+
+typedef struct sessionlog_sector_t {
+    uint32_t generation; // 0 if unused
+    uint32_t first_start_epoch_second;
+} sessionlog_sector;
+
+typedef struct sessionlog_config_t {
+    const esp_partition_t* partition;
+    size_t sector_count;
+    sessionlog_sector sectors[SESSIONLOG_MAX_SECTORS]; // the index, in RAM
+    size_t order[SESSIONLOG_MAX_SECTORS]; // used sectors, oldest first
+    size_t used;
+    size_t write_records; // in the newest sector
+} sessionlog_config;
+
+static sessionlog_config _config;
+
+static size_t sessionlog_record_offset(size_t sector, size_t record)
+{
+    return sector * SESSIONLOG_SECTOR_SIZE + sizeof(sessionlog_header) + record * sizeof(sessionlog_record);
+}
+
+static bool sessionlog_record_is_valid(const sessionlog_record* record)
+{
+    return record->start_epoch_second != SESSIONLOG_ERASED
+        && record->check == (record->start_epoch_second ^ record->elapsed_second ^ SESSIONLOG_RECORD_MAGIC);
+}
+
+uint32_t sessionlog_record_seq(const sessionlog_record* record)
+{
+    return record->seq == SESSIONLOG_ERASED ? 0 : record->seq;
+}
+
+static void sessionlog_build_order(void)
+{
+    _config.used = 0;
+    for (size_t i = 0; i < _config.sector_count; ++i) {
+        if (_config.sectors[i].generation == 0) {
+            continue;
+        }
+        size_t j = _config.used++;
+        for (; j > 0 && _config.sectors[_config.order[j - 1]].generation > _config.sectors[i].generation; --j) {
+            _config.order[j] = _config.order[j - 1];
+        }
+        _config.order[j] = i;
+    }
+}
+
+// Records are written in order, the first erased one is the end
+static size_t sessionlog_count_records(size_t sector)
+{
+    size_t low = 0;
+    size_t high = SESSIONLOG_RECORDS_PER_SECTOR;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        uint32_t start;
+        esp_partition_read(_config.partition, sessionlog_record_offset(sector, mid), &start, sizeof start);
+        if (start == SESSIONLOG_ERASED) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    return low;
+}
+
+void init_sessionlog(void)
+{
+    _config.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, SESSIONLOG_PARTITION_SUBTYPE, SESSIONLOG_PARTITION_LABEL);
+    if (_config.partition == NULL) {
+        ESP_LOGE(LOG_TAG_SESSION_LOG, "no %s partition, session history disabled", SESSIONLOG_PARTITION_LABEL);
+        return;
+    }
+    _config.sector_count = MIN(_config.partition->size / SESSIONLOG_SECTOR_SIZE, SESSIONLOG_MAX_SECTORS);
+
+    for (size_t i = 0; i < _config.sector_count; ++i) {
+        sessionlog_header header;
+        esp_partition_read(_config.partition, i * SESSIONLOG_SECTOR_SIZE, &header, sizeof header);
+        if (header.magic == SESSIONLOG_HEADER_MAGIC && header.generation != SESSIONLOG_ERASED) {
+            _config.sectors[i].generation = header.generation;
+            _config.sectors[i].first_start_epoch_second = header.first_start_epoch_second;
+        }
+    }
+    sessionlog_build_order();
+    if (_config.used > 0) {
+        _config.write_records = sessionlog_count_records(_config.order[_config.used - 1]);
+    }
+
+    ESP_LOGI(LOG_TAG_SESSION_LOG, "%u of %u sectors used, %u sessions in the newest, room for %u",
+        _config.used, _config.sector_count, _config.write_records, _config.sector_count * SESSIONLOG_RECORDS_PER_SECTOR);
+}
+
+// Erases the oldest or next unused sector and makes it the newest
+static bool sessionlog_open_sector(uint32_t first_start_epoch_second)
+{
+    size_t sector;
+    uint32_t generation = 1;
+    if (_config.used > 0) {
+        generation = _config.sectors[_config.order[_config.used - 1]].generation + 1;
+    }
+    if (_config.used < _config.sector_count) {
+        for (sector = 0; _config.sectors[sector].generation != 0; ++sector) {
+        }
+    } else {
+        sector = _config.order[0]; // retention by wrap-around
+    }
+
+    sessionlog_header header = {
+        .magic = SESSIONLOG_HEADER_MAGIC,
+        .generation = generation,
+        .first_start_epoch_second = first_start_epoch_second,
+        .reserved = SESSIONLOG_ERASED,
+    };
+    if (esp_partition_erase_range(_config.partition, sector * SESSIONLOG_SECTOR_SIZE, SESSIONLOG_SECTOR_SIZE) != ESP_OK
+        || esp_partition_write(_config.partition, sector * SESSIONLOG_SECTOR_SIZE, &header, sizeof header) != ESP_OK) {
+        ESP_LOGE(LOG_TAG_SESSION_LOG, "failed to open sector %u", sector);
+        _config.sectors[sector].generation = 0;
+        sessionlog_build_order();
+        return false;
+    }
+    _config.sectors[sector].generation = generation;
+    _config.sectors[sector].first_start_epoch_second = first_start_epoch_second;
+    sessionlog_build_order();
+    _config.write_records = 0;
+    return true;
+}
+
+void sessionlog_append(uint32_t start_epoch_second, uint32_t elapsed_second, uint32_t seq)
+{
+    if (_config.partition == NULL) {
+        return;
+    }
+    if ((_config.used == 0 || _config.write_records == SESSIONLOG_RECORDS_PER_SECTOR) && !sessionlog_open_sector(start_epoch_second)) {
+        return;
+    }
+
+    sessionlog_record record = {
+        .start_epoch_second = start_epoch_second,
+        .elapsed_second = elapsed_second,
+        .seq = seq,
+        .check = start_epoch_second ^ elapsed_second ^ SESSIONLOG_RECORD_MAGIC,
+    };
+    size_t sector = _config.order[_config.used - 1];
+    if (esp_partition_write(_config.partition, sessionlog_record_offset(sector, _config.write_records), &record, sizeof record) != ESP_OK) {
+        ESP_LOGE(LOG_TAG_SESSION_LOG, "failed to append to sector %u", sector);
+    }
+    // a failed slot is skipped, it doesn't pass the check
+    ++_config.write_records;
+}
+
+static size_t sessionlog_records_in(size_t position)
+{
+    return position == _config.used - 1 ? _config.write_records : SESSIONLOG_RECORDS_PER_SECTOR;
+}
+
+// The cursor names its sector and that sector's generation rather than a position in the ring,
+// appends between two resumes may recycle the oldest sector
+static void sessionlog_cursor_set(sessionlog_cursor* cursor, size_t position, size_t record)
+{
+    if (position >= _config.used) {
+        cursor->generation = 0;
+        return;
+    }
+    cursor->sector = _config.order[position];
+    cursor->generation = _config.sectors[cursor->sector].generation;
+    cursor->record = record;
+}
+
+void sessionlog_query_range(sessionlog_cursor* cursor, uint32_t from, uint32_t to)
+{
+    // the index skips every sector that ends before from, the next sector's first start bounds it
+    size_t position = 0;
+    while (position + 1 < _config.used && _config.sectors[_config.order[position + 1]].first_start_epoch_second < from) {
+        ++position;
+    }
+    cursor->from = from;
+    cursor->to = to;
+    sessionlog_cursor_set(cursor, position, 0);
+}
+
+void sessionlog_query_last(sessionlog_cursor* cursor, uint32_t count)
+{
+    cursor->from = 0;
+    cursor->to = SESSIONLOG_ERASED - 1;
+    if (_config.used == 0) {
+        cursor->generation = 0;
+        return;
+    }
+    // walk back by whole sectors, every one but the newest is full
+    size_t position = _config.used - 1;
+    size_t record = 0;
+    size_t remaining = count;
+    for (;;) {
+        size_t available = sessionlog_records_in(position);
+        if (remaining <= available) {
+            record = available - remaining;
+            break;
+        }
+        remaining -= available;
+        if (position == 0) {
+            break;
+        }
+        --position;
+    }
+    sessionlog_cursor_set(cursor, position, record);
+}
+
+bool sessionlog_query_resume(sessionlog_cursor* cursor, sessionlog_emit emit, void* context)
+{
+    if (cursor->generation == 0) {
+        return false;
+    }
+    size_t position = 0;
+    size_t record = 0;
+    if (_config.sectors[cursor->sector].generation == cursor->generation) {
+        while (_config.order[position] != cursor->sector) {
+            ++position;
+        }
+        record = cursor->record;
+    } // else recycled under the cursor, its sessions are gone, carry on from the oldest
+
+    sessionlog_record batch[SESSIONLOG_READ_BATCH];
+    for (; position < _config.used; ++position, record = 0) {
+        size_t sector = _config.order[position];
+        if (_config.sectors[sector].first_start_epoch_second > cursor->to) {
+            break;
+        }
+        size_t count = sessionlog_records_in(position);
+        while (record < count) {
+            size_t n = MIN(count - record, SESSIONLOG_READ_BATCH);
+            if (esp_partition_read(_config.partition, sessionlog_record_offset(sector, record), batch, n * sizeof batch[0]) != ESP_OK) {
+                ESP_LOGE(LOG_TAG_SESSION_LOG, "failed to read sector %u", sector);
+                cursor->generation = 0;
+                return false;
+            }
+            for (size_t i = 0; i < n; ++i) {
+                const sessionlog_record* r = &batch[i];
+                if (!sessionlog_record_is_valid(r) || r->start_epoch_second < cursor->from || r->start_epoch_second > cursor->to) {
+                    continue;
+                }
+                if (!emit(r, context)) {
+                    sessionlog_cursor_set(cursor, position, record + i + 1);
+                    return true;
+                }
+            }
+            record += n;
+        }
+    }
+    cursor->generation = 0;
+    return false;
+}
@@ -0,0 +1,69 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#ifndef SESSIONLOG_H
+#define SESSIONLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct sessionlog_record_t {
+    uint32_t start_epoch_second;
+    uint32_t elapsed_second;
+    uint32_t seq; // of the live uplink, outside the check so older records stay valid
+    uint32_t check; // start ^ elapsed ^ SESSIONLOG_RECORD_MAGIC, catches torn writes
+} sessionlog_record;
+
+// Returns false to pause the query, the cursor then points past record
+typedef bool (*sessionlog_emit)(const sessionlog_record* record, void* context);
+
+// Where a query resumes. Sessions appended meanwhile are streamed too, if they match
+typedef struct sessionlog_cursor_t {
+    size_t sector;
+    uint32_t generation; // of sector, 0 once the query is over
+    size_t record;
+    uint32_t from;
+    uint32_t to;
+} sessionlog_cursor;
+
+// Finds the partition and the write position. Without the partition the log stays empty
+void init_sessionlog(void);
+
+// Appends and queries are datalink task only and need no lock. The sector erase every 255
+// sessions still turns the flash cache off on both cores, stalling every task, device
+// control included, for tens of milliseconds
+void sessionlog_append(uint32_t start_epoch_second, uint32_t elapsed_second, uint32_t seq);
+// 0 if unknown
+uint32_t sessionlog_record_seq(const sessionlog_record* record);
+
+// Start a query, oldest first. Sessions started within [from, to]
+void sessionlog_query_range(sessionlog_cursor* cursor, uint32_t from, uint32_t to);
+// The last count sessions
+void sessionlog_query_last(sessionlog_cursor* cursor, uint32_t count);
+// Streams from the cursor until emit pauses it or the query is over. Returns false once it's
+// over, also after an unreadable sector
+bool sessionlog_query_resume(sessionlog_cursor* cursor, sessionlog_emit emit, void* context);
+
+#endif // SESSIONLOG_H
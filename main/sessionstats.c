@@ -0,0 +1,396 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#include "global.h"
+
+#include "sessionstats.h"
+
+#define NVS_NAMESPACE_SESSION_STATS "stats"
+#define NVS_KEY_SESSION_STATS "days"
+#define SESSIONSTATS_VERSION 2
+#define SESSIONSTATS_HISTOGRAM_BUCKETS 8
+#define SESSIONSTATS_P2_MARKERS 5
+#define SESSIONSTATS_QUANTILE 0.95f
+
+// Upper bounds in seconds, the last bucket takes the rest
+static const uint16_t _histogram_bounds[SESSIONSTATS_HISTOGRAM_BUCKETS - 1] = { 30, 60, 120, 300, 600, 1200, 2400 };
+
+// P-square quantile estimate (Jain & Chlamtac), five markers whatever the number of sessions.
+// The first five observations are kept sorted in q until the markers start moving
+typedef struct sessionstats_p2_t {
+    float q[SESSIONSTATS_P2_MARKERS];
+    float desired[SESSIONSTATS_P2_MARKERS];
+    int32_t n[SESSIONSTATS_P2_MARKERS];
+    uint32_t count;
+} sessionstats_p2;
+
+typedef struct sessionstats_hour_t {
+    uint16_t visits;
+    uint16_t longest_seconds;
+    uint32_t total_seconds;
+} sessionstats_hour;
+
+typedef struct sessionstats_day_t {
+    int32_t day; // since the epoch, in SESSIONSTATS_UTC_OFFSET_SECONDS local time. 0 if unused
+    uint32_t visits;
+    uint32_t total_seconds;
+    uint32_t longest_seconds;
+    uint16_t histogram[SESSIONSTATS_HISTOGRAM_BUCKETS];
+    sessionstats_p2 p95;
+    sessionstats_hour hours[24];
+} sessionstats_day;
+
+// Persisted as is
+typedef struct sessionstats_persisted_t {
+    uint32_t version;
+    sessionstats_day current;
+    sessionstats_day closed; // waiting to be uplinked if day is set
+    float baseline_seconds[24]; // moving average by hour of day, across days
+    uint16_t baseline_sessions[24];
+} sessionstats_persisted;
+
+typedef struct sessionstats_config_t {
+    portMUX_TYPE lock;
+    sessionstats_persisted days;
+    bool dirty;
+    bool delivered; // the closed day was cleared, persist it now
+    int64_t persisted_us;
+    int64_t summary_sent_us; // of the closed day, 0 until queued
+    uint32_t late_sessions; // dropped, their day already summarized
+    uint32_t late_reported; // of those, in the summary waiting for delivery
+} sessionstats_config;
+
+static sessionstats_config _config = {
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+static void sessionstats_p2_add(sessionstats_p2* p2, float x)
+{
+    static const float increments[SESSIONSTATS_P2_MARKERS] = {
+        0, SESSIONSTATS_QUANTILE / 2, SESSIONSTATS_QUANTILE, (1 + SESSIONSTATS_QUANTILE) / 2, 1
+    };
+    float* q = p2->q;
+    int32_t* n = p2->n;
+
+    if (p2->count < SESSIONSTATS_P2_MARKERS) {
+        // insertion into the sorted start
+        int i = p2->count++;
+        for (; i > 0 && q[i - 1] > x; --i) {
+            q[i] = q[i - 1];
+        }
+        q[i] = x;
+        if (p2->count == SESSIONSTATS_P2_MARKERS) {
+            for (int j = 0; j < SESSIONSTATS_P2_MARKERS; ++j) {
+                n[j] = j;
+                p2->desired[j] = 4 * increments[j];
+            }
+        }
+        return;
+    }
+    ++p2->count;
+
+    int k;
+    if (x < q[0]) {
+        q[0] = x;
+        k = 0;
+    } else if (x >= q[4]) {
+        q[4] = x;
+        k = 3;
+    } else {
+        for (k = 0; x >= q[k + 1]; ++k) {
+        }
+    }
+    for (int i = k + 1; i < SESSIONSTATS_P2_MARKERS; ++i) {
+        ++n[i];
+    }
+    for (int i = 0; i < SESSIONSTATS_P2_MARKERS; ++i) {
+        p2->desired[i] += increments[i];
+    }
+
+    for (int i = 1; i < SESSIONSTATS_P2_MARKERS - 1; ++i) {
+        float d = p2->desired[i] - n[i];
+        if ((d >= 1 && n[i + 1] - n[i] > 1) || (d <= -1 && n[i - 1] - n[i] < -1)) {
+            int s = d > 0 ? 1 : -1;
+            float parabolic = q[i] + (float)s / (n[i + 1] - n[i - 1])
+                * ((n[i] - n[i - 1] + s) * (q[i + 1] - q[i]) / (n[i + 1] - n[i])
+                    + (n[i + 1] - n[i] - s) * (q[i] - q[i - 1]) / (n[i] - n[i - 1]));
+            if (q[i - 1] < parabolic && parabolic < q[i + 1]) {
+                q[i] = parabolic;
+            } else {
+                q[i] += s * (q[i + s] - q[i]) / (n[i + s] - n[i]);
+            }
+            n[i] += s;
+        }
+    }
+}
+
+static uint32_t sessionstats_p2_get(const sessionstats_p2* p2)
+{
+    if (p2->count == 0) {
+        return 0;
+    }
+    if (p2->count < SESSIONSTATS_P2_MARKERS) {
+        // nearest rank on the few sorted values
+        uint32_t rank = (uint32_t)(SESSIONSTATS_QUANTILE * p2->count + 0.999f);
+        return (uint32_t)(p2->q[rank - 1] + 0.5f);
+    }
+    return (uint32_t)(p2->q[2] + 0.5f);
+}
+
+static int32_t sessionstats_day_of(time_t epoch_second)
+{
+    return (int32_t)((epoch_second + SESSIONSTATS_UTC_OFFSET_SECONDS) / (24 * 60 * 60));
+}
+
+// Called with the lock held
+static void sessionstats_close_day(int32_t day)
+{
+    if (_config.days.closed.day != 0) {
+        ESP_LOGW(LOG_TAG_SESSION_STATS, "summary of day %d never went out, replaced", _config.days.closed.day);
+    }
+    _config.days.closed = _config.days.current;
+    memset(&_config.days.current, 0, sizeof _config.days.current);
+    _config.days.current.day = day;
+    _config.summary_sent_us = 0;
+    _config.dirty = true;
+}
+
+static void sessionstats_day_add(sessionstats_day* d, unsigned int hour, size_t bucket, uint32_t elapsed_second)
+{
+    ++d->visits;
+    d->total_seconds += elapsed_second;
+    d->longest_seconds = MAX(d->longest_seconds, elapsed_second);
+    ++d->histogram[bucket];
+    sessionstats_p2_add(&d->p95, elapsed_second);
+
+    sessionstats_hour* h = &d->hours[hour];
+    ++h->visits;
+    h->total_seconds += elapsed_second;
+    h->longest_seconds = MIN(MAX(h->longest_seconds, elapsed_second), UINT16_MAX);
+}
+
+void sessionstats_record(time_t start_epoch_second, uint32_t elapsed_second)
+{
+    int32_t day = sessionstats_day_of(start_epoch_second);
+    unsigned int hour = (start_epoch_second + SESSIONSTATS_UTC_OFFSET_SECONDS) % (24 * 60 * 60) / (60 * 60);
+    size_t bucket = 0;
+    while (bucket < SESSIONSTATS_HISTOGRAM_BUCKETS - 1 && elapsed_second > _histogram_bounds[bucket]) {
+        ++bucket;
+    }
+
+    portENTER_CRITICAL(&_config.lock);
+    sessionstats_day* current = &_config.days.current;
+    if (day > current->day) {
+        if (current->day != 0) {
+            sessionstats_close_day(day);
+        } else {
+            current->day = day;
+        }
+    }
+    // a session started before midnight but ending after it still counts on its day, as long
+    // as that day's summary hasn't gone out. Later ones are only counted
+    sessionstats_day* target = NULL;
+    if (day == current->day) {
+        target = current;
+    } else if (day == _config.days.closed.day && _config.summary_sent_us == 0) {
+        target = &_config.days.closed;
+    }
+    if (target != NULL) {
+        sessionstats_day_add(target, hour, bucket, elapsed_second);
+    } else {
+        ++_config.late_sessions;
+    }
+
+    float* baseline = &_config.days.baseline_seconds[hour];
+    if (_config.days.baseline_sessions[hour] == 0) {
+        *baseline = elapsed_second;
+    } else {
+        *baseline += SESSIONSTATS_BASELINE_WEIGHT * (elapsed_second - *baseline);
+    }
+    if (_config.days.baseline_sessions[hour] < UINT16_MAX) {
+        ++_config.days.baseline_sessions[hour];
+    }
+    _config.dirty = true;
+    portEXIT_CRITICAL(&_config.lock);
+
+    if (target == NULL) {
+        ESP_LOGW(LOG_TAG_SESSION_STATS, "session of day %d dropped, already summarized", day);
+    }
+}
+
+static void sessionstats_persist(void)
+{
+    static sessionstats_persisted copy; // too big for the datalink stack
+
+    portENTER_CRITICAL(&_config.lock);
+    copy = _config.days;
+    _config.dirty = false;
+    portEXIT_CRITICAL(&_config.lock);
+
+    nvs_handle handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE_SESSION_STATS, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(handle, NVS_KEY_SESSION_STATS, &copy, sizeof copy);
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(LOG_TAG_SESSION_STATS, "failed to persist: %s", esp_err_to_name(err));
+        _config.dirty = true;
+    }
+    _config.persisted_us = esp_timer_get_time();
+}
+
+// late: sessions dropped since the last delivered summary
+static int sessionstats_format(const sessionstats_day* day, uint32_t late, char* buffer, size_t len)
+{
+    int pos = snprintf(buffer, len,
+        "{\"day\":%lld,\"visits\":%u,\"total\":%u,\"mean\":%u,\"longest\":%u,\"p95\":%u,\"late\":%u,\"hist\":[",
+        (long long)day->day * 24 * 60 * 60 - SESSIONSTATS_UTC_OFFSET_SECONDS, day->visits, day->total_seconds,
+        day->visits ? day->total_seconds / day->visits : 0, day->longest_seconds, sessionstats_p2_get(&day->p95), late);
+    for (int i = 0; i < SESSIONSTATS_HISTOGRAM_BUCKETS && pos < (int)len; ++i) {
+        pos += snprintf(buffer + pos, len - pos, "%s%u", i ? "," : "", day->histogram[i]);
+    }
+
+    // hour: [visits, total, longest], empty hours as 0
+    if (pos < (int)len) {
+        pos += snprintf(buffer + pos, len - pos, "],\"hours\":[");
+    }
+    for (int i = 0; i < 24 && pos < (int)len; ++i) {
+        const sessionstats_hour* h = &day->hours[i];
+        if (h->visits) {
+            pos += snprintf(buffer + pos, len - pos, "%s[%u,%u,%u]", i ? "," : "", h->visits, h->total_seconds, h->longest_seconds);
+        } else {
+            pos += snprintf(buffer + pos, len - pos, "%s0", i ? "," : "");
+        }
+    }
+    if (pos < (int)len) {
+        pos += snprintf(buffer + pos, len - pos, "]}");
+    }
+    return pos;
+}
+
+int sessionstats_service(time_t now, char* buffer, size_t len, int32_t* day)
+{
+    int32_t today = sessionstats_day_of(now);
+    int64_t now_us = esp_timer_get_time();
+
+    portENTER_CRITICAL(&_config.lock);
+    // quiet days close here, busy ones when the first session of the next day ends
+    if (_config.days.current.day != 0 && today > _config.days.current.day) {
+        sessionstats_close_day(today);
+    }
+    bool persist = _config.dirty
+        && (_config.days.closed.day != 0 || _config.delivered
+            || now_us - _config.persisted_us >= SESSIONSTATS_PERSIST_INTERVAL_S * 1000000LL);
+    _config.delivered = false;
+    portEXIT_CRITICAL(&_config.lock);
+
+    if (persist) {
+        sessionstats_persist();
+    }
+
+    static sessionstats_day closed;
+    portENTER_CRITICAL(&_config.lock);
+    bool due = _config.days.closed.day != 0
+        && (_config.summary_sent_us == 0 || now_us - _config.summary_sent_us >= SESSIONSTATS_SUMMARY_RETRY_S * 1000000LL);
+    uint32_t late = _config.late_sessions;
+    if (due) {
+        closed = _config.days.closed;
+        _config.late_reported = late;
+    }
+    portEXIT_CRITICAL(&_config.lock);
+    if (!due) {
+        return 0;
+    }
+    *day = closed.day;
+    return sessionstats_format(&closed, late, buffer, len);
+}
+
+uint32_t sessionstats_get_baseline(time_t start_epoch_second)
+{
+    unsigned int hour = (start_epoch_second + SESSIONSTATS_UTC_OFFSET_SECONDS) % (24 * 60 * 60) / (60 * 60);
+    portENTER_CRITICAL(&_config.lock);
+    uint32_t baseline = _config.days.baseline_sessions[hour] < SESSIONSTATS_BASELINE_MIN_SESSIONS
+        ? 0 : (uint32_t)(_config.days.baseline_seconds[hour] + 0.5f);
+    portEXIT_CRITICAL(&_config.lock);
+    return baseline;
+}
+
+void sessionstats_summary_sent(int32_t day)
+{
+    portENTER_CRITICAL(&_config.lock);
+    if (_config.days.closed.day == day) {
+        _config.summary_sent_us = esp_timer_get_time();
+    }
+    portEXIT_CRITICAL(&_config.lock);
+}
+
+void sessionstats_summary_delivered(int32_t day)
+{
+    portENTER_CRITICAL(&_config.lock);
+    bool cleared = day != 0 && _config.days.closed.day == day;
+    if (cleared) {
+        _config.days.closed.day = 0;
+        _config.summary_sent_us = 0;
+        _config.late_sessions -= _config.late_reported;
+        _config.late_reported = 0;
+        _config.dirty = true;
+        _config.delivered = true;
+    }
+    portEXIT_CRITICAL(&_config.lock);
+    if (cleared) {
+        ESP_LOGI(LOG_TAG_SESSION_STATS, "summary of day %d delivered", day);
+    }
+}
+
+void init_sessionstats(void)
+{
+    nvs_handle handle;
+    size_t len = sizeof _config.days;
+    bool loaded = nvs_open(NVS_NAMESPACE_SESSION_STATS, NVS_READONLY, &handle) == ESP_OK;
+    if (loaded) {
+        loaded = nvs_get_blob(handle, NVS_KEY_SESSION_STATS, &_config.days, &len) == ESP_OK
+            && len == sizeof _config.days && _config.days.version == SESSIONSTATS_VERSION;
+        nvs_close(handle);
+    }
+    if (!loaded) {
+        memset(&_config.days, 0, sizeof _config.days);
+        _config.days.version = SESSIONSTATS_VERSION;
+    }
+    _config.persisted_us = esp_timer_get_time();
+    ESP_LOGI(LOG_TAG_SESSION_STATS, "%s, %u sessions today, %d bytes persisted",
+        loaded ? "restored" : "fresh", _config.days.current.visits, sizeof _config.days);
+}
@@ -0,0 +1,54 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#ifndef SESSIONSTATS_H
+#define SESSIONSTATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Needs NVS
+void init_sessionstats(void);
+
+// O(1), called by device control as each session ends
+void sessionstats_record(time_t start_epoch_second, uint32_t elapsed_second);
+
+// Called periodically by datalink. Closes the day once it's over, persists the aggregates
+// and formats the summary of a closed day, if one is waiting and not sent in the last
+// SESSIONSTATS_SUMMARY_RETRY_S. Returns the summary length, 0 if none, and its day
+int sessionstats_service(time_t now, char* buffer, size_t len, int32_t* day);
+
+// Typical session length for the hour of day start falls in, 0 until it's learned
+uint32_t sessionstats_get_baseline(time_t start_epoch_second);
+
+// After the summary of day returned by sessionstats_service was queued
+void sessionstats_summary_sent(int32_t day);
+
+// Once a transport confirmed the summary of day. The closed day is cleared and persisted by the
+// next sessionstats_service. Any task, repeated calls are ignored
+void sessionstats_summary_delivered(int32_t day);
+
+#endif // SESSIONSTATS_H
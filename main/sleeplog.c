@@ -0,0 +1,307 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include <string.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "driver/rtc_io.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_sleep.h"
+
+#include "global.h"
+
+#include "datalink.h"
+#include "devicecontrollogic.h"
+#include "sleeplog.h"
+#include "tasks.h"
+#include "timeman.h"
+#include "uplinkseq.h"
+
+#define SLEEP_LOG_RTC_MAGIC 0x504f4f52
+
+_Static_assert(SLEEP_LOG_FLUSH_SESSIONS <= SLEEP_LOG_CAPACITY, "flush threshold exceeds RTC buffer capacity");
+
+typedef struct sleep_log_session_t {
+    uint32_t start_epoch_second;
+    uint32_t elapsed_second;
+    uint32_t seq; // taken on the first flush, every resend carries it. 0 until then
+    bool logged; // in the flash history since the first flush
+    bool delivered; // acknowledged by a transport since the flush
+} sleep_log_session;
+
+typedef struct sleep_log_rtc_state_t {
+    uint32_t magic;
+    uint32_t grace_period_seconds;
+    uint32_t open_start_epoch_second; // 0 if no session is open
+    uint32_t count; // closed sessions, kept until their uplink is confirmed
+    int armed_level;
+    sleep_log_session sessions[SLEEP_LOG_CAPACITY];
+} sleep_log_rtc_state;
+
+// Survives deep sleep, lost on power-on or reset
+RTC_DATA_ATTR static sleep_log_rtc_state _rtc_state;
+
+// delivery confirmations come from the transports' tasks
+static portMUX_TYPE _delivered_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void sleep_log_close_session(time_t now)
+{
+    if (_rtc_state.count == SLEEP_LOG_CAPACITY) {
+        // should not happen unless flushes keep failing. drop the oldest one
+        memmove(&_rtc_state.sessions[0], &_rtc_state.sessions[1], sizeof(sleep_log_session) * (SLEEP_LOG_CAPACITY - 1));
+        --_rtc_state.count;
+    }
+
+    // like the awake path, a session lasts until its grace period is over
+    sleep_log_session* session = &_rtc_state.sessions[_rtc_state.count++];
+    session->start_epoch_second = _rtc_state.open_start_epoch_second;
+    session->elapsed_second = now - _rtc_state.open_start_epoch_second + _rtc_state.grace_period_seconds;
+    session->seq = 0;
+    session->logged = false;
+    session->delivered = false;
+    _rtc_state.open_start_epoch_second = 0;
+}
+
+static void sleep_log_record_edge(bool detected, time_t now)
+{
+    if (detected) {
+        if (_rtc_state.open_start_epoch_second != 0) {
+            return;
+        }
+
+        if (_rtc_state.count > 0) {
+            sleep_log_session* last = &_rtc_state.sessions[_rtc_state.count - 1];
+            if (now <= (time_t)(last->start_epoch_second + last->elapsed_second)) {
+                // detected in grace period, reopen the previous session and keep its start time
+                _rtc_state.open_start_epoch_second = last->start_epoch_second;
+                --_rtc_state.count;
+                return;
+            }
+        }
+
+        _rtc_state.open_start_epoch_second = now;
+    } else if (_rtc_state.open_start_epoch_second != 0) {
+        sleep_log_close_session(now);
+    }
+}
+
+static bool sleep_log_flush_due(time_t now)
+{
+    if (_rtc_state.count >= SLEEP_LOG_FLUSH_SESSIONS) {
+        return true;
+    }
+
+    return _rtc_state.count > 0 && now - (time_t)_rtc_state.sessions[0].start_epoch_second >= SLEEP_LOG_FLUSH_MAX_AGE_SECONDS;
+}
+
+static int sleep_log_read_level(void)
+{
+    rtc_gpio_init(BODY_DETECTION_PIN);
+    rtc_gpio_set_direction(BODY_DETECTION_PIN, RTC_GPIO_MODE_INPUT_ONLY);
+    return rtc_gpio_get_level(BODY_DETECTION_PIN);
+}
+
+bool sleep_log_is_available(void)
+{
+    // ext0 wakeup only works on RTC IOs
+    return rtc_gpio_is_valid_gpio(BODY_DETECTION_PIN);
+}
+
+// Returns true if this boot has to go through the full init, i.e. a flush is due
+bool sleep_log_handle_wakeup(void)
+{
+    // ext0 leaves the pin routed to the RTC mux
+    rtc_gpio_deinit(BODY_DETECTION_PIN);
+
+    if (_rtc_state.magic != SLEEP_LOG_RTC_MAGIC) {
+        memset(&_rtc_state, 0, sizeof _rtc_state);
+        _rtc_state.magic = SLEEP_LOG_RTC_MAGIC;
+        _rtc_state.grace_period_seconds = BODY_DETECTION_DEFAULT_GRACE_PERIOD_SECONDS;
+        return true;
+    }
+
+    // the RTC keeps the system time across deep sleep. if it has never been synced, sessions can't be stamped
+    if (!timeman_is_time_set()) {
+        return true;
+    }
+
+    time_t now;
+    time(&now);
+
+    switch (esp_sleep_get_wakeup_cause()) {
+    case ESP_SLEEP_WAKEUP_EXT0: {
+        int level = _rtc_state.armed_level;
+        sleep_log_record_edge(BODY_DETECTION_LOW_ACTIVE ? !level : level, now);
+        break;
+    }
+    case ESP_SLEEP_WAKEUP_TIMER:
+        break;
+    default:
+        return true;
+    }
+
+    return sleep_log_flush_due(now);
+}
+
+static void sleep_log_session_delivered(void* context)
+{
+    uint32_t index = (uint32_t)(uintptr_t)context;
+    portENTER_CRITICAL(&_delivered_lock);
+    if (index < _rtc_state.count) {
+        _rtc_state.sessions[index].delivered = true;
+    }
+    portEXIT_CRITICAL(&_delivered_lock);
+}
+
+uint32_t sleep_log_flush(void)
+{
+    portENTER_CRITICAL(&_delivered_lock);
+    for (uint32_t i = 0; i < _rtc_state.count; ++i) {
+        _rtc_state.sessions[i].delivered = false;
+    }
+    portEXIT_CRITICAL(&_delivered_lock);
+
+    uint32_t queued = 0;
+    for (; queued < _rtc_state.count; ++queued) {
+        sleep_log_session* session = &_rtc_state.sessions[queued];
+        // the backend drops a resend by its seq, so it's taken once and kept with the session
+        if (session->seq == 0) {
+            session->seq = uplinkseq_next();
+        }
+        data_link_event event = {
+            .event_type = DATA_LINK_EVENT_BODY_DETECTION,
+            .body_detection_event = {
+                .start_epoch_second = session->start_epoch_second,
+                .elapsed_ms = (uint64_t)session->elapsed_second * 1000,
+                .seq = session->seq,
+                .logged = session->logged,
+                .on_delivered = sleep_log_session_delivered,
+                .delivered_context = (void*)(uintptr_t)queued }
+        };
+        if (!datalink_send_event(&event)) {
+            break;
+        }
+        session->logged = true;
+    }
+
+    ESP_LOGI(LOG_TAG_SLEEP_LOG, "flushing %u of %u buffered sessions", queued, _rtc_state.count);
+    return queued;
+}
+
+uint32_t sleep_log_get_delivered_count(void)
+{
+    uint32_t delivered = 0;
+    portENTER_CRITICAL(&_delivered_lock);
+    for (uint32_t i = 0; i < _rtc_state.count; ++i) {
+        delivered += _rtc_state.sessions[i].delivered;
+    }
+    portEXIT_CRITICAL(&_delivered_lock);
+    return delivered;
+}
+
+uint32_t sleep_log_remove_delivered(void)
+{
+    uint32_t kept = 0;
+    portENTER_CRITICAL(&_delivered_lock);
+    for (uint32_t i = 0; i < _rtc_state.count; ++i) {
+        if (!_rtc_state.sessions[i].delivered) {
+            _rtc_state.sessions[kept++] = _rtc_state.sessions[i];
+        }
+    }
+    uint32_t removed = _rtc_state.count - kept;
+    _rtc_state.count = kept;
+    portEXIT_CRITICAL(&_delivered_lock);
+    return removed;
+}
+
+// Hands over the session device control is tracking, so it continues in deep sleep
+void sleep_log_adopt_session(time_t start_time)
+{
+    if (start_time != 0 && _rtc_state.open_start_epoch_second == 0) {
+        _rtc_state.open_start_epoch_second = start_time;
+    }
+}
+
+void sleep_log_enter_deep_sleep(void)
+{
+    time_t now;
+    time(&now);
+
+    // catch up with the pin in case an edge was missed while awake
+    int level = sleep_log_read_level();
+    bool detected = BODY_DETECTION_LOW_ACTIVE ? !level : level;
+    if (timeman_is_time_set()) {
+        sleep_log_record_edge(detected, now);
+    }
+
+    // ext0 is level triggered. arm it for the opposite level so both edges wake us up
+    _rtc_state.armed_level = !level;
+    esp_sleep_enable_ext0_wakeup(BODY_DETECTION_PIN, _rtc_state.armed_level);
+
+    if (_rtc_state.count > 0) {
+        time_t age = now - (time_t)_rtc_state.sessions[0].start_epoch_second;
+        time_t remaining = MAX(SLEEP_LOG_FLUSH_MAX_AGE_SECONDS - age, 1);
+        esp_sleep_enable_timer_wakeup((uint64_t)remaining * 1000000ULL);
+    }
+
+    esp_deep_sleep_start();
+}
+
+static void sleep_log_flush_task(void* arg)
+{
+    UNUSED(arg);
+    const TickType_t xDelay = 500 / portTICK_PERIOD_MS;
+    const TickType_t timeout = SLEEP_LOG_FLUSH_TIMEOUT_MS / portTICK_PERIOD_MS;
+    const TickType_t start = xTaskGetTickCount();
+
+    _rtc_state.grace_period_seconds = device_control_get_body_detection_grace_period();
+    uint32_t flushed = sleep_log_flush();
+
+    // stay awake until the clock is synced and a transport acknowledged every flushed session
+    while (xTaskGetTickCount() - start < timeout) {
+        if (timeman_is_time_set() && sleep_log_get_delivered_count() >= flushed) {
+            break;
+        }
+        vTaskDelay(xDelay);
+    }
+
+    // only acknowledged sessions leave RTC memory, the next flush sends the others again
+    uint32_t delivered = sleep_log_remove_delivered();
+    if (delivered < flushed) {
+        ESP_LOGW(LOG_TAG_SLEEP_LOG, "%u of %u flushed sessions unacknowledged, kept", flushed - delivered, flushed);
+    }
+
+    sleep_log_adopt_session(device_control_get_body_detection_start_time());
+    ESP_LOGI(LOG_TAG_SLEEP_LOG, "entering deep sleep");
+    sleep_log_enter_deep_sleep();
+}
+
+void start_sleep_log_flush(void)
+{
+    app_task_start(APP_TASK_SLEEP_LOG_FLUSH, sleep_log_flush_task, NULL);
+}
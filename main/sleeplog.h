@@ -0,0 +1,44 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#ifndef SLEEPLOG_H
+#define SLEEPLOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+bool sleep_log_is_available(void);
+bool sleep_log_handle_wakeup(void);
+// Queues the buffered sessions for uplink, returns how many. They stay buffered until
+// sleep_log_remove_delivered, which drops those a transport acknowledged meanwhile
+uint32_t sleep_log_flush(void);
+uint32_t sleep_log_get_delivered_count(void);
+// Returns how many were removed
+uint32_t sleep_log_remove_delivered(void);
+void sleep_log_adopt_session(time_t start_time);
+void sleep_log_enter_deep_sleep(void);
+void start_sleep_log_flush(void);
+
+#endif // SLEEPLOG_H
@@ -46,6 +46,7 @@ typedef struct Status_t {
     int fan_enabled;
     WifiStatus wifi_status;
     DatalinkStatus datalink_status;
+    DatalinkStatus cloud_status; // IoT Hub, owned by device control
 } DeviceStatus;
 
 extern DeviceStatus __device_status;
@@ -22,3 +22,128 @@
  **************************************************************************/
 // <END LICENSE>
 
+#include "esp_log.h"
+
+#include "global.h"
+
+#include "eventbus.h"
+#include "tasks.h"
+
+typedef struct app_task_info_t {
+    const char* name;
+    uint32_t stack_size;
+    UBaseType_t priority;
+    BaseType_t core;
+    StackType_t* stack;
+} app_task_info;
+
+#define X(id, name, stack, priority, core) static StackType_t id##_stack[stack];
+APP_TASK_TABLE(X)
+#undef X
+
+static const app_task_info _task_info[APP_TASK_COUNT] = {
+#define X(id, name, stack, priority, core) [id] = { name, stack, priority, core, id##_stack },
+    APP_TASK_TABLE(X)
+#undef X
+};
+
+#define APP_TASK_STACK_SUM(id, name, stack, priority, core) +(stack)
+#define APP_TASK_STACK_TOTAL (0 APP_TASK_TABLE(APP_TASK_STACK_SUM))
+
+#define APP_STATIC_RAM_TOTAL (APP_TASK_STACK_TOTAL                     \
+    + APP_TASK_COUNT * sizeof(StaticTask_t)                            \
+    + APP_EVENT_GROUP_COUNT * sizeof(StaticEventGroup_t)               \
+    + APP_TIMER_COUNT * sizeof(StaticTimer_t)                          \
+    + APP_BINARY_SEMAPHORE_COUNT * sizeof(StaticSemaphore_t))
+
+_Static_assert(APP_STATIC_RAM_TOTAL <= APP_STATIC_RAM_BUDGET_BYTES, "statically allocated RTOS objects exceed the RAM budget");
+
+static StaticTask_t _task_buffers[APP_TASK_COUNT];
+static TaskHandle_t _task_handles[APP_TASK_COUNT];
+static StaticEventGroup_t _event_group_buffers[APP_EVENT_GROUP_COUNT];
+static StaticTimer_t _timer_buffers[APP_TIMER_COUNT];
+static StaticSemaphore_t _binary_semaphore_buffers[APP_BINARY_SEMAPHORE_COUNT];
+static size_t _binary_semaphore_count;
+static portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+
+TaskHandle_t app_task_start(app_task task, TaskFunction_t function, void* arg)
+{
+    if (_task_handles[task] != NULL) {
+        ESP_LOGE(LOG_TAG_APP, "task %s already started", _task_info[task].name);
+        return _task_handles[task];
+    }
+
+    const app_task_info* info = &_task_info[task];
+    _task_handles[task] = xTaskCreateStaticPinnedToCore(function, info->name, info->stack_size, arg,
+        info->priority, info->stack, &_task_buffers[task], info->core);
+    return _task_handles[task];
+}
+
+void app_task_exit(app_task task)
+{
+    _task_handles[task] = NULL;
+    vTaskDelete(NULL);
+}
+
+EventGroupHandle_t app_event_group_create(app_event_group group)
+{
+    return xEventGroupCreateStatic(&_event_group_buffers[group]);
+}
+
+TimerHandle_t app_timer_create(app_timer timer, const char* name, TickType_t period, UBaseType_t auto_reload, TimerCallbackFunction_t callback)
+{
+    return xTimerCreateStatic(name, period, auto_reload, (void*)0, callback, &_timer_buffers[timer]);
+}
+
+SemaphoreHandle_t app_binary_semaphore_create(void)
+{
+    size_t index;
+
+    // boot phases run concurrently
+    portENTER_CRITICAL(&_lock);
+    index = _binary_semaphore_count;
+    if (index < APP_BINARY_SEMAPHORE_COUNT) {
+        ++_binary_semaphore_count;
+    }
+    portEXIT_CRITICAL(&_lock);
+
+    if (index == APP_BINARY_SEMAPHORE_COUNT) {
+        ESP_LOGE(LOG_TAG_APP, "out of static binary semaphores");
+        abort();
+    }
+    return xSemaphoreCreateBinaryStatic(&_binary_semaphore_buffers[index]);
+}
+
+const char* app_task_get_name(app_task task)
+{
+    return _task_info[task].name;
+}
+
+uint32_t app_task_get_stack_size(app_task task)
+{
+    return _task_info[task].stack_size;
+}
+
+UBaseType_t app_task_get_stack_high_water_mark(app_task task)
+{
+    if (_task_handles[task] == NULL) {
+        return 0;
+    }
+    return uxTaskGetStackHighWaterMark(_task_handles[task]);
+}
+
+void app_tasks_log_ram_budget(void)
+{
+    ESP_LOGI(LOG_TAG_APP, "static RTOS RAM: %u of %u bytes (stacks %u, %u tasks, %u event groups, %u timers, %u semaphores), event bus %u bytes",
+        APP_STATIC_RAM_TOTAL, APP_STATIC_RAM_BUDGET_BYTES, APP_TASK_STACK_TOTAL,
+        APP_TASK_COUNT, APP_EVENT_GROUP_COUNT, APP_TIMER_COUNT, APP_BINARY_SEMAPHORE_COUNT, eventbus_get_static_size());
+
+    for (int i = 0; i < APP_TASK_COUNT; ++i) {
+        if (_task_handles[i] == NULL) {
+            continue;
+        }
+        ESP_LOGI(LOG_TAG_APP, "task %s: priority %u, core %d, stack %u bytes, high water mark %u bytes free",
+            _task_info[i].name, _task_info[i].priority, _task_info[i].core, _task_info[i].stack_size,
+            app_task_get_stack_high_water_mark(i));
+    }
+}
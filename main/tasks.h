@@ -25,4 +25,128 @@
 #ifndef TASKS_H
 #define TASKS_H
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+
+#include "global.h"
+
+// All application tasks and RTOS objects are statically allocated from the tables below.
+// main/CMakeLists.txt parses APP_TASK_TABLE to print the RAM budget at configure time.
+
+// Network-facing work shares the protocol core with the WiFi (23), event loop (20), LwIP (18)
+// and MQTT client (5) tasks. Sensor and control work runs on the application core so a busy
+// uplink never delays a PIR edge.
+#define APP_CORE_PROTOCOL PRO_CPU_NUM
+#if portNUM_PROCESSORS > 1
+#define APP_CORE_APPLICATION APP_CPU_NUM
+#else
+#define APP_CORE_APPLICATION PRO_CPU_NUM
+#endif
+
+// Priorities:
+//   10 device control: edge to state change latency
+//    9 latency benchmark stimulus, benchmark builds only
+//    5 datalink event loop and MQTT uplink: below the IDF network tasks they feed
+//    4 Azure IoT loop and benchmark uplink load
+//    3 HTTP diagnostics server
+//    2 LED animation
+//    1 boot worker, sleep log flush and deferred log drain, same as the main task
+// esp_http_server creates its task itself, so it can't come from the table below
+#define APP_HTTP_SERVER_STACK_SIZE 4096
+#define APP_HTTP_SERVER_PRIORITY 3
+#define APP_HTTP_SERVER_CORE APP_CORE_PROTOCOL
+
+// X(id, name, stack size in bytes, priority, core)
+#define APP_TASK_TABLE(X)                                                          \
+    X(APP_TASK_LED, "task_led_control_1", 1024, 2, APP_CORE_APPLICATION)          \
+    X(APP_TASK_DEVICE_CONTROL, "device_control_task", 4096, 10, APP_CORE_APPLICATION) \
+    X(APP_TASK_DATALINK, "datalink_event_loop", 4096, 5, APP_CORE_PROTOCOL)       \
+    X(APP_TASK_MQTT_UPLINK, "mqtt_uplink", 3072, 5, APP_CORE_PROTOCOL)            \
+    X(APP_TASK_AZIOT, "aziot_loop_task", 8192, 4, APP_CORE_PROTOCOL)              \
+    X(APP_TASK_SLEEP_LOG_FLUSH, "sleep_log_flush", 2048, 1, tskNO_AFFINITY)       \
+    X(APP_TASK_BOOT_WORKER, "boot_worker", 4096, 1, APP_CORE_APPLICATION)         \
+    X(APP_TASK_APPLOG, "applog_drain", 3072, 1, APP_CORE_PROTOCOL)                \
+    APP_TASK_TABLE_LATENCY_BENCHMARK(X)                                          \
+    APP_TASK_TABLE_TRACE_REPLAY(X)                                               \
+    APP_TASK_TABLE_FLEET_SIM(X)                                                  \
+    APP_TASK_TABLE_MICROBENCH(X)
+
+#if LATENCY_BENCHMARK_ENABLED
+#define APP_TASK_TABLE_LATENCY_BENCHMARK(X)                                        \
+    X(APP_TASK_LATENCY_BENCHMARK, "latency_bench", 2048, 9, APP_CORE_APPLICATION) \
+    X(APP_TASK_UPLINK_LOAD, "uplink_load", 4096, 4, APP_CORE_PROTOCOL)
+#else
+#define APP_TASK_TABLE_LATENCY_BENCHMARK(X)
+#endif
+
+#if TRACE_REPLAY_ENABLED
+#define APP_TASK_TABLE_TRACE_REPLAY(X) \
+    X(APP_TASK_TRACE_REPLAY, "trace_replay", 3072, 9, APP_CORE_APPLICATION)
+#else
+#define APP_TASK_TABLE_TRACE_REPLAY(X)
+#endif
+
+#if FLEET_SIM_ENABLED
+#define APP_TASK_TABLE_FLEET_SIM(X) \
+    X(APP_TASK_FLEET_SIM, "fleet_sim", 3072, 4, APP_CORE_PROTOCOL)
+#else
+#define APP_TASK_TABLE_FLEET_SIM(X)
+#endif
+
+#if MICROBENCH_ENABLED
+#define APP_TASK_TABLE_MICROBENCH(X) \
+    X(APP_TASK_MICROBENCH, "microbench", 4096, 9, APP_CORE_APPLICATION)
+#else
+#define APP_TASK_TABLE_MICROBENCH(X)
+#endif
+
+#define APP_EVENT_GROUP_TABLE(X) \
+    X(APP_EVENT_GROUP_LED)       \
+    X(APP_EVENT_GROUP_WIFI)      \
+    X(APP_EVENT_GROUP_BOOT)
+
+#define APP_TIMER_TABLE(X)                   \
+    X(APP_TIMER_BODY_DETECTION_GRACE_PERIOD) \
+    X(APP_TIMER_OVERSTAY_CHECK)
+
+// ready and space semaphore per event bus subscriber, metrics snapshot lock, MQTT uplink wakeup
+#define APP_BINARY_SEMAPHORE_COUNT (EVENTBUS_MAX_SUBSCRIBERS * 2 + 2)
+
+typedef enum app_task_t {
+#define X(id, name, stack, priority, core) id,
+    APP_TASK_TABLE(X)
+#undef X
+    APP_TASK_COUNT
+} app_task;
+
+typedef enum app_event_group_t {
+#define X(id) id,
+    APP_EVENT_GROUP_TABLE(X)
+#undef X
+    APP_EVENT_GROUP_COUNT
+} app_event_group;
+
+typedef enum app_timer_t {
+#define X(id) id,
+    APP_TIMER_TABLE(X)
+#undef X
+    APP_TIMER_COUNT
+} app_timer;
+
+TaskHandle_t app_task_start(app_task task, TaskFunction_t function, void* arg);
+// Deletes the calling task, which must be the given one
+void app_task_exit(app_task task);
+EventGroupHandle_t app_event_group_create(app_event_group group);
+TimerHandle_t app_timer_create(app_timer timer, const char* name, TickType_t period, UBaseType_t auto_reload, TimerCallbackFunction_t callback);
+SemaphoreHandle_t app_binary_semaphore_create(void);
+
+const char* app_task_get_name(app_task task);
+uint32_t app_task_get_stack_size(app_task task);
+// Returns 0 if the task is not running
+UBaseType_t app_task_get_stack_high_water_mark(app_task task);
+void app_tasks_log_ram_budget(void);
+
 #endif // TASKS_H
@@ -26,8 +26,11 @@
 #include <sys/time.h>
 #include <time.h>
 
+#include "freertos/FreeRTOS.h"
+
 #include "esp_log.h"
 #include "esp_sntp.h"
+#include "esp_timer.h"
 
 #include "global.h"
 
@@ -35,6 +38,32 @@
 
 static bool _is_time_set = false;
 static bool _timeman_started = false;
+static int64_t _epoch_offset_us;
+static portMUX_TYPE _epoch_offset_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static int64_t timeman_set_epoch_offset(const struct timeval* tv)
+{
+    int64_t offset = (int64_t)tv->tv_sec * 1000000 + tv->tv_usec - esp_timer_get_time();
+    portENTER_CRITICAL(&_epoch_offset_lock);
+    _epoch_offset_us = offset;
+    portEXIT_CRITICAL(&_epoch_offset_lock);
+    return offset;
+}
+
+int64_t timeman_get_epoch_offset_us(void)
+{
+    portENTER_CRITICAL(&_epoch_offset_lock);
+    int64_t offset = _epoch_offset_us;
+    portEXIT_CRITICAL(&_epoch_offset_lock);
+
+    // time set some other way than SNTP, e.g. kept across deep sleep
+    if (offset == 0 && timeman_is_time_set()) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        offset = timeman_set_epoch_offset(&tv);
+    }
+    return offset;
+}
 
 bool timeman_is_time_set()
 {
@@ -72,6 +101,7 @@ static void time_sync_notification_cb(struct timeval* tv)
         time(&now);
         localtime_r(&now, &timeinfo);
         timeman_is_time_set();
+        timeman_set_epoch_offset(tv);
         ESP_LOGI(LOG_TAG_TIMEMAN, "system time synced: %d-%02d-%02d %02d:%02d:%02d",
             timeinfo.tm_year + 1900, timeinfo.tm_mon + 1, timeinfo.tm_mday, timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec);
         break;
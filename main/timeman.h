@@ -25,7 +25,12 @@
 #ifndef TIMEMAN_H
 #define TIMEMAN_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 bool timeman_is_time_set();
+// Wall clock minus esp_timer time in microseconds, refreshed on every SNTP sync. 0 until time is set
+int64_t timeman_get_epoch_offset_us(void);
 void timeman_start();
 
 #endif
\ No newline at end of file
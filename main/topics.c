@@ -0,0 +1,160 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "nvs.h"
+
+#include "global.h"
+
+#include "topics.h"
+
+#define NVS_KEY_DEVICE_ID "devid"
+#define NVS_KEY_SITE "site"
+#define NVS_KEY_GROUP "group"
+
+// segments are bounded, so topics can't be truncated
+_Static_assert(sizeof(MQTT_TOPIC_ROOT) + 3 * (MQTT_TOPIC_SEGMENT_MAX_LEN + 1) + sizeof("/c/#") <= MQTT_TOPIC_MAX_LEN,
+    "MQTT_TOPIC_MAX_LEN too small");
+
+typedef struct topics_config_t {
+    char device_id[MQTT_TOPIC_SEGMENT_MAX_LEN + 1];
+    char site[MQTT_TOPIC_SEGMENT_MAX_LEN + 1];
+    char group[MQTT_TOPIC_SEGMENT_MAX_LEN + 1];
+
+    char uplink[TOPICS_UPLINK_COUNT][MQTT_TOPIC_MAX_LEN];
+    char config_prefix[TOPICS_SCOPE_COUNT][MQTT_TOPIC_MAX_LEN]; // up to and including "/c/"
+    int config_prefix_len[TOPICS_SCOPE_COUNT];
+    char config_subscription[TOPICS_SCOPE_COUNT][MQTT_TOPIC_MAX_LEN];
+} topics_config;
+
+static topics_config _config;
+
+static const char* const _uplink_suffixes[TOPICS_UPLINK_COUNT] = {
+    [TOPICS_UPLINK_BODY_DETECTION] = MQTT_BODY_DETECTION_PUBLISH_TOPIC,
+    [TOPICS_UPLINK_SESSION] = MQTT_SESSION_PUBLISH_TOPIC,
+    [TOPICS_UPLINK_TELEMETRY] = MQTT_TELEMETRY_PUBLISH_TOPIC,
+    [TOPICS_UPLINK_LOAD_TEST] = MQTT_LOAD_TEST_PUBLISH_TOPIC,
+    [TOPICS_UPLINK_SESSION_SUMMARY] = MQTT_SESSION_SUMMARY_PUBLISH_TOPIC,
+    [TOPICS_UPLINK_HISTORY_REPLY] = MQTT_HISTORY_REPLY_PUBLISH_TOPIC,
+    [TOPICS_UPLINK_ALERT] = MQTT_ALERT_PUBLISH_TOPIC,
+};
+
+static bool topics_is_valid_segment(const char* segment)
+{
+    if (segment[0] == 0 || strcmp(segment, MQTT_TOPIC_ALL) == 0) {
+        return false;
+    }
+    return strpbrk(segment, "/+#") == NULL;
+}
+
+static void topics_read_segment(nvs_handle handle, bool opened, const char* key, char* segment, const char* fallback)
+{
+    size_t len = MQTT_TOPIC_SEGMENT_MAX_LEN + 1;
+    if (opened && nvs_get_str(handle, key, segment, &len) == ESP_OK) {
+        if (topics_is_valid_segment(segment)) {
+            return;
+        }
+        ESP_LOGE(LOG_TAG_TOPICS, "invalid %s provisioned: %s", key, segment);
+    }
+    strcpy(segment, fallback);
+}
+
+static void topics_build_scope(topics_scope scope, const char* site, const char* group, const char* device)
+{
+    _config.config_prefix_len[scope] = snprintf(_config.config_prefix[scope], MQTT_TOPIC_MAX_LEN,
+        MQTT_TOPIC_ROOT "/%s/%s/%s/c/", site, group, device);
+    snprintf(_config.config_subscription[scope], MQTT_TOPIC_MAX_LEN, "%s#", _config.config_prefix[scope]);
+}
+
+void init_topics(void)
+{
+    char mac_id[13];
+    uint8_t mac[6];
+    ESP_ERROR_CHECK(esp_read_mac(mac, ESP_MAC_WIFI_STA));
+    snprintf(mac_id, sizeof mac_id, "%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+
+    // namespace shared with device control config, it may not exist yet on a fresh device
+    nvs_handle handle;
+    bool opened = nvs_open("config", NVS_READONLY, &handle) == ESP_OK;
+    topics_read_segment(handle, opened, NVS_KEY_DEVICE_ID, _config.device_id, mac_id);
+    topics_read_segment(handle, opened, NVS_KEY_SITE, _config.site, MQTT_TOPIC_DEFAULT_SITE);
+    topics_read_segment(handle, opened, NVS_KEY_GROUP, _config.group, MQTT_TOPIC_DEFAULT_GROUP);
+    if (opened) {
+        nvs_close(handle);
+    }
+
+    for (int i = 0; i < TOPICS_UPLINK_COUNT; ++i) {
+        snprintf(_config.uplink[i], MQTT_TOPIC_MAX_LEN, MQTT_TOPIC_ROOT "/%s/%s/%s/s/%s",
+            _config.site, _config.group, _config.device_id, _uplink_suffixes[i]);
+    }
+
+    topics_build_scope(TOPICS_SCOPE_DEVICE, _config.site, _config.group, _config.device_id);
+    topics_build_scope(TOPICS_SCOPE_GROUP, _config.site, _config.group, MQTT_TOPIC_ALL);
+    topics_build_scope(TOPICS_SCOPE_SITE, _config.site, MQTT_TOPIC_ALL, MQTT_TOPIC_ALL);
+    topics_build_scope(TOPICS_SCOPE_FLEET, MQTT_TOPIC_ALL, MQTT_TOPIC_ALL, MQTT_TOPIC_ALL);
+
+    ESP_LOGI(LOG_TAG_TOPICS, "device %s, site %s, group %s", _config.device_id, _config.site, _config.group);
+}
+
+const char* topics_get_device_id(void)
+{
+    return _config.device_id;
+}
+
+const char* topics_get_site(void)
+{
+    return _config.site;
+}
+
+const char* topics_get_group(void)
+{
+    return _config.group;
+}
+
+const char* topics_get_uplink(topics_uplink uplink)
+{
+    return _config.uplink[uplink];
+}
+
+const char* topics_get_config_subscription(topics_scope scope)
+{
+    return _config.config_subscription[scope];
+}
+
+const char* topics_match_config(const char* topic, int topic_len, int* suffix_len, topics_scope* scope)
+{
+    for (int i = 0; i < TOPICS_SCOPE_COUNT; ++i) {
+        int prefix_len = _config.config_prefix_len[i];
+        if (topic_len > prefix_len && memcmp(topic, _config.config_prefix[i], prefix_len) == 0) {
+            *suffix_len = topic_len - prefix_len;
+            *scope = (topics_scope)i;
+            return topic + prefix_len;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,65 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#ifndef TOPICS_H
+#define TOPICS_H
+
+#include <stddef.h>
+
+// Broadest last. Config on a narrower scope is not merged with broader ones, whichever
+// arrives last wins
+typedef enum topics_scope_t {
+    TOPICS_SCOPE_DEVICE,
+    TOPICS_SCOPE_GROUP,
+    TOPICS_SCOPE_SITE,
+    TOPICS_SCOPE_FLEET,
+    TOPICS_SCOPE_COUNT
+} topics_scope;
+
+typedef enum topics_uplink_t {
+    TOPICS_UPLINK_BODY_DETECTION,
+    TOPICS_UPLINK_SESSION,
+    TOPICS_UPLINK_TELEMETRY,
+    TOPICS_UPLINK_LOAD_TEST,
+    TOPICS_UPLINK_SESSION_SUMMARY,
+    TOPICS_UPLINK_HISTORY_REPLY,
+    TOPICS_UPLINK_ALERT,
+    TOPICS_UPLINK_COUNT
+} topics_uplink;
+
+// Needs NVS
+void init_topics(void);
+
+const char* topics_get_device_id(void);
+const char* topics_get_site(void);
+const char* topics_get_group(void);
+
+const char* topics_get_uplink(topics_uplink uplink);
+const char* topics_get_config_subscription(topics_scope scope);
+
+// If the topic is config addressed to this device at any scope, returns the part after
+// ".../c/" and its length. NULL otherwise
+const char* topics_match_config(const char* topic, int topic_len, int* suffix_len, topics_scope* scope);
+
+#endif
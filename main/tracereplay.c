@@ -0,0 +1,225 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "global.h"
+
+#include "bodydetection.h"
+#include "devicecontrollogic.h"
+#include "tasks.h"
+#include "tracereplay.h"
+
+#if TRACE_REPLAY_ENABLED
+
+typedef struct trace_edge_t {
+    uint32_t at_ms; // since the start of the trace
+    int level; // body detected
+} trace_edge;
+
+typedef struct trace_session_t {
+    uint32_t start_second; // since the start of the trace
+    uint32_t elapsed_second;
+} trace_session;
+
+typedef struct trace_t {
+    const char* name;
+    unsigned int grace_period_seconds; // the capture's, the device has to be configured the same
+    const trace_edge* edges;
+    size_t edge_count;
+    const trace_session* expected;
+    size_t expected_count;
+} trace;
+
+// Field captures go here in the same form, with the sessions the backend recorded for them
+static const trace_edge _merge_and_flicker_edges[] = {
+    { 1000, 1 }, { 5000, 0 }, { 8000, 1 }, { 20000, 0 }, // back within the grace period, one session
+    { 60000, 1 }, { 75000, 0 },
+    { 100000, 1 }, { 100400, 0 }, { 100800, 1 }, { 101200, 0 }, // PIR flicker
+    { 120000, 1 }, { 130000, 0 }, { 136000, 1 }, { 140000, 0 }, // back just after the grace period, two sessions
+};
+
+static const trace_session _merge_and_flicker_sessions[] = {
+    { 1, 24 },
+    { 60, 20 },
+    { 100, 6 },
+    { 120, 15 },
+    { 136, 9 },
+};
+
+#define TRACE(name, grace, edges, sessions) \
+    { name, grace, edges, sizeof(edges) / sizeof(edges[0]), sessions, sizeof(sessions) / sizeof(sessions[0]) }
+
+static const trace _traces[] = {
+    TRACE("merge_and_flicker", 5, _merge_and_flicker_edges, _merge_and_flicker_sessions),
+};
+
+typedef struct trace_replay_state_t {
+    portMUX_TYPE lock;
+    volatile int64_t started_us;
+    trace_session sessions[TRACE_REPLAY_MAX_SESSIONS];
+    size_t session_count;
+} trace_replay_state;
+
+static trace_replay_state _state = {
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+int64_t trace_replay_monotonic_us(int64_t timer_us)
+{
+    return (timer_us - _state.started_us) * TRACE_REPLAY_SPEEDUP;
+}
+
+void trace_replay_record_session(uint64_t start_epoch_second, uint64_t elapsed_second)
+{
+    portENTER_CRITICAL(&_state.lock);
+    if (_state.session_count < TRACE_REPLAY_MAX_SESSIONS) {
+        trace_session* session = &_state.sessions[_state.session_count++];
+        session->start_second = (uint32_t)(start_epoch_second - TRACE_REPLAY_EPOCH);
+        session->elapsed_second = (uint32_t)elapsed_second;
+    }
+    portEXIT_CRITICAL(&_state.lock);
+}
+
+// Run time of the tasks a session passes through, in run time stats ticks (microseconds)
+static uint32_t pipeline_runtime(void)
+{
+    static TaskStatus_t task_status[METRICS_MAX_TASKS];
+    const char* device_control = app_task_get_name(APP_TASK_DEVICE_CONTROL);
+    const char* datalink = app_task_get_name(APP_TASK_DATALINK);
+
+    uint32_t total = 0;
+    UBaseType_t count = uxTaskGetSystemState(task_status, METRICS_MAX_TASKS, NULL);
+    for (UBaseType_t i = 0; i < count; ++i) {
+        if (strcmp(task_status[i].pcTaskName, device_control) == 0 || strcmp(task_status[i].pcTaskName, datalink) == 0) {
+            total += task_status[i].ulRunTimeCounter;
+        }
+    }
+    return total;
+}
+
+static bool session_matches(const trace_session* actual, const trace_session* expected)
+{
+    return abs((int)actual->start_second - (int)expected->start_second) <= TRACE_REPLAY_TOLERANCE_SECONDS
+        && abs((int)actual->elapsed_second - (int)expected->elapsed_second) <= TRACE_REPLAY_TOLERANCE_SECONDS;
+}
+
+static bool trace_replay_run(const trace* t)
+{
+    unsigned int grace_period = device_control_get_body_detection_grace_period();
+    if (grace_period != t->grace_period_seconds) {
+        ESP_LOGE(LOG_TAG_BENCHMARK, "%s: FAIL, captured with a %us grace period, device configured for %us",
+            t->name, t->grace_period_seconds, grace_period);
+        return false;
+    }
+
+    portENTER_CRITICAL(&_state.lock);
+    _state.session_count = 0;
+    portEXIT_CRITICAL(&_state.lock);
+    device_control_reset_edge_latency();
+    uint32_t runtime = pipeline_runtime();
+
+    // virtual time starts now, edges are due at their offset scaled down to real time
+    _state.started_us = esp_timer_get_time();
+    TickType_t start = xTaskGetTickCount();
+    for (size_t i = 0; i < t->edge_count; ++i) {
+        TickType_t due = start + t->edges[i].at_ms / TRACE_REPLAY_SPEEDUP / portTICK_PERIOD_MS;
+        TickType_t now = xTaskGetTickCount();
+        if ((int32_t)(due - now) > 0) {
+            vTaskDelay(due - now);
+        }
+        body_detection_inject(t->edges[i].level);
+    }
+
+    // the last session ends a grace period after the last edge
+    vTaskDelay(((grace_period + 2 * TRACE_REPLAY_TOLERANCE_SECONDS) * 1000 / TRACE_REPLAY_SPEEDUP) / portTICK_PERIOD_MS);
+    runtime = pipeline_runtime() - runtime;
+
+    portENTER_CRITICAL(&_state.lock);
+    size_t session_count = _state.session_count;
+    portEXIT_CRITICAL(&_state.lock);
+
+    bool pass = session_count == t->expected_count;
+    for (size_t i = 0; i < session_count && i < t->expected_count; ++i) {
+        if (!session_matches(&_state.sessions[i], &t->expected[i])) {
+            ESP_LOGE(LOG_TAG_BENCHMARK, "%s: session %u is %us+%us, expected %us+%us", t->name, i,
+                _state.sessions[i].start_second, _state.sessions[i].elapsed_second,
+                t->expected[i].start_second, t->expected[i].elapsed_second);
+            pass = false;
+        }
+    }
+
+    device_control_latency_stats latency;
+    device_control_get_edge_latency(&latency);
+    ESP_LOGI(LOG_TAG_BENCHMARK, "%s: %u/%u sessions, %u/%u edges, cpu %uus per edge, latency p50 <=%lldus, max %lldus",
+        t->name, session_count, t->expected_count, latency.count, t->edge_count,
+        runtime / t->edge_count, device_control_latency_percentile(&latency, 50), latency.max_us);
+    ESP_LOGI(LOG_TAG_BENCHMARK, "%s: %s", t->name, pass ? "PASS" : "FAIL");
+    return pass;
+}
+
+static void trace_replay_task(void* arg)
+{
+    UNUSED(arg);
+    size_t passed = 0;
+    for (size_t i = 0; i < sizeof(_traces) / sizeof(_traces[0]); ++i) {
+        passed += trace_replay_run(&_traces[i]);
+    }
+    ESP_LOGI(LOG_TAG_BENCHMARK, "trace replay done, %u/%u traces passed", passed, sizeof(_traces) / sizeof(_traces[0]));
+    app_task_exit(APP_TASK_TRACE_REPLAY);
+}
+
+void start_trace_replay(void)
+{
+    ESP_LOGW(LOG_TAG_BENCHMARK, "trace replay enabled, the PIR sensor is ignored and time runs %dx", TRACE_REPLAY_SPEEDUP);
+    app_task_start(APP_TASK_TRACE_REPLAY, trace_replay_task, NULL);
+}
+
+#else
+
+void start_trace_replay(void)
+{
+}
+
+int64_t trace_replay_monotonic_us(int64_t timer_us)
+{
+    return timer_us;
+}
+
+void trace_replay_record_session(uint64_t start_epoch_second, uint64_t elapsed_second)
+{
+    UNUSED(start_epoch_second);
+    UNUSED(elapsed_second);
+}
+
+#endif // TRACE_REPLAY_ENABLED
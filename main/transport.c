@@ -0,0 +1,463 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "global.h"
+
+#include "applog.h"
+#include "transport.h"
+
+#define TRANSPORT_BATCH_MAX TRANSPORT_LANE_SESSION_BATCH
+
+typedef struct transport_lane_config_t {
+    const char* name;
+    size_t depth; // up to TRANSPORT_QUEUE_DEPTH
+    uint32_t weight; // sends per round while other weighted lanes wait, 0 if not weighted
+    size_t batch; // messages per send, up to TRANSPORT_BATCH_MAX
+} transport_lane_config;
+
+static const transport_lane_config _lane_config[TRANSPORT_LANE_COUNT] = {
+    [TRANSPORT_LANE_URGENT] = { "urgent", TRANSPORT_QUEUE_DEPTH, 0, 1 },
+    [TRANSPORT_LANE_SESSION] = { "session", TRANSPORT_QUEUE_DEPTH, TRANSPORT_LANE_SESSION_WEIGHT, TRANSPORT_LANE_SESSION_BATCH },
+    [TRANSPORT_LANE_BULK] = { "bulk", TRANSPORT_QUEUE_DEPTH, TRANSPORT_LANE_BULK_WEIGHT, 1 },
+    [TRANSPORT_LANE_STATUS] = { "status", 1, 0, 1 }, // coalesced
+};
+
+typedef struct transport_queue_t {
+    transport_message* slots[TRANSPORT_QUEUE_DEPTH];
+    size_t head;
+    size_t count;
+    uint32_t credit; // left in this round
+    uint32_t sent;
+    uint32_t dropped;
+    uint32_t latency_last_ms;
+    uint32_t latency_max_ms;
+    uint64_t latency_total_ms;
+} transport_queue;
+
+typedef struct transport_t {
+    const transport_ops* ops;
+    bool enabled;
+    void (*notify)(void);
+
+    transport_queue lanes[TRANSPORT_LANE_COUNT];
+    size_t count; // all lanes
+    size_t high_water_mark;
+
+    uint32_t sent;
+    uint32_t dropped;
+    uint32_t failed;
+    int64_t failed_last_us; // send refused or not confirmed, 0 if never
+    int64_t window_full_since_us; // 0 while the window has room
+
+    uint32_t connects;
+    uint32_t connect_last_ms;
+    uint32_t connect_max_ms;
+} transport;
+
+static portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+static transport _transports[TRANSPORT_COUNT];
+
+void transport_register(transport_id id, const transport_ops* ops, bool enabled, void (*notify)(void))
+{
+    transport* t = &_transports[id];
+    t->ops = ops;
+    t->enabled = enabled;
+    t->notify = notify;
+}
+
+transport_message* transport_message_create_prefixed(topics_uplink uplink, const char* prefix, int prefix_len, const char* data, int len)
+{
+    transport_message* message = malloc(sizeof(transport_message) + prefix_len + len + 1);
+    if (message == NULL) {
+        ESP_LOGE(LOG_TAG_TRANSPORT, "no memory for a %d byte message", prefix_len + len);
+        return NULL;
+    }
+    atomic_init(&message->refcount, 1);
+    message->uplink = uplink;
+    message->created_us = esp_timer_get_time();
+    message->on_delivered = NULL;
+    message->delivered_context = NULL;
+    message->parts = NULL;
+    message->part_count = 0;
+    message->len = prefix_len + len;
+    memcpy(message->data, prefix, prefix_len);
+    memcpy(message->data + prefix_len, data, len);
+    message->data[message->len] = 0;
+    return message;
+}
+
+transport_message* transport_message_create(topics_uplink uplink, const char* data, int len)
+{
+    return transport_message_create_prefixed(uplink, NULL, 0, data, len);
+}
+
+void transport_message_retain(transport_message* message)
+{
+    atomic_fetch_add(&message->refcount, 1);
+}
+
+void transport_message_release(transport_message* message)
+{
+    if (atomic_fetch_sub(&message->refcount, 1) == 1) {
+        for (size_t i = 0; i < message->part_count; ++i) {
+            transport_message_release(message->parts[i]);
+        }
+        free(message);
+    }
+}
+
+bool transport_message_is_awaited(const transport_message* message)
+{
+    if (message->on_delivered != NULL) {
+        return true;
+    }
+    for (size_t i = 0; i < message->part_count; ++i) {
+        if (message->parts[i]->on_delivered != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void transport_message_delivered(const transport_message* message)
+{
+    if (message->on_delivered != NULL) {
+        message->on_delivered(message->delivered_context);
+    }
+    for (size_t i = 0; i < message->part_count; ++i) {
+        transport_message_delivered(message->parts[i]);
+    }
+}
+
+// "[a,b,...]" out of JSON objects, taking over the references to parts. NULL if out of memory,
+// the references stay with the caller then
+static transport_message* transport_message_batch(transport_message** parts, size_t count)
+{
+    int len = 1;
+    for (size_t i = 0; i < count; ++i) {
+        len += parts[i]->len + 1;
+    }
+    // the part list goes after the text, aligned
+    size_t parts_offset = (sizeof(transport_message) + len + 1 + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    transport_message* batch = malloc(parts_offset + count * sizeof(transport_message*));
+    if (batch == NULL) {
+        ESP_LOGE(LOG_TAG_TRANSPORT, "no memory to batch %u messages", count);
+        return NULL;
+    }
+    atomic_init(&batch->refcount, 1);
+    batch->uplink = parts[0]->uplink;
+    batch->created_us = parts[0]->created_us; // the oldest, queues are FIFO
+    batch->on_delivered = NULL;
+    batch->delivered_context = NULL;
+    batch->parts = (transport_message**)((char*)batch + parts_offset);
+    batch->part_count = count;
+    char* p = batch->data;
+    for (size_t i = 0; i < count; ++i) {
+        *p++ = i ? ',' : '[';
+        memcpy(p, parts[i]->data, parts[i]->len);
+        p += parts[i]->len;
+        batch->parts[i] = parts[i];
+    }
+    *p++ = ']';
+    *p = 0;
+    batch->len = len;
+    return batch;
+}
+
+// Under the lock
+static transport_message* transport_queue_pop(transport* t, transport_lane lane)
+{
+    transport_queue* q = &t->lanes[lane];
+    transport_message* message = q->slots[q->head];
+    q->head = (q->head + 1) % TRANSPORT_QUEUE_DEPTH;
+    --q->count;
+    --t->count;
+    return message;
+}
+
+void transport_enqueue(transport_id id, transport_lane lane, transport_message* message)
+{
+    transport* t = &_transports[id];
+    if (!t->enabled) {
+        return;
+    }
+
+    atomic_fetch_add(&message->refcount, 1);
+    transport_message* evicted = NULL;
+    transport_queue* q = &t->lanes[lane];
+
+    portENTER_CRITICAL(&_lock);
+    if (q->count == _lane_config[lane].depth) {
+        evicted = transport_queue_pop(t, lane);
+        ++q->dropped;
+        ++t->dropped;
+    }
+    q->slots[(q->head + q->count) % TRANSPORT_QUEUE_DEPTH] = message;
+    ++q->count;
+    ++t->count;
+    if (t->count > t->high_water_mark) {
+        t->high_water_mark = t->count;
+    }
+    portEXIT_CRITICAL(&_lock);
+
+    if (evicted != NULL) {
+        transport_message_release(evicted);
+        if (lane != TRANSPORT_LANE_STATUS) {
+            APPLOG_W(LOG_TAG_TRANSPORT, "%s %s lane full, oldest message dropped",
+                (uint32_t)(uintptr_t)t->ops->name, (uint32_t)(uintptr_t)_lane_config[lane].name);
+        }
+    }
+    if (t->notify != NULL) {
+        t->notify();
+    }
+}
+
+// Under the lock. Urgent first, then weighted round robin over the weighted lanes that have
+// something queued, the rest only when those are empty. TRANSPORT_LANE_COUNT if all are empty
+static transport_lane transport_schedule(transport* t)
+{
+    if (t->lanes[TRANSPORT_LANE_URGENT].count > 0) {
+        return TRANSPORT_LANE_URGENT;
+    }
+
+    for (int round = 0; round < 2; ++round) {
+        bool waiting = false;
+        for (transport_lane lane = 0; lane < TRANSPORT_LANE_COUNT; ++lane) {
+            transport_queue* q = &t->lanes[lane];
+            if (_lane_config[lane].weight == 0 || q->count == 0) {
+                continue;
+            }
+            waiting = true;
+            if (q->credit > 0) {
+                --q->credit;
+                return lane;
+            }
+        }
+        if (!waiting) {
+            break;
+        }
+        // every waiting lane used up its share, start a new round
+        for (transport_lane lane = 0; lane < TRANSPORT_LANE_COUNT; ++lane) {
+            t->lanes[lane].credit = _lane_config[lane].weight;
+        }
+    }
+
+    for (transport_lane lane = 0; lane < TRANSPORT_LANE_COUNT; ++lane) {
+        if (_lane_config[lane].weight == 0 && t->lanes[lane].count > 0) {
+            return lane;
+        }
+    }
+    return TRANSPORT_LANE_COUNT;
+}
+
+// Only JSON objects go into a batch, it's sent as an array of them
+static bool transport_message_batchable(const transport_message* message)
+{
+    return message->len > 0 && message->data[0] == '{' && message->part_count == 0;
+}
+
+// Under the lock. Whether the message at the head of the lane can join the batch started by first
+static bool transport_can_batch(const transport_queue* q, const transport_message* first)
+{
+    if (q->count == 0) {
+        return false;
+    }
+    const transport_message* next = q->slots[q->head];
+    return next->uplink == first->uplink && transport_message_batchable(next);
+}
+
+// Sends and releases message, which stands for count queued ones
+static void transport_send(transport* t, transport_lane lane, transport_message* message, size_t count)
+{
+    bool sent = t->ops->send(message);
+    uint32_t latency_ms = (esp_timer_get_time() - message->created_us) / 1000;
+    portENTER_CRITICAL(&_lock);
+    if (sent) {
+        transport_queue* q = &t->lanes[lane];
+        q->sent += count;
+        q->latency_last_ms = latency_ms;
+        q->latency_max_ms = MAX(q->latency_max_ms, latency_ms);
+        q->latency_total_ms += (uint64_t)latency_ms * count;
+        t->sent += count;
+    } else {
+        t->failed += count;
+        t->failed_last_us = esp_timer_get_time();
+    }
+    portEXIT_CRITICAL(&_lock);
+    if (!sent) {
+        ESP_LOGE(LOG_TAG_TRANSPORT, "%s failed to send %u messages in %d bytes, dropped", t->ops->name, count, message->len);
+    }
+    transport_message_release(message);
+}
+
+void transport_pump(transport_id id)
+{
+    transport* t = &_transports[id];
+    if (!t->enabled) {
+        return;
+    }
+
+    for (;;) {
+        bool connected = t->ops->is_connected();
+        bool window_full = connected && t->ops->get_in_flight() >= t->ops->window;
+        transport_message* parts[TRANSPORT_BATCH_MAX];
+        size_t count = 0;
+        transport_lane lane = TRANSPORT_LANE_COUNT;
+
+        portENTER_CRITICAL(&_lock);
+        if (!window_full) {
+            t->window_full_since_us = 0;
+        } else if (t->window_full_since_us == 0) {
+            t->window_full_since_us = esp_timer_get_time();
+        }
+        if (connected && !window_full) {
+            lane = transport_schedule(t);
+        }
+        if (lane != TRANSPORT_LANE_COUNT) {
+            parts[count++] = transport_queue_pop(t, lane);
+            bool batchable = transport_message_batchable(parts[0]);
+            while (batchable && count < _lane_config[lane].batch && transport_can_batch(&t->lanes[lane], parts[0])) {
+                parts[count++] = transport_queue_pop(t, lane);
+            }
+        }
+        portEXIT_CRITICAL(&_lock);
+
+        if (count == 0) {
+            return;
+        }
+
+        transport_message* batch = count > 1 ? transport_message_batch(parts, count) : NULL;
+        if (batch != NULL) {
+            transport_send(t, lane, batch, count);
+            continue;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            transport_send(t, lane, parts[i], 1);
+        }
+    }
+}
+
+void transport_note_connected(transport_id id, int64_t connect_us)
+{
+    transport* t = &_transports[id];
+    uint32_t connect_ms = connect_us > 0 ? (uint32_t)(connect_us / 1000) : 0;
+
+    portENTER_CRITICAL(&_lock);
+    ++t->connects;
+    t->connect_last_ms = connect_ms;
+    if (connect_ms > t->connect_max_ms) {
+        t->connect_max_ms = connect_ms;
+    }
+    portEXIT_CRITICAL(&_lock);
+
+    ESP_LOGI(LOG_TAG_TRANSPORT, "%s connected in %u ms", transport_get_name(id), connect_ms);
+}
+
+void transport_note_failed(transport_id id)
+{
+    transport* t = &_transports[id];
+    portENTER_CRITICAL(&_lock);
+    ++t->failed;
+    t->failed_last_us = esp_timer_get_time();
+    portEXIT_CRITICAL(&_lock);
+}
+
+transport_health transport_get_health(transport_id id)
+{
+    transport* t = &_transports[id];
+    if (!t->enabled || !t->ops->is_connected()) {
+        return TRANSPORT_HEALTH_DOWN;
+    }
+
+    portENTER_CRITICAL(&_lock);
+    bool backed_up = t->count > TRANSPORT_QUEUE_DEPTH / 2;
+    int64_t window_full_since = t->window_full_since_us;
+    int64_t failed_last = t->failed_last_us;
+    portEXIT_CRITICAL(&_lock);
+
+    int64_t now = esp_timer_get_time();
+    bool stalled = window_full_since != 0 && now - window_full_since > TRANSPORT_STALL_MS * 1000LL;
+    bool failing = failed_last != 0 && now - failed_last < TRANSPORT_STALL_MS * 1000LL;
+    if (backed_up || stalled || failing) {
+        return TRANSPORT_HEALTH_DEGRADED;
+    }
+    return TRANSPORT_HEALTH_UP;
+}
+
+bool transport_is_enabled(transport_id id)
+{
+    return _transports[id].enabled;
+}
+
+bool transport_is_idle(transport_id id)
+{
+    transport* t = &_transports[id];
+    return !t->enabled || (t->count == 0 && t->ops->get_in_flight() == 0);
+}
+
+const char* transport_get_name(transport_id id)
+{
+    return _transports[id].ops != NULL ? _transports[id].ops->name : "";
+}
+
+const char* transport_get_lane_name(transport_lane lane)
+{
+    return _lane_config[lane].name;
+}
+
+void transport_get_stats(transport_id id, transport_stats* stats)
+{
+    transport* t = &_transports[id];
+    stats->health = transport_get_health(id);
+    stats->in_flight = t->enabled ? t->ops->get_in_flight() : 0;
+
+    portENTER_CRITICAL(&_lock);
+    stats->queued = t->count;
+    stats->high_water_mark = t->high_water_mark;
+    stats->sent = t->sent;
+    stats->dropped = t->dropped;
+    stats->failed = t->failed;
+    stats->connects = t->connects;
+    stats->connect_last_ms = t->connect_last_ms;
+    stats->connect_max_ms = t->connect_max_ms;
+    for (transport_lane lane = 0; lane < TRANSPORT_LANE_COUNT; ++lane) {
+        const transport_queue* q = &t->lanes[lane];
+        transport_lane_stats* lane_stats = &stats->lanes[lane];
+        lane_stats->queued = q->count;
+        lane_stats->sent = q->sent;
+        lane_stats->dropped = q->dropped;
+        lane_stats->latency_last_ms = q->latency_last_ms;
+        lane_stats->latency_max_ms = q->latency_max_ms;
+        lane_stats->latency_avg_ms = q->sent ? q->latency_total_ms / q->sent : 0;
+    }
+    portEXIT_CRITICAL(&_lock);
+}
@@ -0,0 +1,142 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "topics.h"
+
+typedef enum transport_id_t {
+    TRANSPORT_MQTT,
+    TRANSPORT_AZIOT,
+    TRANSPORT_COUNT
+} transport_id;
+
+// Each transport queues per lane. Urgent goes first, session and bulk share what's left by
+// weight, status only goes out when the rest are empty and keeps just the newest message
+typedef enum transport_lane_t {
+    TRANSPORT_LANE_URGENT,
+    TRANSPORT_LANE_SESSION,
+    TRANSPORT_LANE_BULK,
+    TRANSPORT_LANE_STATUS,
+    TRANSPORT_LANE_COUNT
+} transport_lane;
+
+typedef enum transport_health_t {
+    TRANSPORT_HEALTH_DOWN, // disabled or not connected
+    TRANSPORT_HEALTH_DEGRADED, // connected but backed up
+    TRANSPORT_HEALTH_UP,
+} transport_health;
+
+// Called from the transport's task once the broker or hub acknowledged the message. A message
+// queued on several transports is confirmed by each of them
+typedef void (*transport_delivered_fn)(void* context);
+
+// Formatted once, shared by every transport it's queued on
+typedef struct transport_message_t {
+    atomic_int refcount;
+    topics_uplink uplink; // MQTT topic, Azure ignores it
+    int64_t created_us; // lane latency runs from here to the send
+    transport_delivered_fn on_delivered; // NULL unless set before queueing
+    void* delivered_context;
+    // a batch holds a reference to each message it was built from, NULL otherwise
+    struct transport_message_t** parts;
+    size_t part_count;
+    int len;
+    char data[]; // terminated
+} transport_message;
+
+// Called from the transport's own task only. send may keep a reference to the message until
+// it's acknowledged, see transport_message_delivered
+typedef struct transport_ops_t {
+    const char* name;
+    size_t window; // sent but not confirmed
+    bool (*is_connected)(void);
+    size_t (*get_in_flight)(void);
+    bool (*send)(transport_message* message);
+} transport_ops;
+
+typedef struct transport_lane_stats_t {
+    size_t queued;
+    uint32_t sent;
+    uint32_t dropped; // evicted from a full lane, for status replaced by a newer one
+    uint32_t latency_last_ms;
+    uint32_t latency_max_ms;
+    uint32_t latency_avg_ms;
+} transport_lane_stats;
+
+typedef struct transport_stats_t {
+    transport_health health;
+    size_t queued; // all lanes
+    size_t high_water_mark;
+    size_t in_flight;
+    uint32_t sent;
+    uint32_t dropped; // evicted from a full queue
+    uint32_t failed; // rejected by the transport, dropped as well
+    uint32_t connects;
+    uint32_t connect_last_ms;
+    uint32_t connect_max_ms;
+    transport_lane_stats lanes[TRANSPORT_LANE_COUNT];
+} transport_stats;
+
+// notify is called after a message is queued, e.g. to wake the transport's task. May be NULL
+void transport_register(transport_id id, const transport_ops* ops, bool enabled, void (*notify)(void));
+
+// Returns NULL if out of memory. The caller holds one reference
+transport_message* transport_message_create(topics_uplink uplink, const char* data, int len);
+// Same, with prefix in front of data
+transport_message* transport_message_create_prefixed(topics_uplink uplink, const char* prefix, int prefix_len, const char* data, int len);
+void transport_message_retain(transport_message* message);
+void transport_message_release(transport_message* message);
+// Whether anybody waits on its acknowledgement, only then does a transport have to track it
+bool transport_message_is_awaited(const transport_message* message);
+// From the transport's task once acknowledged. Calls on_delivered of the message and of every
+// message batched into it
+void transport_message_delivered(const transport_message* message);
+
+// Takes its own reference, a full lane evicts its oldest message
+void transport_enqueue(transport_id id, transport_lane lane, transport_message* message);
+
+// Sends queued messages, lane by lane, while connected and within the window. Consecutive JSON
+// objects for the same uplink in a batching lane go out as one JSON array
+void transport_pump(transport_id id);
+
+// Connect latency as seen by the transport, see the callers for what it covers
+void transport_note_connected(transport_id id, int64_t connect_us);
+// A message the transport took but lost later, e.g. the hub didn't confirm it
+void transport_note_failed(transport_id id);
+
+transport_health transport_get_health(transport_id id);
+bool transport_is_enabled(transport_id id);
+bool transport_is_idle(transport_id id); // nothing queued or in flight
+const char* transport_get_name(transport_id id);
+const char* transport_get_lane_name(transport_lane lane);
+void transport_get_stats(transport_id id, transport_stats* stats);
+
+#endif
@@ -0,0 +1,100 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "global.h"
+
+#include "uplinkseq.h"
+
+#define NVS_NAMESPACE_UPLINKSEQ "uplinkseq"
+#define NVS_KEY_UPLINKSEQ_BOOT "boot"
+#define NVS_KEY_UPLINKSEQ_RESERVED "reserved"
+
+typedef struct uplinkseq_config_t {
+    nvs_handle nvs_handle;
+    uint32_t boot_id;
+    atomic_uint seq; // last one handed out
+    atomic_uint reserved; // persisted, nothing above it is handed out
+} uplinkseq_config;
+
+static uplinkseq_config _config;
+
+static void uplinkseq_reserve(uint32_t up_to)
+{
+    esp_err_t err = nvs_set_u32(_config.nvs_handle, NVS_KEY_UPLINKSEQ_RESERVED, up_to);
+    if (err == ESP_OK) {
+        err = nvs_commit(_config.nvs_handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(LOG_TAG_UPLINK_SEQ, "failed to reserve up to %u, not stamping past %u: %s",
+            up_to, atomic_load(&_config.reserved), esp_err_to_name(err));
+        return;
+    }
+    atomic_store(&_config.reserved, up_to);
+}
+
+void init_uplinkseq(void)
+{
+    ESP_ERROR_CHECK(nvs_open(NVS_NAMESPACE_UPLINKSEQ, NVS_READWRITE, &_config.nvs_handle));
+
+    uint32_t boot_id = 0;
+    nvs_get_u32(_config.nvs_handle, NVS_KEY_UPLINKSEQ_BOOT, &boot_id);
+    _config.boot_id = boot_id + 1;
+    nvs_set_u32(_config.nvs_handle, NVS_KEY_UPLINKSEQ_BOOT, _config.boot_id);
+
+    // whatever was reserved last boot may have gone out, carry on after it, block aligned
+    uint32_t reserved = 0;
+    nvs_get_u32(_config.nvs_handle, NVS_KEY_UPLINKSEQ_RESERVED, &reserved);
+    reserved += (UPLINKSEQ_RESERVE_BLOCK - reserved % UPLINKSEQ_RESERVE_BLOCK) % UPLINKSEQ_RESERVE_BLOCK;
+    atomic_init(&_config.seq, reserved);
+    atomic_init(&_config.reserved, reserved);
+    uplinkseq_reserve(reserved + UPLINKSEQ_RESERVE_BLOCK);
+
+    ESP_LOGI(LOG_TAG_UPLINK_SEQ, "boot id %u, sequence from %u", _config.boot_id, reserved + 1);
+}
+
+uint32_t uplinkseq_next(void)
+{
+    uint32_t seq = atomic_fetch_add(&_config.seq, 1) + 1;
+    // exactly one caller reaches the middle of the block, it reserves the block after while
+    // the rest of this one covers everybody else. After a failure the next middle retries
+    if (seq % UPLINKSEQ_RESERVE_BLOCK == UPLINKSEQ_RESERVE_BLOCK / 2) {
+        uplinkseq_reserve(seq - seq % UPLINKSEQ_RESERVE_BLOCK + 2 * UPLINKSEQ_RESERVE_BLOCK);
+    }
+    // a number that isn't persisted could repeat after a reboot
+    if (seq > atomic_load(&_config.reserved)) {
+        return 0;
+    }
+    return seq;
+}
+
+uint32_t uplinkseq_get_boot_id(void)
+{
+    return _config.boot_id;
+}
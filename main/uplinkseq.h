@@ -0,0 +1,44 @@
+// <BEGIN LICENSE>
+/*************************************************************************
+ * Copyright 2020 Afa Cheng <afa@afa.moe>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+ * THE SOFTWARE.
+ **************************************************************************/
+// <END LICENSE>
+
+#ifndef UPLINKSEQ_H
+#define UPLINKSEQ_H
+
+#include <stdint.h>
+
+// Sequence numbers for uplink events, so the backend can drop resends in O(1): an event is
+// a duplicate iff (device, seq) was seen before. seq survives reboots and never repeats;
+// boot counts the reboots, a seq gap within one boot means events were lost.
+// The next block of UPLINKSEQ_RESERVE_BLOCK numbers is persisted halfway through the current
+// one, so a reboot skips fewer than two blocks
+
+// Needs NVS. Counts this boot
+void init_uplinkseq(void);
+
+// Any task. 0 past the last persisted block, while reserving the next one fails, the event
+// then goes out unstamped
+uint32_t uplinkseq_next(void);
+uint32_t uplinkseq_get_boot_id(void);
+
+#endif // UPLINKSEQ_H
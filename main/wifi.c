@@ -40,6 +40,7 @@
 
 #include "devicecontrollogic.h"
 #include "status.h"
+#include "tasks.h"
 #include "wifi.h"
 
 /* FreeRTOS event group to signal when we are connected*/
@@ -49,6 +50,8 @@ const int WIFI_CONNECTED_BIT = BIT0;
 
 static int retry_count;
 static bool disconnect_instr;
+static uint32_t total_retry_count;
+static uint32_t disconnect_count;
 
 static void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
@@ -59,6 +62,7 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t e
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) { // disconnected
         xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT);
         __device_status.wifi_status = WIFI_STATUS_DISCONNECTED;
+        ++disconnect_count;
 
         const wifi_event_sta_disconnected_t *event = event_data;
         char ssid[33];
@@ -70,6 +74,7 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t e
 
         while (retry_count < WIFI_CONNECT_MAXIMUM_RETRY && !disconnect_instr) {
             ++retry_count;
+            ++total_retry_count;
             ESP_LOGI(LOG_TAG_WIFI, "WiFi reconnecting, retry %d...", retry_count);
             esp_wifi_connect();
         }
@@ -96,7 +101,7 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t e
 void init_wifi(void)
 {
     ESP_ERROR_CHECK(esp_netif_init());
-    wifi_event_group = xEventGroupCreate();
+    wifi_event_group = app_event_group_create(APP_EVENT_GROUP_WIFI);
 
     ESP_ERROR_CHECK(esp_event_loop_create_default());
     esp_netif_create_default_wifi_sta();
@@ -182,6 +187,15 @@ void set_wifi_security(wifi_security security, const uint8_t* ssid, size_t ssid_
     ESP_LOGI(LOG_TAG_WIFI, "WiFi security set");
 }
 
+void wifi_get_stats(wifi_stats* stats)
+{
+    wifi_ap_record_t apinfo = {};
+    stats->connected = esp_wifi_sta_get_ap_info(&apinfo) == ESP_OK;
+    stats->rssi = stats->connected ? apinfo.rssi : 0;
+    stats->retries = total_retry_count;
+    stats->disconnects = disconnect_count;
+}
+
 void reconnect_wifi()
 {
     disconnect_wifi();
@@ -25,6 +25,7 @@
 #ifndef WIFI_H
 #define WIFI_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "global.h"
@@ -36,11 +37,19 @@ typedef enum wifi_security_t {
     //    WIFI_SEC_WPA_WPA2_ENT,
 } wifi_security;
 
+typedef struct wifi_stats_t {
+    bool connected;
+    int8_t rssi; // dBm, 0 when not connected
+    uint32_t retries; // reconnect attempts since boot
+    uint32_t disconnects;
+} wifi_stats;
+
 void init_wifi(void);
 void start_wifi(void);
 void disconnect_wifi(void);
 void connect_wifi(void);
 void reconnect_wifi(void);
+void wifi_get_stats(wifi_stats* stats);
 void set_wifi_security(wifi_security security, const uint8_t *ssid, size_t ssid_len, const uint8_t *credentials, size_t credentials_len);
 
 #endif // WIFI_H